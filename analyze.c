@@ -1,20 +1,28 @@
 #include <assert.h>
-#include <stdlib.h>
-#include <string.h>
+#include <limits.h>
 #include "uoocc.h"
 
-Map *symbol_table;
+_Thread_local Map *symbol_table;
+
+// top level declarations are numbered in source order. A function body only
+// sees the entries of the declarations before it, even when the file scope
+// has been registered ahead of the bodies.
+static _Thread_local int decl_order = INT_MAX;
 
 static SymbolTableEntry *make_SymbolTableEntry(CType *ctype, int is_global) {
-  SymbolTableEntry *p = malloc(sizeof(SymbolTableEntry));
+  SymbolTableEntry *p = arena_alloc_tagged(&table_arena, MEM_SYMBOL,
+                                           sizeof(SymbolTableEntry));
   p->ctype = ctype;
   p->is_global = is_global;
   p->is_constant = 0;
+  p->decl_order = decl_order;
   return p;
 }
 
 static SymbolTableEntry *symboltable_get(Map *table, char *key) {
   MapEntry *e = map_get(table, key);
+  if (e != NULL && ((SymbolTableEntry *)e->val)->decl_order > decl_order)
+    e = NULL;  // declared later in the file
   if (e == NULL) {
     if (table->next == NULL)
       return NULL;
@@ -66,8 +74,12 @@ int sizeof_ctype(CType *ctype) {
     int now_offset = 0;
     for (int i = 0; i < list->size; i++) {
       StructMember *p = vector_at(list, i);
-      p->offset = calc_offset(p->ctype, now_offset);
-      now_offset = p->offset + sizeof_ctype(p->ctype);
+      // the file scope is laid out before the parallel analyses, which
+      // then find nothing to write
+      int offset = calc_offset(p->ctype, now_offset);
+      if (p->offset != offset)
+        p->offset = offset;
+      now_offset = offset + sizeof_ctype(p->ctype);
     }
     int mod = now_offset % max_size(ctype);
     return mod == 0 ? now_offset : now_offset + max_size(ctype) - mod;
@@ -75,7 +87,7 @@ int sizeof_ctype(CType *ctype) {
     assert(0);
 }
 
-int offset_from_bp;
+static _Thread_local int offset_from_bp;
 static int get_offset_from_bp(CType *ctype) {
   int stack_size = sizeof_ctype(ctype);
   if (stack_size == 1)
@@ -97,7 +109,7 @@ static int get_offset_from_bp(CType *ctype) {
 static Ast *array_to_ptr(Ast *p) {
   CType *ctype = p->ctype;
   if (ctype->type == TYPE_ARRAY) {
-    Ast *new = make_ast_op(AST_OP_REF, p, NULL, NULL);
+    Ast *new = make_ast_op(AST_OP_REF, p, NULL, p->token);
     return semantic_analysis(new);
   } else {
     return p;
@@ -111,9 +123,164 @@ static CType *char_to_int(CType *ctype) {
     return ctype;
 }
 
-static CType *update_ctype(CType *ctype, Token *token) {
+static int is_int(Ast *p, int val) {
+  return p != NULL && p->type == AST_INT && p->ival == val;
+}
+
+static int has_side_effects(Ast *p) {
+  if (p == NULL)
+    return 0;
+  switch (p->type) {
+    case AST_INT:
+    case AST_STR:
+    case AST_VAR:
+      return 0;
+    case AST_OP_ASSIGN:
+    case AST_OP_POST_INC:
+    case AST_OP_POST_DEC:
+    case AST_OP_PRE_INC:
+    case AST_OP_PRE_DEC:
+    case AST_CALL_FUNC:
+      return 1;
+    default:
+      return has_side_effects(p->left) || has_side_effects(p->right);
+  }
+}
+
+// p stands for its operand q when the type stays the same, a char operand
+// would not be promoted any more.
+static Ast *fold_to(Ast *p, Ast *q) {
+  return q->ctype->type == p->ctype->type ? q : p;
+}
+
+// tells an lvalue by its parsed form, x + 0 is folded to the lvalue x.
+static int is_lvalue(Ast *p) {
+  return p->type == AST_VAR || p->type == AST_OP_DEREF ||
+         p->type == AST_OP_DOT || p->type == AST_OP_ARROW ||
+         p->type == AST_SUBSCRIPT;
+}
+
+// folds an analyzed operator on constants, or applies an identity. The
+// generated code computes in 64 bits and divides unsigned, so results
+// which do not fit in an int and negative divisions are left to it.
+static Ast *fold(Ast *p) {
+  Ast *l = p->left;
+  Ast *r = p->right;
+  if (l->type == AST_INT && (r == NULL || r->type == AST_INT)) {
+    long a = l->ival;
+    long b = r != NULL ? r->ival : 0;
+    long v;
+    switch (p->type) {
+      case AST_OP_ADD:
+        v = a + b;
+        break;
+      case AST_OP_SUB:
+        v = a - b;
+        break;
+      case AST_OP_MUL:
+        v = a * b;
+        break;
+      case AST_OP_DIV:
+        if (a < 0 || b <= 0)
+          return p;
+        v = a / b;
+        break;
+      case AST_OP_LSHIFT:
+        if (b < 0 || b > 31)
+          return p;
+        v = (long)((unsigned long)a << b);
+        break;
+      case AST_OP_RSHIFT:
+        if (b < 0 || b > 63)
+          return p;
+        v = a >> b;
+        break;
+      case AST_OP_LT:
+        v = a < b;
+        break;
+      case AST_OP_LE:
+        v = a <= b;
+        break;
+      case AST_OP_EQUAL:
+        v = a == b;
+        break;
+      case AST_OP_NEQUAL:
+        v = a != b;
+        break;
+      case AST_OP_B_AND:
+        v = a & b;
+        break;
+      case AST_OP_B_XOR:
+        v = a ^ b;
+        break;
+      case AST_OP_B_OR:
+        v = a | b;
+        break;
+      case AST_OP_L_AND:
+        v = a && b;
+        break;
+      case AST_OP_L_OR:
+        v = a || b;
+        break;
+      case AST_OP_B_NOT:
+        v = ~a;
+        break;
+      case AST_OP_L_NOT:
+        v = !a;
+        break;
+      default:
+        return p;
+    }
+    if (v < INT_MIN || v > INT_MAX)
+      return p;
+    return make_ast_int(v);
+  }
+
+  switch (p->type) {
+    case AST_OP_ADD:
+    case AST_OP_B_XOR:
+    case AST_OP_B_OR:
+      if (is_int(r, 0))
+        return fold_to(p, l);
+      if (is_int(l, 0))
+        return fold_to(p, r);
+      break;
+    case AST_OP_SUB:
+    case AST_OP_LSHIFT:
+    case AST_OP_RSHIFT:
+      if (is_int(r, 0))
+        return fold_to(p, l);
+      break;
+    case AST_OP_MUL:
+      if (is_int(r, 1))
+        return fold_to(p, l);
+      if (is_int(l, 1))
+        return fold_to(p, r);
+      if ((is_int(r, 0) && !has_side_effects(l)) ||
+          (is_int(l, 0) && !has_side_effects(r)))
+        return make_ast_int(0);
+      break;
+    case AST_OP_DIV:
+      if (is_int(r, 1))
+        return fold_to(p, l);
+      break;
+    case AST_OP_L_AND:
+      if (is_int(l, 0))  // the right is not evaluated
+        return make_ast_int(0);
+      break;
+    case AST_OP_L_OR:
+      if (l->type == AST_INT && l->ival != 0)
+        return make_ast_int(1);
+      break;
+  }
+  return p;
+}
+
+static CType *update_ctype(CType *ctype, Token token) {
   if (ctype->type == TYPE_ARRAY || ctype->type == TYPE_PTR) {
-    ctype->ptrof = update_ctype(ctype->ptrof, token);
+    CType *ptrof = update_ctype(ctype->ptrof, token);
+    if (ctype->ptrof != ptrof)
+      ctype->ptrof = ptrof;
     return ctype;
   }
 
@@ -145,13 +312,33 @@ static CType *update_ctype(CType *ctype, Token *token) {
       Vector *v = ctype->struct_decl;
       for (int i = 0; i < v->size; i++) {
         StructMember *sm = vector_at(v, i);
-        sm->ctype = update_ctype(sm->ctype, token);
+        CType *member = update_ctype(sm->ctype, token);
+        if (sm->ctype != member)
+          sm->ctype = member;
       }
     }
   }
   return ctype;
 }
 
+static void register_function(Ast *p) {
+  SymbolTableEntry *_e = make_SymbolTableEntry(p->ctype, 0);
+  MapEntry *e = allocate_MapEntry(p->ident, _e);
+  map_put(symbol_table, e);
+}
+
+static void analyze_function_body(Ast *p) {
+  symbol_table = p->symbol_table;
+  offset_from_bp = 0;
+  if (p->args->size > 6)
+    error_with_token(p->token, "too many arguments");
+  for (int i = 0; i < p->args->size; i++)
+    p->args->data[i] = semantic_analysis(vector_at(p->args, i));
+  p->statement = semantic_analysis(p->statement);
+  symbol_table = symbol_table->next;
+  p->offset_from_bp = offset_from_bp;
+}
+
 Ast *semantic_analysis(Ast *p) {
   if (p == NULL)
     return NULL;
@@ -170,7 +357,7 @@ Ast *semantic_analysis(Ast *p) {
         p->ctype = p->right->ctype;
       else
         p->ctype = char_to_int(p->left->ctype);
-      break;
+      return fold(p);
     case AST_OP_SUB:
       p->left = semantic_analysis(p->left);
       p->right = semantic_analysis(p->right);
@@ -184,7 +371,7 @@ Ast *semantic_analysis(Ast *p) {
         p->ctype = p->right->ctype;
       else
         p->ctype = char_to_int(p->left->ctype);
-      break;
+      return fold(p);
     case AST_OP_MUL:
     case AST_OP_DIV:
     case AST_OP_LT:
@@ -203,13 +390,13 @@ Ast *semantic_analysis(Ast *p) {
       p->left = array_to_ptr(p->left);
       p->right = array_to_ptr(p->right);
       p->ctype = char_to_int(p->left->ctype);
-      break;
+      return fold(p);
     case AST_OP_B_NOT:
     case AST_OP_L_NOT:
       p->left = semantic_analysis(p->left);
       p->left = array_to_ptr(p->left);
       p->ctype = char_to_int(p->left->ctype);
-      break;
+      return fold(p);
     case AST_OP_POST_INC:
     case AST_OP_POST_DEC:
     case AST_OP_PRE_INC:
@@ -221,7 +408,12 @@ Ast *semantic_analysis(Ast *p) {
       p->ctype = p->left->ctype;
       break;
     case AST_OP_REF:
+      if (!is_lvalue(p->left))
+        error_with_token(p->token, "cannot take the address of an rvalue");
       p->left = semantic_analysis(p->left);
+      if (p->left->type != AST_VAR && p->left->type != AST_OP_DEREF &&
+          p->left->type != AST_OP_DOT)
+        error_with_token(p->token, "cannot take the address of an rvalue");
       if (p->left->ctype->type == TYPE_ARRAY)
         p->ctype = make_ctype(TYPE_PTR, p->left->ctype->ptrof);
       else
@@ -236,6 +428,8 @@ Ast *semantic_analysis(Ast *p) {
       sizeof_ctype(p->ctype);  // to calc struct offset
       break;
     case AST_OP_ASSIGN:
+      if (!is_lvalue(p->left))
+        error_with_token(p->token, "expression is not assignable");
       p->left = semantic_analysis(p->left);
       p->right = semantic_analysis(p->right);
       p->left = array_to_ptr(p->left);
@@ -268,7 +462,7 @@ Ast *semantic_analysis(Ast *p) {
       int is_exist_target = 0;
       for (int i = 0; i < list->size; i++) {
         StructMember *sm = vector_at(list, i);
-        if (strcmp(sm->name, target) == 0) {
+        if (sm->name == target) {  // both are interned
           is_exist_target = 1;
           p->ctype = sm->ctype;
           p->offset_from_bp = sm->offset;
@@ -338,8 +532,20 @@ Ast *semantic_analysis(Ast *p) {
       map_put(symbol_table, e);
       break;
     }
+    case AST_DECL_TYPEDEF: {
+      // resolved and laid out once here, function bodies only read it. A
+      // struct declared by tag alone is resolved where it is used.
+      CType *ctype = p->ctype->ptrof;
+      if (ctype->struct_tag != NULL && ctype->struct_decl == NULL)
+        return NULL;
+      p->ctype->ptrof = update_ctype(ctype, p->token);
+      if (p->ctype->ptrof->type == TYPE_STRUCT)
+        sizeof_ctype(p->ctype->ptrof);
+      return NULL;
+    }
     case AST_DECL_GLOBAL_VAR: {
       p->ctype = update_ctype(p->ctype, p->token);
+      sizeof_ctype(p->ctype);  // to calc struct offset
 
       // register variable
       SymbolTableEntry *_e = make_SymbolTableEntry(p->ctype, 1);
@@ -364,27 +570,14 @@ Ast *semantic_analysis(Ast *p) {
       }
       break;
     }
-    case AST_DECL_FUNC: {
-      // register function to symbol table.
-      SymbolTableEntry *_e = make_SymbolTableEntry(p->ctype, 0);
-      MapEntry *e = allocate_MapEntry(p->ident, _e);
-      map_put(symbol_table, e);
+    case AST_DECL_FUNC:
+      register_function(p);
 
       // when function prototype
       if (p->statement == NULL)
         return NULL;
-
-      symbol_table = p->symbol_table;
-      offset_from_bp = 0;
-      if (p->args->size > 6)
-        error_with_token(p->token, "too many arguments");
-      for (int i = 0; i < p->args->size; i++)
-        p->args->data[i] = semantic_analysis(vector_at(p->args, i));
-      p->statement = semantic_analysis(p->statement);
-      symbol_table = symbol_table->next;
-      p->offset_from_bp = offset_from_bp;
+      analyze_function_body(p);
       break;
-    }
     case AST_COMPOUND_STATEMENT:
       for (int i = 0; i < p->statements->size; i++)
         p->statements->data[i] = semantic_analysis(vector_at(p->statements, i));
@@ -411,3 +604,46 @@ Ast *semantic_analysis(Ast *p) {
 
   return p;
 }
+
+static void analyze_job(int i, void *arg) {
+  Ast *p = vector_at(arg, i);
+  if (p == NULL || p->type != AST_DECL_FUNC)
+    return;
+  decl_order = i;
+  long t = time_now();
+  analyze_function_body(p);
+  time_function("semantic_analysis", p->ident, t);
+  decl_order = INT_MAX;
+}
+
+// analyzes the top level declarations in place. With jobs > 1 the file
+// scope is registered first and the function bodies are analyzed on worker
+// threads, each with its own frame state.
+void analyze_program(Vector *decls, int jobs) {
+  if (jobs <= 1) {
+    for (int i = 0; i < decls->size; i++) {
+      Ast *p = vector_at(decls, i);
+      long t = time_now();
+      decls->data[i] = semantic_analysis(p);
+      if (p != NULL && p->type == AST_DECL_FUNC && p->statement != NULL)
+        time_function("semantic_analysis", p->ident, t);
+    }
+    return;
+  }
+
+  for (int i = 0; i < decls->size; i++) {
+    Ast *p = vector_at(decls, i);
+    decl_order = i;
+    if (p != NULL && p->type == AST_DECL_FUNC) {
+      register_function(p);
+      if (p->statement == NULL)
+        decls->data[i] = NULL;
+    } else {
+      decls->data[i] = semantic_analysis(p);
+    }
+  }
+  decl_order = INT_MAX;
+
+  // the file scope is read only from here on
+  parallel_for(decls->size, jobs, analyze_job, decls);
+}
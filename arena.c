@@ -0,0 +1,279 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include "uoocc.h"
+
+// each thread allocates from its own token, ast, table and string arenas.
+_Thread_local Arena token_arena = {"token"};
+_Thread_local Arena ast_arena = {"ast"};
+_Thread_local Arena table_arena = {"table"};
+_Thread_local Arena string_arena = {"string"};
+Arena intern_arena = {.name = "intern", .persistent = 1};
+Arena header_arena = {.name = "header", .persistent = 1};
+
+// the thread arenas come first, in the order arena_save_thread uses
+#define ARENAS                                                            \
+  {&token_arena, &ast_arena, &table_arena, &string_arena, &intern_arena, \
+   &header_arena}
+
+#define NUM_ARENAS (NUM_THREAD_ARENAS + 2)
+
+static int round_size(int size) {
+  return (size + ARENA_ALIGN - 1) & ~(ARENA_ALIGN - 1);
+}
+
+static ArenaBlock *allocate_block(Arena *a, int size) {
+  ArenaBlock *b = malloc(sizeof(ArenaBlock) + size);
+  if (b == NULL)
+    error("out of memory");
+  a->reserved_bytes += size;
+  return b;
+}
+
+static void link_block(ArenaBlock **head, ArenaBlock *b) {
+  b->prev = NULL;
+  b->next = *head;
+  if (*head != NULL)
+    (*head)->prev = b;
+  *head = b;
+}
+
+static char *tag_names[NUM_MEM_TAGS] = {
+    "token", "ast", "ctype", "string", "map", "vector", "symbol", "other",
+};
+
+// returns zero-filled memory which lives until arena_release, counted as
+// allocated for tag.
+void *arena_alloc_tagged(Arena *a, int tag, int size) {
+  size = round_size(size == 0 ? 1 : size);
+  a->num_allocs++;
+  a->num_bytes += size;
+  MemTagStats *t = &a->tags[tag];
+  t->num_allocs++;
+  t->num_bytes += size;
+  t->live_bytes += size;
+  if (t->peak_bytes < t->live_bytes)
+    t->peak_bytes = t->live_bytes;
+
+  // fixed-size nodes are recycled through per-size-class free lists.
+  if (size <= ARENA_MAX_POOLED_SIZE) {
+    void **pool = &a->pool[size / ARENA_ALIGN - 1];
+    if (*pool != NULL) {
+      void *p = *pool;
+      *pool = *(void **)p;
+      a->num_reused++;
+      return memset(p, 0, size);
+    }
+  }
+
+  // big allocations get a dedicated block so that they can be freed alone.
+  if (size > ARENA_BLOCK_SIZE / 4) {
+    ArenaBlock *b = allocate_block(a, size);
+    link_block(&a->large, b);
+    return memset(b + 1, 0, size);
+  }
+
+  if (a->end - a->ptr < size) {
+    ArenaBlock *b = a->spare;
+    if (b != NULL)
+      a->spare = b->next;
+    else
+      b = allocate_block(a, ARENA_BLOCK_SIZE);
+    link_block(&a->blocks, b);
+    a->ptr = (char *)(b + 1);
+    a->end = a->ptr + ARENA_BLOCK_SIZE;
+  }
+  void *p = a->ptr;
+  a->ptr += size;
+  return memset(p, 0, size);
+}
+
+// gives back memory obtained from arena_alloc_tagged(a, tag, size) for
+// reuse.
+void arena_free_tagged(Arena *a, int tag, void *p, int size) {
+  if (p == NULL)
+    return;
+  size = round_size(size == 0 ? 1 : size);
+  a->tags[tag].live_bytes -= size;
+
+  if (size <= ARENA_MAX_POOLED_SIZE) {
+    void **pool = &a->pool[size / ARENA_ALIGN - 1];
+    *(void **)p = *pool;
+    *pool = p;
+  } else if (size > ARENA_BLOCK_SIZE / 4) {
+    ArenaBlock *b = (ArenaBlock *)p - 1;
+    if (b->prev == NULL)
+      a->large = b->next;
+    else
+      b->prev->next = b->next;
+    if (b->next != NULL)
+      b->next->prev = b->prev;
+    a->reserved_bytes -= size;
+    free(b);
+  }
+  // medium sized chunks stay in their block until arena_release.
+}
+
+void *arena_realloc_tagged(Arena *a, int tag, void *p, int old_size,
+                           int new_size) {
+  void *q = arena_alloc_tagged(a, tag, new_size);
+  if (p != NULL) {
+    memcpy(q, p, old_size < new_size ? old_size : new_size);
+    arena_free_tagged(a, tag, p, old_size);
+  }
+  return q;
+}
+
+void *arena_alloc(Arena *a, int size) {
+  return arena_alloc_tagged(a, MEM_OTHER, size);
+}
+
+void arena_free(Arena *a, void *p, int size) {
+  arena_free_tagged(a, MEM_OTHER, p, size);
+}
+
+void *arena_realloc(Arena *a, void *p, int old_size, int new_size) {
+  return arena_realloc_tagged(a, MEM_OTHER, p, old_size, new_size);
+}
+
+char *arena_strndup(Arena *a, char *s, int len) {
+  char *p = arena_alloc(a, len + 1);
+  memcpy(p, s, len);
+  p[len] = '\0';
+  return p;
+}
+
+static void free_blocks(ArenaBlock *b) {
+  while (b != NULL) {
+    ArenaBlock *next = b->next;
+    free(b);
+    b = next;
+  }
+}
+
+// releases everything allocated from the arena in one shot.
+void arena_release(Arena *a) {
+  free_blocks(a->blocks);
+  free_blocks(a->large);
+  free_blocks(a->spare);
+  a->blocks = a->large = a->spare = NULL;
+  a->ptr = a->end = NULL;
+  memset(a->pool, 0, sizeof(a->pool));
+  a->reserved_bytes = 0;
+  for (int i = 0; i < NUM_MEM_TAGS; i++)
+    a->tags[i].live_bytes = 0;
+}
+
+// interned identifiers and cached headers are shared by every compilation
+// and are kept.
+void arena_release_all(void) {
+  Arena *arenas[] = ARENAS;
+  for (int i = 0; i < NUM_ARENAS; i++)
+    if (!arenas[i]->persistent)
+      arena_release(arenas[i]);
+}
+
+static void splice_blocks(ArenaBlock **head, ArenaBlock *list) {
+  if (list == NULL)
+    return;
+  ArenaBlock *tail = list;
+  while (tail->next != NULL)
+    tail = tail->next;
+  tail->next = *head;
+  if (*head != NULL)
+    (*head)->prev = tail;
+  *head = list;
+}
+
+// like arena_release, but the blocks are kept for the next allocations.
+void arena_recycle(Arena *a) {
+  free_blocks(a->large);
+  a->large = NULL;
+  splice_blocks(&a->spare, a->blocks);
+  a->blocks = NULL;
+  a->ptr = a->end = NULL;
+  memset(a->pool, 0, sizeof(a->pool));
+  long reserved = 0;
+  for (ArenaBlock *b = a->spare; b != NULL; b = b->next)
+    reserved += ARENA_BLOCK_SIZE;
+  a->reserved_bytes = reserved;
+  for (int i = 0; i < NUM_MEM_TAGS; i++)
+    a->tags[i].live_bytes = 0;
+}
+
+// a long running server keeps its memory warm between compilations.
+void arena_recycle_all(void) {
+  Arena *arenas[] = ARENAS;
+  for (int i = 0; i < NUM_ARENAS; i++)
+    if (!arenas[i]->persistent)
+      arena_recycle(arenas[i]);
+}
+
+void arena_print_stats(FILE *fp) {
+  fprintf(fp, "%-8s %12s %12s %12s %12s\n", "arena", "allocs", "bytes",
+          "reused", "reserved");
+  Arena *arenas[] = ARENAS;
+  for (int i = 0; i < NUM_ARENAS; i++) {
+    Arena *a = arenas[i];
+    fprintf(fp, "%-8s %12ld %12ld %12ld %12ld\n", a->name, a->num_allocs,
+            a->num_bytes, a->num_reused, a->reserved_bytes);
+  }
+
+  // the peaks of the arenas are added up, they need not coincide
+  fprintf(fp, "%-8s %12s %12s %12s %12s\n", "tag", "allocs", "bytes", "live",
+          "peak");
+  for (int i = 0; i < NUM_MEM_TAGS; i++) {
+    MemTagStats sum = {0};
+    for (int j = 0; j < NUM_ARENAS; j++) {
+      MemTagStats *t = &arenas[j]->tags[i];
+      sum.num_allocs += t->num_allocs;
+      sum.num_bytes += t->num_bytes;
+      sum.live_bytes += t->live_bytes;
+      sum.peak_bytes += t->peak_bytes;
+    }
+    fprintf(fp, "%-8s %12ld %12ld %12ld %12ld\n", tag_names[i],
+            sum.num_allocs, sum.num_bytes, sum.live_bytes, sum.peak_bytes);
+  }
+  struct rusage ru;
+  if (getrusage(RUSAGE_SELF, &ru) == 0)
+    fprintf(fp, "peak rss %ld KB\n", ru.ru_maxrss);
+}
+
+// moves the thread arenas of the calling thread into saved, which must hold
+// NUM_THREAD_ARENAS arenas, and leaves them empty. The memory stays valid
+// after the thread exits.
+void arena_save_thread(Arena *saved) {
+  Arena *arenas[] = ARENAS;
+  for (int i = 0; i < NUM_THREAD_ARENAS; i++) {
+    saved[i] = *arenas[i];
+    char *name = arenas[i]->name;
+    memset(arenas[i], 0, sizeof(Arena));
+    arenas[i]->name = name;
+  }
+}
+
+// takes over the blocks and the counters of arenas saved by another thread.
+// The unused tail of their current block and their free lists are dropped.
+void arena_adopt_thread(Arena *saved) {
+  Arena *arenas[] = ARENAS;
+  for (int i = 0; i < NUM_THREAD_ARENAS; i++) {
+    Arena *a = arenas[i];
+    splice_blocks(&a->blocks, saved[i].blocks);
+    splice_blocks(&a->large, saved[i].large);
+    splice_blocks(&a->spare, saved[i].spare);
+    a->num_allocs += saved[i].num_allocs;
+    a->num_bytes += saved[i].num_bytes;
+    a->num_reused += saved[i].num_reused;
+    a->reserved_bytes += saved[i].reserved_bytes;
+    // the worker ran alongside, its peak is taken on top of what is live
+    for (int j = 0; j < NUM_MEM_TAGS; j++) {
+      MemTagStats *t = &a->tags[j], *s = &saved[i].tags[j];
+      t->num_allocs += s->num_allocs;
+      t->num_bytes += s->num_bytes;
+      if (t->peak_bytes < t->live_bytes + s->peak_bytes)
+        t->peak_bytes = t->live_bytes + s->peak_bytes;
+      t->live_bytes += s->live_bytes;
+    }
+  }
+}
@@ -0,0 +1,929 @@
+#include <elf.h>
+#include <stdlib.h>
+#include <string.h>
+#include "uoocc.h"
+
+// assembler for the AT&T syntax subset that gen.c emits. It writes an
+// ELF64 relocatable object which can be linked by cc.
+
+enum {
+  SECT_TEXT,
+  SECT_DATA,
+  NUM_SECTS,
+};
+
+typedef struct {
+  char *name;  // interned
+  int sect;
+  long offset;
+  int defined;
+  int global;
+  int index;  // in .symtab, 0 when not written
+} AsmSymbol;
+
+// a reference to a symbol, resolved or turned into a relocation at the end
+typedef struct {
+  int sect;
+  long offset;
+  AsmSymbol *sym;
+  long addend;
+  int type;  // R_X86_64_*
+} Fixup;
+
+enum {
+  OP_REG,
+  OP_IMM,
+  OP_MEM,
+};
+
+#define REG_NONE -1
+#define REG_RIP 16
+
+typedef struct {
+  int kind;
+  int reg;       // OP_REG
+  int size;      // of the register in bytes
+  int need_rex;  // spl, bpl, sil and dil are only reachable with REX
+  long imm;      // immediate value or displacement
+  AsmSymbol *sym;
+  int base;  // OP_MEM, REG_NONE when absent
+  int index;
+  int scale;
+  int indirect;  // "*" operand of call and jmp
+} Operand;
+
+static struct {
+  char *name;
+  int reg;
+  int size;
+  int need_rex;
+} registers[] = {
+    {"rax", 0, 8},   {"rcx", 1, 8},   {"rdx", 2, 8},   {"rbx", 3, 8},
+    {"rsp", 4, 8},   {"rbp", 5, 8},   {"rsi", 6, 8},   {"rdi", 7, 8},
+    {"r8", 8, 8},    {"r9", 9, 8},    {"r10", 10, 8},  {"r11", 11, 8},
+    {"r12", 12, 8},  {"r13", 13, 8},  {"r14", 14, 8},  {"r15", 15, 8},
+    {"eax", 0, 4},   {"ecx", 1, 4},   {"edx", 2, 4},   {"ebx", 3, 4},
+    {"esp", 4, 4},   {"ebp", 5, 4},   {"esi", 6, 4},   {"edi", 7, 4},
+    {"r8d", 8, 4},   {"r9d", 9, 4},   {"r10d", 10, 4}, {"r11d", 11, 4},
+    {"r12d", 12, 4}, {"r13d", 13, 4}, {"r14d", 14, 4}, {"r15d", 15, 4},
+    {"ax", 0, 2},    {"cx", 1, 2},    {"dx", 2, 2},    {"bx", 3, 2},
+    {"sp", 4, 2},    {"bp", 5, 2},    {"si", 6, 2},    {"di", 7, 2},
+    {"al", 0, 1},    {"cl", 1, 1},    {"dl", 2, 1},    {"bl", 3, 1},
+    {"spl", 4, 1, 1}, {"bpl", 5, 1, 1}, {"sil", 6, 1, 1}, {"dil", 7, 1, 1},
+    {"r8b", 8, 1},   {"r9b", 9, 1},   {"r10b", 10, 1}, {"r11b", 11, 1},
+    {"r12b", 12, 1}, {"r13b", 13, 1}, {"r14b", 14, 1}, {"r15b", 15, 1},
+    {"rip", REG_RIP, 8},
+};
+
+#define NUM_REGISTERS (int)(sizeof(registers) / sizeof(registers[0]))
+
+// condition codes of jcc and setcc
+static struct {
+  char *name;
+  int code;
+} conditions[] = {
+    {"o", 0x0},   {"no", 0x1},  {"b", 0x2},   {"c", 0x2},   {"nae", 0x2},
+    {"ae", 0x3},  {"nb", 0x3},  {"nc", 0x3},  {"e", 0x4},   {"z", 0x4},
+    {"ne", 0x5},  {"nz", 0x5},  {"be", 0x6},  {"na", 0x6},  {"a", 0x7},
+    {"nbe", 0x7}, {"s", 0x8},   {"ns", 0x9},  {"p", 0xa},   {"np", 0xb},
+    {"l", 0xc},   {"nge", 0xc}, {"ge", 0xd},  {"nl", 0xd},  {"le", 0xe},
+    {"ng", 0xe},  {"g", 0xf},   {"nle", 0xf},
+};
+
+#define NUM_CONDITIONS (int)(sizeof(conditions) / sizeof(conditions[0]))
+
+enum {
+  INS_ALU,     // ext is the opcode extension of the 0x81 group
+  INS_MOV,
+  INS_TEST,
+  INS_LEA,
+  INS_MOVX,    // ext is the opcode after 0x0f, or 0x63 for movslq
+  INS_SHIFT,   // ext is the opcode extension of the 0xc1 group
+  INS_UNARY,   // ext is the opcode extension of the 0xf7 group
+  INS_INCDEC,  // ext is the opcode extension of the 0xff group
+  INS_IMUL,
+  INS_PUSH,
+  INS_POP,
+  INS_JMP,
+  INS_CALL,
+  INS_FIXED,  // ext holds the bytes of the instruction, REX.W for size 8
+};
+
+static struct {
+  char *name;
+  int kind;
+  int ext;
+  int size;  // fixed operand size, 0 when it comes from the operands
+} instructions[] = {
+    {"add", INS_ALU, 0},          {"or", INS_ALU, 1},
+    {"and", INS_ALU, 4},          {"sub", INS_ALU, 5},
+    {"xor", INS_ALU, 6},          {"cmp", INS_ALU, 7},
+    {"mov", INS_MOV},             {"test", INS_TEST},
+    {"lea", INS_LEA},             {"movslq", INS_MOVX, 0x63, 8},
+    {"movsbq", INS_MOVX, 0xbe, 8}, {"movsbl", INS_MOVX, 0xbe, 4},
+    {"movswq", INS_MOVX, 0xbf, 8}, {"movswl", INS_MOVX, 0xbf, 4},
+    {"movzbq", INS_MOVX, 0xb6, 8}, {"movzbl", INS_MOVX, 0xb6, 4},
+    {"movzwq", INS_MOVX, 0xb7, 8}, {"movzwl", INS_MOVX, 0xb7, 4},
+    {"sal", INS_SHIFT, 4},        {"shl", INS_SHIFT, 4},
+    {"shr", INS_SHIFT, 5},        {"sar", INS_SHIFT, 7},
+    {"not", INS_UNARY, 2},        {"neg", INS_UNARY, 3},
+    {"mul", INS_UNARY, 4},        {"div", INS_UNARY, 6},
+    {"idiv", INS_UNARY, 7},       {"inc", INS_INCDEC, 0},
+    {"dec", INS_INCDEC, 1},       {"imul", INS_IMUL},
+    {"push", INS_PUSH, 0, 8},     {"pop", INS_POP, 0, 8},
+    {"jmp", INS_JMP},             {"call", INS_CALL},
+    {"ret", INS_FIXED, 0xc3},     {"leave", INS_FIXED, 0xc9},
+    {"nop", INS_FIXED, 0x90},     {"cqo", INS_FIXED, 0x99, 8},
+    {"cltq", INS_FIXED, 0x98, 8},
+};
+
+#define NUM_INSTRUCTIONS (int)(sizeof(instructions) / sizeof(instructions[0]))
+
+static _Thread_local Output sections[NUM_SECTS];
+static _Thread_local int current_sect;
+static _Thread_local Map *symbols;
+static _Thread_local Vector *symbol_list;  // AsmSymbol * in order of appearance
+static _Thread_local Vector *fixups;
+static _Thread_local int asm_line;
+
+static void asm_error(char *msg) {
+  fprintf(stderr, "assembler:%d: Error: %s.\n", asm_line, msg);
+  abort_compilation();
+}
+
+static AsmSymbol *find_symbol(char *name, int len) {
+  char *key = intern_string_n(name, len);
+  MapEntry *e = map_get(symbols, key);
+  if (e != NULL)
+    return e->val;
+  AsmSymbol *sym = arena_alloc(&table_arena, sizeof(AsmSymbol));
+  sym->name = key;
+  map_put(symbols, allocate_MapEntry(key, sym));
+  vector_push_back(symbol_list, sym);
+  return sym;
+}
+
+static long current_offset(void) {
+  return sections[current_sect].len;
+}
+
+static void emit_byte(int c) {
+  char b = c;
+  output_write(&sections[current_sect], &b, 1);
+}
+
+static void emit_value(long v, int size) {
+  for (int i = 0; i < size; i++)
+    emit_byte(v >> (i * 8));
+}
+
+static void emit_fixup(AsmSymbol *sym, long addend, int type, int size) {
+  Fixup *f = arena_alloc(&table_arena, sizeof(Fixup));
+  f->sect = current_sect;
+  f->offset = current_offset();
+  f->sym = sym;
+  f->addend = addend;
+  f->type = type;
+  vector_push_back(fixups, f);
+  emit_value(0, size);
+}
+
+static int is_symbol_char(int c) {
+  return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') ||
+         ('0' <= c && c <= '9') || c == '_' || c == '.' || c == '$';
+}
+
+static char *skip_space(char *p, char *end) {
+  while (p < end && (*p == ' ' || *p == '\t'))
+    p++;
+  return p;
+}
+
+static int parse_register(char *p, char *end, Operand *op) {
+  int len = 0;
+  while (p + len < end && is_symbol_char((unsigned char)p[len]))
+    len++;
+  for (int i = 0; i < NUM_REGISTERS; i++) {
+    if ((int)strlen(registers[i].name) == len &&
+        strncmp(registers[i].name, p, len) == 0) {
+      op->reg = registers[i].reg;
+      op->size = registers[i].size;
+      op->need_rex = registers[i].need_rex;
+      return len;
+    }
+  }
+  asm_error("unknown register");
+  return 0;
+}
+
+// number or symbol[+-number]
+static char *parse_value(char *p, char *end, long *val, AsmSymbol **sym) {
+  *val = 0;
+  *sym = NULL;
+  if (p < end && (('0' <= *p && *p <= '9') || *p == '-')) {
+    char *q;
+    *val = strtoull(p, &q, 0);
+    if (*p == '-')
+      *val = strtoll(p, &q, 0);
+    return q;
+  }
+  char *start = p;
+  while (p < end && is_symbol_char((unsigned char)*p))
+    p++;
+  if (p == start)
+    asm_error("expression was expected");
+  *sym = find_symbol(start, p - start);
+  if (p < end && (*p == '+' || *p == '-')) {
+    char *q;
+    *val = strtoll(p, &q, 0);
+    p = q;
+  }
+  return p;
+}
+
+// parses an operand in [p, end) which has no surrounding white space.
+static void parse_operand(char *p, char *end, Operand *op) {
+  memset(op, 0, sizeof(Operand));
+  op->base = op->index = REG_NONE;
+  if (*p == '*') {
+    op->indirect = 1;
+    p++;
+  }
+  if (*p == '%') {
+    op->kind = OP_REG;
+    parse_register(p + 1, end, op);
+    return;
+  }
+  if (*p == '$') {
+    op->kind = OP_IMM;
+    parse_value(p + 1, end, &op->imm, &op->sym);
+    return;
+  }
+
+  op->kind = OP_MEM;
+  if (*p != '(')
+    p = parse_value(p, end, &op->imm, &op->sym);
+  if (p == end)
+    return;  // absolute address or branch target
+  if (*p != '(' || end[-1] != ')')
+    asm_error("invalid memory operand");
+
+  Operand r;
+  p++;
+  if (*p == '%') {
+    p += 1 + parse_register(p + 1, end, &r);
+    op->base = r.reg;
+  }
+  if (*p == ',') {
+    p++;
+    if (*p != '%')
+      asm_error("index register was expected");
+    p += 1 + parse_register(p + 1, end, &r);
+    op->index = r.reg;
+    op->scale = 1;
+    if (*p == ',')
+      op->scale = strtol(p + 1, &p, 10);
+  }
+  if (*p != ')')
+    asm_error("invalid memory operand");
+}
+
+static int is_reg(Operand *op) {
+  return op->kind == OP_REG;
+}
+
+static int fits_int8(long v) {
+  return -128 <= v && v <= 127;
+}
+
+static int fits_int32(long v) {
+  return -2147483648L <= v && v <= 2147483647L;
+}
+
+// emits [66] [REX] opcode ModRM [SIB] [disp]. reg is the ModRM.reg field, a
+// register number or an opcode extension. imm_size is the size of the
+// immediate which follows, needed for %rip relative displacements.
+static void emit_modrm(int size, int opcode, int reg, int reg_need_rex,
+                       Operand *rm, int imm_size) {
+  int rex = 0;
+  if (size == 8)
+    rex |= 8;
+  if (reg >= 8)
+    rex |= 4;
+  if (rm->kind == OP_REG && rm->reg >= 8)
+    rex |= 1;
+  if (rm->kind == OP_MEM && rm->index != REG_NONE && rm->index >= 8)
+    rex |= 2;
+  if (rm->kind == OP_MEM && rm->base != REG_NONE && rm->base != REG_RIP &&
+      rm->base >= 8)
+    rex |= 1;
+
+  if (size == 2)
+    emit_byte(0x66);
+  if (rex != 0 || reg_need_rex || (rm->kind == OP_REG && rm->need_rex))
+    emit_byte(0x40 | rex);
+  if (opcode > 0xffff)
+    emit_byte(opcode >> 16);
+  if (opcode > 0xff)
+    emit_byte(opcode >> 8);
+  emit_byte(opcode);
+
+  reg &= 7;
+  if (rm->kind == OP_REG) {
+    emit_byte(0xc0 | reg << 3 | (rm->reg & 7));
+    return;
+  }
+
+  if (rm->base == REG_RIP) {
+    emit_byte(reg << 3 | 5);
+    if (rm->sym != NULL)
+      emit_fixup(rm->sym, rm->imm - 4 - imm_size, R_X86_64_PC32, 4);
+    else
+      emit_value(rm->imm, 4);
+    return;
+  }
+
+  int mod;
+  if (rm->base == REG_NONE)
+    mod = 0;  // disp32 only
+  else if (rm->sym == NULL && rm->imm == 0 && (rm->base & 7) != 5)
+    mod = 0;
+  else if (rm->sym == NULL && fits_int8(rm->imm))
+    mod = 1;
+  else
+    mod = 2;
+
+  if (rm->base == REG_NONE || rm->index != REG_NONE || (rm->base & 7) == 4) {
+    // SIB byte
+    int scale = rm->scale == 8 ? 3 : rm->scale == 4 ? 2 : rm->scale == 2;
+    int index = rm->index == REG_NONE ? 4 : rm->index & 7;
+    int base = rm->base == REG_NONE ? 5 : rm->base & 7;
+    emit_byte(mod << 6 | reg << 3 | 4);
+    emit_byte(scale << 6 | index << 3 | base);
+  } else {
+    emit_byte(mod << 6 | reg << 3 | (rm->base & 7));
+  }
+
+  if (mod == 1)
+    emit_value(rm->imm, 1);
+  else if (mod == 2 || rm->base == REG_NONE) {
+    if (rm->sym != NULL)
+      emit_fixup(rm->sym, rm->imm, R_X86_64_32S, 4);
+    else
+      emit_value(rm->imm, 4);
+  }
+}
+
+static void emit_imm(Operand *op, int size) {
+  if (op->sym != NULL)
+    emit_fixup(op->sym, op->imm, size == 8 ? R_X86_64_64 : R_X86_64_32S,
+               size);
+  else
+    emit_value(op->imm, size);
+}
+
+// a branch to a label already defined nearby gets the short form
+static void emit_branch(int short_opcode, int long_opcode, Operand *target) {
+  AsmSymbol *sym = target->sym;
+  if (sym == NULL)
+    asm_error("branch target was expected");
+  int long_size = long_opcode > 0xff ? 6 : 5;
+  if (sym->defined && sym->sect == current_sect &&
+      fits_int8(sym->offset - (current_offset() + 2))) {
+    emit_byte(short_opcode);
+    emit_value(sym->offset - (current_offset() + 1), 1);
+    return;
+  }
+  if (long_size == 6)
+    emit_byte(long_opcode >> 8);
+  emit_byte(long_opcode);
+  emit_fixup(sym, -4, R_X86_64_PC32, 4);
+}
+
+static int condition_code(char *s) {
+  for (int i = 0; i < NUM_CONDITIONS; i++)
+    if (strcmp(conditions[i].name, s) == 0)
+      return conditions[i].code;
+  return -1;
+}
+
+// the operand size is given by the suffix or by a register operand.
+static int operand_size(int size, Operand *ops, int n) {
+  for (int i = n - 1; size == 0 && i >= 0; i--)
+    if (is_reg(&ops[i]))
+      size = ops[i].size;
+  if (size == 0)
+    asm_error("operand size is ambiguous");
+  return size;
+}
+
+static void encode(int kind, int ext, int size, Operand *ops, int n) {
+  Operand *src = &ops[0], *dst = &ops[n - 1];
+  int byte = 0;
+
+  switch (kind) {
+    case INS_ALU:
+      size = operand_size(size, ops, n);
+      byte = size == 1;
+      if (src->kind == OP_IMM) {
+        if (byte) {
+          emit_modrm(size, 0x80, ext, 0, dst, 1);
+          emit_imm(src, 1);
+        } else if (src->sym == NULL && fits_int8(src->imm)) {
+          emit_modrm(size, 0x83, ext, 0, dst, 1);
+          emit_imm(src, 1);
+        } else {
+          emit_modrm(size, 0x81, ext, 0, dst, 4);
+          emit_imm(src, 4);
+        }
+      } else if (is_reg(src)) {
+        emit_modrm(size, ext << 3 | !byte, src->reg, src->need_rex, dst, 0);
+      } else {
+        emit_modrm(size, ext << 3 | 2 | !byte, dst->reg, dst->need_rex, src,
+                   0);
+      }
+      break;
+    case INS_MOV:
+      size = operand_size(size, ops, n);
+      byte = size == 1;
+      if (src->kind == OP_IMM && is_reg(dst) && size == 8 &&
+          src->sym == NULL && !fits_int32(src->imm)) {
+        emit_byte(0x48 | (dst->reg >= 8));  // movabs
+        emit_byte(0xb8 | (dst->reg & 7));
+        emit_imm(src, 8);
+      } else if (src->kind == OP_IMM) {
+        emit_modrm(size, byte ? 0xc6 : 0xc7, 0, 0, dst, byte ? 1 : size % 8);
+        emit_imm(src, byte ? 1 : size == 2 ? 2 : 4);
+      } else if (is_reg(src)) {
+        emit_modrm(size, byte ? 0x88 : 0x89, src->reg, src->need_rex, dst, 0);
+      } else {
+        emit_modrm(size, byte ? 0x8a : 0x8b, dst->reg, dst->need_rex, src, 0);
+      }
+      break;
+    case INS_TEST:
+      size = operand_size(size, ops, n);
+      byte = size == 1;
+      if (src->kind == OP_IMM) {
+        emit_modrm(size, byte ? 0xf6 : 0xf7, 0, 0, dst, byte ? 1 : 4);
+        emit_imm(src, byte ? 1 : 4);
+      } else {
+        emit_modrm(size, byte ? 0x84 : 0x85, src->reg, src->need_rex, dst, 0);
+      }
+      break;
+    case INS_LEA:
+      emit_modrm(operand_size(size, ops, n), 0x8d, dst->reg, 0, src, 0);
+      break;
+    case INS_MOVX:
+      emit_modrm(size, ext == 0x63 ? 0x63 : 0x0f00 | ext, dst->reg,
+                 dst->need_rex, src, 0);
+      break;
+    case INS_SHIFT:
+      size = operand_size(size, &ops[n - 1], 1);
+      byte = size == 1;
+      if (n == 1 || (src->kind == OP_IMM && src->imm == 1)) {
+        emit_modrm(size, byte ? 0xd0 : 0xd1, ext, 0, dst, 0);
+      } else if (src->kind == OP_IMM) {
+        emit_modrm(size, byte ? 0xc0 : 0xc1, ext, 0, dst, 1);
+        emit_imm(src, 1);
+      } else {
+        emit_modrm(size, byte ? 0xd2 : 0xd3, ext, 0, dst, 0);  // %cl
+      }
+      break;
+    case INS_UNARY:
+      size = operand_size(size, ops, n);
+      emit_modrm(size, size == 1 ? 0xf6 : 0xf7, ext, 0, dst, 0);
+      break;
+    case INS_INCDEC:
+      size = operand_size(size, ops, n);
+      emit_modrm(size, size == 1 ? 0xfe : 0xff, ext, 0, dst, 0);
+      break;
+    case INS_IMUL:
+      size = operand_size(size, ops, n);
+      if (n == 1) {
+        emit_modrm(size, 0xf7, 5, 0, dst, 0);
+      } else if (src->kind != OP_IMM) {
+        emit_modrm(size, 0x0faf, dst->reg, 0, src, 0);
+      } else {
+        // $imm, [r/m,] reg
+        Operand *rm = n == 3 ? &ops[1] : dst;
+        int imm8 = src->sym == NULL && fits_int8(src->imm);
+        emit_modrm(size, imm8 ? 0x6b : 0x69, dst->reg, 0, rm, imm8 ? 1 : 4);
+        emit_imm(src, imm8 ? 1 : 4);
+      }
+      break;
+    case INS_PUSH:
+      if (is_reg(src)) {
+        if (src->reg >= 8)
+          emit_byte(0x41);
+        emit_byte(0x50 | (src->reg & 7));
+      } else if (src->kind == OP_IMM && src->sym == NULL &&
+                 fits_int8(src->imm)) {
+        emit_byte(0x6a);
+        emit_imm(src, 1);
+      } else if (src->kind == OP_IMM) {
+        emit_byte(0x68);
+        emit_imm(src, 4);
+      } else {
+        emit_modrm(0, 0xff, 6, 0, src, 0);
+      }
+      break;
+    case INS_POP:
+      if (is_reg(src)) {
+        if (src->reg >= 8)
+          emit_byte(0x41);
+        emit_byte(0x58 | (src->reg & 7));
+      } else {
+        emit_modrm(0, 0x8f, 0, 0, src, 0);
+      }
+      break;
+    case INS_JMP:
+    case INS_CALL:
+      if (src->indirect) {
+        emit_modrm(0, 0xff, kind == INS_JMP ? 4 : 2, 0, src, 0);
+      } else if (kind == INS_JMP) {
+        emit_branch(0xeb, 0xe9, src);
+      } else {
+        emit_byte(0xe8);
+        emit_fixup(src->sym, -4, R_X86_64_PLT32, 4);
+      }
+      break;
+    case INS_FIXED:
+      if (size == 8)
+        emit_byte(0x48);
+      emit_byte(ext);
+      break;
+  }
+}
+
+static void assemble_instruction(char *p, char *end) {
+  char *mnemonic = p;
+  while (p < end && *p != ' ' && *p != '\t')
+    p++;
+  char *name = arena_strndup(&string_arena, mnemonic, p - mnemonic);
+
+  // operands separated by commas outside of parentheses
+  Operand ops[3];
+  int n = 0;
+  p = skip_space(p, end);
+  while (p < end) {
+    char *start = p;
+    for (int depth = 0; p < end && (depth > 0 || *p != ','); p++)
+      depth += *p == '(' ? 1 : *p == ')' ? -1 : 0;
+    char *q = p;
+    while (q > start && (q[-1] == ' ' || q[-1] == '\t'))
+      q--;
+    if (n == 3)
+      asm_error("too many operands");
+    parse_operand(start, q, &ops[n++]);
+    if (p < end)
+      p = skip_space(p + 1, end);
+  }
+
+  int len = strlen(name);
+  if (name[0] == 'j' && condition_code(name + 1) >= 0 && n == 1) {
+    int cc = condition_code(name + 1);
+    emit_branch(0x70 | cc, 0x0f80 | cc, &ops[0]);
+    return;
+  }
+  if (strncmp(name, "set", 3) == 0 && condition_code(name + 3) >= 0 &&
+      n == 1) {
+    emit_modrm(1, 0x0f90 | condition_code(name + 3), 0, 0, &ops[0], 0);
+    return;
+  }
+
+  // exact name first, then the name without the size suffix
+  for (int suffix = 0; suffix <= 1; suffix++) {
+    int size = 0;
+    if (suffix) {
+      char *s = strchr("bwlq", name[len - 1]);
+      if (s == NULL || len < 2)
+        break;
+      size = 1 << (s - "bwlq");
+      name[len - 1] = '\0';
+    }
+    for (int i = 0; i < NUM_INSTRUCTIONS; i++) {
+      if (strcmp(instructions[i].name, name) != 0)
+        continue;
+      if (n == 0 && instructions[i].kind != INS_FIXED)
+        asm_error("operand was expected");
+      if (instructions[i].size != 0)
+        size = instructions[i].size;
+      encode(instructions[i].kind, instructions[i].ext, size, ops, n);
+      return;
+    }
+  }
+  asm_error(allocate_concat_3string("unknown instruction '", mnemonic, "'"));
+}
+
+static void emit_string_literal(char *p, char *end) {
+  if (p >= end || *p != '"')
+    asm_error("string literal was expected");
+  for (p++; p < end && *p != '"'; p++) {
+    if (*p != '\\') {
+      emit_byte(*p);
+      continue;
+    }
+    p++;
+    if ('0' <= *p && *p <= '7') {
+      int c = 0;
+      for (int i = 0; i < 3 && '0' <= *p && *p <= '7'; i++, p++)
+        c = c * 8 + (*p - '0');
+      emit_byte(c);
+      p--;
+      continue;
+    }
+    char *escapes = "n\nt\tr\rv\vf\fa\ab\be\033";
+    char *e = strchr(escapes, *p);
+    if (*p == 'x') {
+      emit_byte(strtol(p + 1, &p, 16));
+      p--;
+    } else if (e != NULL && (e - escapes) % 2 == 0) {
+      emit_byte(e[1]);
+    } else {
+      emit_byte(*p);  // \\, \" and so on
+    }
+  }
+  emit_byte('\0');
+}
+
+static void assemble_directive(char *p, char *end) {
+  char *name = p;
+  while (p < end && *p != ' ' && *p != '\t')
+    p++;
+  int len = p - name;
+  p = skip_space(p, end);
+
+  if (len == 5 && strncmp(name, ".text", len) == 0) {
+    current_sect = SECT_TEXT;
+  } else if (len == 5 && strncmp(name, ".data", len) == 0) {
+    current_sect = SECT_DATA;
+  } else if ((len == 7 && strncmp(name, ".global", len) == 0) ||
+             (len == 6 && strncmp(name, ".globl", len) == 0)) {
+    char *start = p;
+    while (p < end && is_symbol_char((unsigned char)*p))
+      p++;
+    find_symbol(start, p - start)->global = 1;
+  } else if ((len == 7 && strncmp(name, ".string", len) == 0) ||
+             (len == 6 && strncmp(name, ".asciz", len) == 0)) {
+    emit_string_literal(p, end);
+  } else if (len == 5 && strncmp(name, ".zero", len) == 0) {
+    for (long n = strtol(p, NULL, 0); n > 0; n--)
+      emit_byte(0);
+  } else if (len == 6 && strncmp(name, ".align", len) == 0) {
+    long align = strtol(p, NULL, 0);
+    while (align > 0 && current_offset() % align != 0)
+      emit_byte(current_sect == SECT_TEXT ? 0x90 : 0);
+  } else if ((len == 5 && strncmp(name, ".byte", len) == 0) ||
+             (len == 5 && strncmp(name, ".long", len) == 0) ||
+             (len == 5 && strncmp(name, ".quad", len) == 0)) {
+    int size = name[1] == 'b' ? 1 : name[1] == 'l' ? 4 : 8;
+    while (p < end) {
+      Operand op;
+      p = parse_value(p, end, &op.imm, &op.sym);
+      emit_imm(&op, size);
+      p = skip_space(p, end);
+      if (p < end && *p == ',')
+        p = skip_space(p + 1, end);
+    }
+  } else {
+    asm_error("unknown directive");
+  }
+}
+
+static void assemble_line(char *p, char *end) {
+  p = skip_space(p, end);
+  while (end > p && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r'))
+    end--;
+  if (p == end)
+    return;
+
+  if (end[-1] == ':') {
+    AsmSymbol *sym = find_symbol(p, end - 1 - p);
+    if (sym->defined)
+      asm_error(allocate_concat_3string("symbol '", sym->name,
+                                        "' is already defined"));
+    sym->defined = 1;
+    sym->sect = current_sect;
+    sym->offset = current_offset();
+  } else if (*p == '.') {
+    assemble_directive(p, end);
+  } else {
+    assemble_instruction(p, end);
+  }
+}
+
+// ELF symbol index of the section symbols, the section header index is
+// one larger.
+#define SECT_SYMBOL(sect) ((sect) + 1)
+
+static int is_local_label(AsmSymbol *sym) {
+  return strncmp(sym->name, ".L", 2) == 0;
+}
+
+static void write_symbol(Output *symtab, Output *strtab, AsmSymbol *sym) {
+  Elf64_Sym s;
+  memset(&s, 0, sizeof(s));
+  s.st_name = strtab->len;
+  output_write(strtab, sym->name, strlen(sym->name) + 1);
+  s.st_info = ELF64_ST_INFO(sym->global || !sym->defined ? STB_GLOBAL
+                                                         : STB_LOCAL,
+                            STT_NOTYPE);
+  s.st_shndx = sym->defined ? sym->sect + 1 : SHN_UNDEF;
+  s.st_value = sym->defined ? sym->offset : 0;
+  output_write(symtab, (char *)&s, sizeof(s));
+}
+
+// fills .symtab and .strtab, local symbols first as ELF requires.
+// Returns the index of the first global symbol.
+static int build_symtab(Output *symtab, Output *strtab) {
+  Elf64_Sym s;
+  memset(&s, 0, sizeof(s));
+  output_write(symtab, (char *)&s, sizeof(s));
+  output_write(strtab, "", 1);
+  for (int i = 0; i < NUM_SECTS; i++) {
+    s.st_info = ELF64_ST_INFO(STB_LOCAL, STT_SECTION);
+    s.st_shndx = i + 1;
+    output_write(symtab, (char *)&s, sizeof(s));
+  }
+
+  int index = NUM_SECTS + 1;
+  for (int i = 0; i < symbol_list->size; i++) {
+    AsmSymbol *sym = symbol_list->data[i];
+    if (sym->defined && !sym->global && !is_local_label(sym)) {
+      write_symbol(symtab, strtab, sym);
+      sym->index = index++;
+    }
+  }
+  int first_global = index;
+  for (int i = 0; i < symbol_list->size; i++) {
+    AsmSymbol *sym = symbol_list->data[i];
+    if (sym->global || !sym->defined) {
+      write_symbol(symtab, strtab, sym);
+      sym->index = index++;
+    }
+  }
+  return first_global;
+}
+
+// patches references within a section and turns the others into relocations
+// against the symbol, or against the section for local symbols.
+static void resolve_fixups(Output *rela) {
+  for (int i = 0; i < fixups->size; i++) {
+    Fixup *f = fixups->data[i];
+    AsmSymbol *sym = f->sym;
+    int pc_relative = f->type == R_X86_64_PC32 || f->type == R_X86_64_PLT32;
+    if (pc_relative && sym->defined && !sym->global && sym->sect == f->sect) {
+      int v = sym->offset + f->addend - f->offset;
+      memcpy(sections[f->sect].buf + f->offset, &v, 4);
+      continue;
+    }
+    if (!sym->defined && is_local_label(sym))
+      asm_error(allocate_concat_3string("undefined label '", sym->name, "'"));
+
+    Elf64_Rela r;
+    r.r_offset = f->offset;
+    r.r_addend = f->addend;
+    if (sym->defined && !sym->global) {
+      r.r_info = ELF64_R_INFO(SECT_SYMBOL(sym->sect), f->type);
+      r.r_addend += sym->offset;
+    } else {
+      r.r_info = ELF64_R_INFO(sym->index, f->type);
+    }
+    output_write(&rela[f->sect], (char *)&r, sizeof(r));
+  }
+}
+
+enum {
+  SH_NULL,
+  SH_TEXT,
+  SH_DATA,
+  SH_RELA_TEXT,
+  SH_RELA_DATA,
+  SH_SYMTAB,
+  SH_STRTAB,
+  SH_SHSTRTAB,
+  SH_NOTE_STACK,
+  NUM_SH,
+};
+
+static void write_elf(Output *out) {
+  Output symtab, strtab, shstrtab, rela[NUM_SECTS];
+  output_init(&symtab, -1);
+  output_init(&strtab, -1);
+  output_init(&shstrtab, -1);
+  for (int i = 0; i < NUM_SECTS; i++)
+    output_init(&rela[i], -1);
+
+  int first_global = build_symtab(&symtab, &strtab);
+  resolve_fixups(rela);
+
+  Output *contents[NUM_SH] = {NULL,     &sections[SECT_TEXT],
+                              &sections[SECT_DATA], &rela[SECT_TEXT],
+                              &rela[SECT_DATA],     &symtab,
+                              &strtab,              &shstrtab,
+                              NULL};
+  char *names[NUM_SH] = {"",        ".text",    ".data",
+                         ".rela.text", ".rela.data", ".symtab",
+                         ".strtab", ".shstrtab", ".note.GNU-stack"};
+  Elf64_Shdr sh[NUM_SH];
+  memset(sh, 0, sizeof(sh));
+  for (int i = 0; i < NUM_SH; i++) {
+    sh[i].sh_name = shstrtab.len;
+    output_write(&shstrtab, names[i], strlen(names[i]) + 1);
+  }
+
+  sh[SH_TEXT].sh_type = SHT_PROGBITS;
+  sh[SH_TEXT].sh_flags = SHF_ALLOC | SHF_EXECINSTR;
+  sh[SH_TEXT].sh_addralign = 16;
+  sh[SH_DATA].sh_type = SHT_PROGBITS;
+  sh[SH_DATA].sh_flags = SHF_ALLOC | SHF_WRITE;
+  sh[SH_DATA].sh_addralign = 16;
+  for (int i = SH_RELA_TEXT; i <= SH_RELA_DATA; i++) {
+    sh[i].sh_type = SHT_RELA;
+    sh[i].sh_flags = SHF_INFO_LINK;
+    sh[i].sh_link = SH_SYMTAB;
+    sh[i].sh_info = i == SH_RELA_TEXT ? SH_TEXT : SH_DATA;
+    sh[i].sh_addralign = 8;
+    sh[i].sh_entsize = sizeof(Elf64_Rela);
+  }
+  sh[SH_SYMTAB].sh_type = SHT_SYMTAB;
+  sh[SH_SYMTAB].sh_link = SH_STRTAB;
+  sh[SH_SYMTAB].sh_info = first_global;
+  sh[SH_SYMTAB].sh_addralign = 8;
+  sh[SH_SYMTAB].sh_entsize = sizeof(Elf64_Sym);
+  sh[SH_STRTAB].sh_type = SHT_STRTAB;
+  sh[SH_STRTAB].sh_addralign = 1;
+  sh[SH_SHSTRTAB].sh_type = SHT_STRTAB;
+  sh[SH_SHSTRTAB].sh_addralign = 1;
+  sh[SH_NOTE_STACK].sh_type = SHT_PROGBITS;
+  sh[SH_NOTE_STACK].sh_addralign = 1;
+
+  // contents follow the ELF header in section order
+  long offset = sizeof(Elf64_Ehdr);
+  for (int i = 1; i < NUM_SH; i++) {
+    long align = sh[i].sh_addralign;
+    offset = (offset + align - 1) / align * align;
+    sh[i].sh_offset = offset;
+    sh[i].sh_size = contents[i] != NULL ? contents[i]->len : 0;
+    offset += sh[i].sh_size;
+  }
+  long shoff = (offset + 7) / 8 * 8;
+
+  Elf64_Ehdr eh;
+  memset(&eh, 0, sizeof(eh));
+  memcpy(eh.e_ident, ELFMAG, SELFMAG);
+  eh.e_ident[EI_CLASS] = ELFCLASS64;
+  eh.e_ident[EI_DATA] = ELFDATA2LSB;
+  eh.e_ident[EI_VERSION] = EV_CURRENT;
+  eh.e_ident[EI_OSABI] = ELFOSABI_SYSV;
+  eh.e_type = ET_REL;
+  eh.e_machine = EM_X86_64;
+  eh.e_version = EV_CURRENT;
+  eh.e_shoff = shoff;
+  eh.e_ehsize = sizeof(Elf64_Ehdr);
+  eh.e_shentsize = sizeof(Elf64_Shdr);
+  eh.e_shnum = NUM_SH;
+  eh.e_shstrndx = SH_SHSTRTAB;
+
+  static char zeros[16];
+  output_write(out, (char *)&eh, sizeof(eh));
+  long pos = sizeof(eh);
+  for (int i = 1; i < NUM_SH; i++) {
+    output_write(out, zeros, sh[i].sh_offset - pos);
+    if (contents[i] != NULL)
+      output_write(out, contents[i]->buf, contents[i]->len);
+    pos = sh[i].sh_offset + sh[i].sh_size;
+  }
+  output_write(out, zeros, shoff - pos);
+  output_write(out, (char *)sh, sizeof(sh));
+
+  output_release(&symtab);
+  output_release(&strtab);
+  output_release(&shstrtab);
+  for (int i = 0; i < NUM_SECTS; i++)
+    output_release(&rela[i]);
+}
+
+// assembles the text of the given length and writes the object to out.
+void assemble(char *text, int len, Output *out) {
+  for (int i = 0; i < NUM_SECTS; i++)
+    output_init(&sections[i], -1);
+  current_sect = SECT_TEXT;
+  symbols = map_new(NULL);
+  symbol_list = vector_new();
+  fixups = vector_new();
+  asm_line = 0;
+
+  for (char *p = text, *end = text + len; p < end;) {
+    char *eol = memchr(p, '\n', end - p);
+    if (eol == NULL)
+      eol = end;
+    asm_line++;
+    assemble_line(p, eol);
+    p = eol + 1;
+  }
+
+  write_elf(out);
+  for (int i = 0; i < NUM_SECTS; i++)
+    output_release(&sections[i]);
+}
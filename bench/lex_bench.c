@@ -0,0 +1,44 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/resource.h>
+#include <time.h>
+#include "../uoocc.h"
+
+// usage: lexbench.out [/path/to/input]
+int main(int argc, char **argv) {
+  if (argc != 2) {
+    fprintf(stderr, "usage: %s [/path/to/input]\n", argv[0]);
+    return 1;
+  }
+
+  FILE *fp = fopen(argv[1], "r");
+  if (fp == NULL) {
+    perror(argv[1]);
+    return 1;
+  }
+
+  struct timespec start, end;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  Compilation c = {0};
+  compilation = &c;
+  init_token_queue(fp);
+  int tokens = 1;
+  while (current_token().type != TK_EOF) {
+    next_token();
+    tokens++;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  long bytes = c.token_queue.source.len;
+  fclose(fp);
+
+  double sec =
+      (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  printf("%d tokens, %ld bytes in %.3f sec: %.0f tokens/sec, %.1f MB/s\n",
+         tokens, bytes, sec, tokens / sec, bytes / sec / 1e6);
+  printf("peak RSS %ld KB, arena memory %ld KB\n", usage.ru_maxrss,
+         (token_arena.reserved_bytes + intern_arena.reserved_bytes) / 1024);
+  return 0;
+}
@@ -0,0 +1,232 @@
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "uoocc.h"
+
+// The assembly of each function is kept in DIR/KEY.s, KEY being the digest
+// of the function, the declarations it can see, the compiler and the
+// optimizations. Label numbers depend on the rest of the file, so the entry
+// refers to them symbolically: .LF<n> is the n-th label of the function and
+// .LS<n> is the n-th string of the entry, whose spelling is listed in the
+// header. The time generating the function took tells what a hit saves.
+//
+//   uoocc function cache 2
+//   <nanoseconds of codegen>
+//   <number of strings>
+//   <one spelling per line>
+//   <assembly>
+
+#define CACHE_MAGIC "uoocc function cache 2\n"
+
+static unsigned long build_id;
+
+static void init_build_id(void) {
+  struct stat st;
+  build_id = DIGEST_INIT;
+  if (stat("/proc/self/exe", &st) == 0) {
+    long id[] = {st.st_ino, st.st_size, st.st_mtime};
+    build_id = digest_n(build_id, (char *)id, sizeof(id));
+  }
+}
+
+// identifies the build of the compiler, whose cached output is not valid
+// for any other build.
+unsigned long compiler_id(void) {
+  static pthread_once_t once = PTHREAD_ONCE_INIT;
+  pthread_once(&once, init_build_id);
+  return build_id;
+}
+
+static char *entry_path(unsigned long key) {
+  unsigned long id = compiler_id();
+  key = digest_n(key, (char *)&id, sizeof(id));
+  int levels[] = {compilation->opts->optimize, compilation->opts->peephole};
+  key = digest_n(key, (char *)levels, sizeof(levels));
+  char name[32];
+  snprintf(name, sizeof(name), "/%016lx.s", key);
+  return allocate_concat_2string(compilation->opts->cache_dir, name);
+}
+
+// returns the spelling of the string literal numbered label.
+static char *string_of_label(int label) {
+  Vector *v = compilation->string_table->vec;
+  int lo = 0, hi = v->size - 1;
+  while (lo <= hi) {
+    int mid = (lo + hi) / 2;
+    MapEntry *e = vector_at(v, mid);
+    if (*(int *)e->val == label)
+      return e->key;
+    if (*(int *)e->val < label)
+      lo = mid + 1;
+    else
+      hi = mid - 1;
+  }
+  return NULL;
+}
+
+static int is_digit(char c) {
+  return '0' <= c && c <= '9';
+}
+
+static long read_number(char **p, char *end) {
+  long n = 0;
+  while (*p < end && is_digit(**p))
+    n = n * 10 + (*(*p)++ - '0');
+  return n;
+}
+
+// copies the entry body in p[0..end) to out, the strings numbered from 0 in
+// the spellings before it and the labels from base. Returns 0 when the
+// entry is broken or names a string this file does not have.
+static int load_body(char *p, char *end, int base, int *labels,
+                     int num_strings, Output *out) {
+  // the spellings are looked up in this file's string table
+  for (int i = 0; i < num_strings; i++) {
+    char *line = ++p;
+    while (p < end && *p != '\n')
+      p++;
+    MapEntry *e = p < end ? map_get(compilation->string_table,
+                                    intern_string_n(line, p - line))
+                          : NULL;
+    if (e == NULL)
+      return 0;
+    labels[i] = *(int *)e->val;
+  }
+  if (p == end || *p++ != '\n')
+    return 0;
+
+  Output text;
+  output_init(&text, -1);
+  char *start = p;
+  while (p < end) {
+    if (end - p < 4 || p[0] != '.' || p[1] != 'L' ||
+        (p[2] != 'F' && p[2] != 'S') || !is_digit(p[3])) {
+      p++;
+      continue;
+    }
+    output_write(&text, start, p + 2 - start);
+    char kind = p[2];
+    int n = 0;
+    for (p += 3; p < end && is_digit(*p); p++)
+      n = n * 10 + (*p - '0');
+    if (kind == 'S' && n >= num_strings) {
+      output_release(&text);
+      return 0;
+    }
+    output_int(&text, kind == 'F' ? base + n : labels[n]);
+    start = p;
+  }
+  output_write(&text, start, end - start);
+  output_write(out, text.buf, text.len);
+  atomic_fetch_add(&compilation->cache_bytes, text.len);
+  output_release(&text);
+  return 1;
+}
+
+// writes the assembly of the function cached under key, its labels
+// numbered from base, to out. Returns 0 when there is no usable entry.
+int cache_load(unsigned long key, int base, Output *out) {
+  long t = time_now();
+  FILE *fp = fopen(entry_path(key), "r");
+  if (fp == NULL)
+    return 0;
+  Source src;
+  source_read(&src, fp);
+  fclose(fp);
+
+  char *p = src.buf, *end = src.buf + src.len;
+  int magic_len = strlen(CACHE_MAGIC);
+  if (end - p < magic_len || memcmp(p, CACHE_MAGIC, magic_len) != 0) {
+    source_release(&src);
+    return 0;
+  }
+  p += magic_len;
+
+  long codegen_time = read_number(&p, end);
+  if (p == end || *p++ != '\n') {
+    source_release(&src);
+    return 0;
+  }
+
+  int num_strings = read_number(&p, end);
+  int *labels = arena_alloc(&table_arena, (num_strings + 1) * sizeof(int));
+  int loaded = load_body(p, end, base, labels, num_strings, out);
+  arena_free(&table_arena, labels, (num_strings + 1) * sizeof(int));
+  source_release(&src);
+  if (loaded)
+    atomic_fetch_add(&compilation->cache_saved,
+                     codegen_time - (time_now() - t));
+  return loaded;
+}
+
+static int index_of_string(Vector *strings, char *s) {
+  for (int i = 0; i < strings->size; i++)
+    if (vector_at(strings, i) == s)
+      return i;
+  vector_push_back(strings, s);
+  return strings->size - 1;
+}
+
+// keeps the assembly of a function whose labels are numbered from base and
+// which took nanos to generate. The cache is an optimization, entries which
+// cannot be written are skipped.
+void cache_store(unsigned long key, int base, char *text, int len,
+                 long nanos) {
+  Vector *strings = vector_new();
+  Output body;
+  output_init(&body, -1);
+  char *p = text, *end = text + len, *start = text;
+  while (p < end) {
+    if (end - p < 3 || p[0] != '.' || p[1] != 'L' || !is_digit(p[2])) {
+      p++;
+      continue;
+    }
+    output_write(&body, start, p + 2 - start);
+    int n = 0;
+    for (p += 2; p < end && is_digit(*p); p++)
+      n = n * 10 + (*p - '0');
+    if (n >= base) {
+      output_write(&body, "F", 1);
+      output_int(&body, n - base);
+    } else {
+      // strings are numbered before any function
+      char *s = string_of_label(n);
+      if (s == NULL || strchr(s, '\n') != NULL) {
+        output_release(&body);
+        return;
+      }
+      output_write(&body, "S", 1);
+      output_int(&body, index_of_string(strings, s));
+    }
+    start = p;
+  }
+  output_write(&body, start, end - start);
+
+  // written under a temporary name, readers see whole entries only
+  char *path = entry_path(key);
+  char *tmp = allocate_concat_2string(path, ".XXXXXX");
+  int fd = mkstemp(tmp);
+  if (fd < 0) {
+    mkdir(compilation->opts->cache_dir, 0777);
+    tmp = allocate_concat_2string(path, ".XXXXXX");
+    fd = mkstemp(tmp);
+  }
+  FILE *fp = fd >= 0 ? fdopen(fd, "w") : NULL;
+  if (fp == NULL) {
+    if (fd >= 0)
+      close(fd);
+    output_release(&body);
+    return;
+  }
+  fprintf(fp, "%s%ld\n%d\n", CACHE_MAGIC, nanos, strings->size);
+  for (int i = 0; i < strings->size; i++)
+    fprintf(fp, "%s\n", (char *)vector_at(strings, i));
+  fwrite(body.buf, 1, body.len, fp);
+  int failed = ferror(fp);
+  if (fclose(fp) != 0 || failed || rename(tmp, path) != 0)
+    unlink(tmp);
+  output_release(&body);
+}
@@ -0,0 +1,210 @@
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "uoocc.h"
+
+// -Idir, -Dname and -jN also accept the argument as the next word.
+static char *option_arg(int argc, char **argv, int *i) {
+  if (argv[*i][2] != '\0')
+    return argv[*i] + 2;
+  if (*i + 1 == argc)
+    error(allocate_concat_3string("missing argument to '", argv[*i], "'"));
+  return argv[++*i];
+}
+
+// parses the arguments into opts, the input files and the -o file. -I, -D
+// and -U go to the preprocessor.
+void parse_options(int argc, char **argv, Options *opts, Vector *inputs,
+                   char **output) {
+  Options defaults = {.jobs = 1};
+  *opts = defaults;
+  *output = NULL;
+  for (int i = 0; i < argc; i++) {
+    if (strcmp(argv[i], "-fmem-report") == 0)
+      opts->mem_report = 1;
+    else if (strncmp(argv[i], "-fserver=", 9) == 0)
+      opts->server = argv[i] + 9;
+    else if (strncmp(argv[i], "-fcache=", 8) == 0)
+      opts->cache_dir = argv[i] + 8;
+    else if (strcmp(argv[i], "-fcache-report") == 0)
+      opts->cache_report = 1;
+    else if (strncmp(argv[i], "-fpch=", 6) == 0)
+      opts->pch = argv[i] + 6;
+    else if (strcmp(argv[i], "-fpch-create") == 0)
+      opts->pch_create = 1;
+    else if (strcmp(argv[i], "-ftime-report") == 0)
+      opts->time_report = 1;
+    else if (strncmp(argv[i], "-ftime-trace=", 13) == 0)
+      opts->time_trace = argv[i] + 13;
+    else if (strcmp(argv[i], "-fpeephole") == 0)
+      opts->peephole = 1;
+    else if (strcmp(argv[i], "-fpeephole-report") == 0)
+      opts->peephole_report = 1;
+    else if (strcmp(argv[i], "-E") == 0)
+      opts->preprocess_only = 1;
+    else if (strcmp(argv[i], "-c") == 0)
+      opts->object = 1;
+    else if (strcmp(argv[i], "-O") == 0)
+      opts->optimize = 1;
+    else if (strncmp(argv[i], "-O", 2) == 0)
+      opts->optimize = atoi(argv[i] + 2);
+    else if (strncmp(argv[i], "-j", 2) == 0)
+      opts->jobs = atoi(option_arg(argc, argv, &i));
+    else if (strncmp(argv[i], "-o", 2) == 0)
+      *output = option_arg(argc, argv, &i);
+    else if (strncmp(argv[i], "-I", 2) == 0)
+      pp_add_include_path(option_arg(argc, argv, &i));
+    else if (strncmp(argv[i], "-D", 2) == 0)
+      pp_define(option_arg(argc, argv, &i));
+    else if (strncmp(argv[i], "-U", 2) == 0)
+      pp_undef(option_arg(argc, argv, &i));
+    else if (argv[i][0] != '-')
+      vector_push_back(inputs, argv[i]);
+    else
+      error(allocate_concat_3string("unknown option '", argv[i], "'"));
+  }
+  if (opts->optimize > 0)
+    opts->peephole = 1;
+}
+
+// like gcc, the output of dir/name.c is name.o or name.s in the working
+// directory. The name is interned because every compilation releases the
+// arenas of its thread.
+char *default_output(char *input, int object) {
+  char *base = strrchr(input, '/') != NULL ? strrchr(input, '/') + 1 : input;
+  int len = strlen(base);
+  if (len > 2 && strcmp(base + len - 2, ".c") == 0)
+    len -= 2;
+  return intern_string(allocate_concat_2string(
+      arena_strndup(&string_arena, base, len), object ? ".o" : ".s"));
+}
+
+// reads the file, or stdin when input is NULL.
+void read_input(char *input, Source *src) {
+  FILE *fp = stdin;
+  if (input != NULL && (fp = fopen(input, "r")) == NULL)
+    error(allocate_concat_3string("cannot open '", input, "'"));
+  source_read(src, fp);
+  if (fp != stdin)
+    fclose(fp);
+}
+
+// returns the descriptor of the output file, stdout when output is NULL.
+int open_output(char *output) {
+  int fd = 1;
+  if (output != NULL &&
+      (fd = open(output, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0)
+    error(allocate_concat_3string("cannot open '", output, "'"));
+  return fd;
+}
+
+// compiles the source, which the compilation takes over, and writes the
+// preprocessed source, the assembly or with -c the object to out. Whatever
+// is left in c after an error is freed by compilation_release.
+void compile_source(Compilation *c, Source *src, Options *opts, Output *out) {
+  compilation = c;
+  c->opts = opts;
+  c->token_queue.source = *src;
+  src = &c->token_queue.source;
+  long t = time_now();
+  if (preprocess_needed(src)) {
+    output_init(&c->scratch, -1);
+    preprocess(src, c->input != NULL ? c->input : "<stdin>", &c->scratch);
+    source_release(src);
+    src->buf = c->scratch.buf;
+    src->len = c->scratch.len;
+    c->scratch.buf = NULL;
+    time_phase("preprocess", t);
+  }
+  if (opts->preprocess_only) {
+    output_write(out, src->buf, src->len);
+    source_release(src);
+    return;
+  }
+
+  // tokens are lexed on demand, the lexer is timed with the parser
+  t = time_now();
+  init_token_queue_source(src);
+  c->token_queue.digesting = opts->cache_dir != NULL;
+  c->string_table = map_new(NULL);
+  c->typedef_table = map_new(NULL);
+  symbol_table = map_new(NULL);
+  time_phase("init_token_queue", t);
+  t = time_now();
+  Vector *globals = opts->pch != NULL ? adopt_snapshot(opts->pch) : NULL;
+  if (globals != NULL)
+    time_phase("adopt_snapshot", t);
+  t = time_now();
+  Vector *v = program();
+  time_phase("program", t);
+
+  t = time_now();
+  analyze_program(v, opts->jobs);
+  time_phase("semantic_analysis", t);
+  if (globals != NULL) {
+    // the variables of the header come first, as they would when parsed
+    for (int i = 0; i < v->size; i++)
+      vector_push_back(globals, vector_at(v, i));
+    v = globals;
+  }
+  if (opts->pch_create) {
+    write_snapshot(v, out);
+    compilation_release(c);
+    symbol_table = NULL;
+    return;
+  }
+
+  // with -c the assembly is kept in memory and assembled into an object
+  if (opts->object)
+    output_init(&c->scratch, -1);
+  asm_output = opts->object ? &c->scratch : out;
+  t = time_now();
+  emit_literal("\t.global main\n");
+  emit_string();
+  time_phase("emit_string", t);
+  t = time_now();
+  codegen_program(v, opts->jobs);
+  time_phase("codegen", t);
+  if (opts->object) {
+    t = time_now();
+    assemble(c->scratch.buf, c->scratch.len, out);
+    time_phase("assemble", t);
+  }
+  compilation_release(c);
+
+  if (opts->mem_report)
+    arena_print_stats(stderr);
+  if (opts->cache_report)
+    fprintf(stderr,
+            "function cache: %d hits, %d misses, %ld bytes reused, "
+            "%.3f ms saved\n",
+            atomic_load(&c->cache_hits), atomic_load(&c->cache_misses),
+            atomic_load(&c->cache_bytes), atomic_load(&c->cache_saved) / 1e6);
+  if (opts->peephole_report)
+    peephole_report(stderr);
+  if (opts->time_report)
+    time_report(stderr);
+  symbol_table = NULL;
+}
+
+// frees the source and the buffers of the compilation. The arenas stay.
+void compilation_release(Compilation *c) {
+  source_release(&c->token_queue.source);
+  free(c->scratch.buf);
+  c->scratch.buf = NULL;
+  c->scratch.len = c->scratch.cap = 0;
+}
+
+// compiles c->input into c->output.
+void compile(Compilation *c, Options *opts) {
+  Source src;
+  read_input(c->input, &src);
+  Output out;
+  int fd = open_output(c->output);
+  output_init(&out, fd);
+  compile_source(c, &src, opts, &out);
+  output_release(&out);
+  if (fd != 1)
+    close(fd);
+}
@@ -1,11 +1,12 @@
+#include <stdlib.h>
 #include "uoocc.h"
 
 void emit_string(void) {
-  Vector *v = string_table->vec;
+  Vector *v = compilation->string_table->vec;
   for (int i = 0; i < v->size; i++) {
     MapEntry *e = vector_at(v, i);
-    printf(".L%d:\n", *(int *)(e->val));
-    printf("\t.string %s\n", e->key);
+    emit(".L%d:\n", *(int *)(e->val));
+    emit("\t.string %s\n", e->key);
   }
 }
 
@@ -14,17 +15,17 @@ static void emit_lvalue(Ast *p) {
     codegen(p->left);
   } else if (p->type == AST_VAR) {
     if (p->symbol_table_entry->is_global) {
-      printf("\tleaq %s(%%rip), %%rax\n", p->ident);
-      printf("\tpushq %%rax\n");
+      emit("\tleaq %s(%%rip), %%rax\n", p->ident);
+      emit_literal("\tpushq %rax\n");
     } else {
-      printf("\tleaq %d(%%rbp), %%rax\n", -p->symbol_table_entry->offset);
-      printf("\tpushq %%rax\n");
+      emit("\tleaq %d(%%rbp), %%rax\n", -p->symbol_table_entry->offset);
+      emit_literal("\tpushq %rax\n");
     }
   } else if (p->type == AST_OP_DOT) {
     emit_lvalue(p->left);
-    printf("\tpopq %%rax\n");
-    printf("\taddq $%d, %%rax\n", p->offset_from_bp);
-    printf("\tpushq %%rax\n");
+    emit_literal("\tpopq %rax\n");
+    emit("\taddq $%d, %%rax\n", p->offset_from_bp);
+    emit_literal("\tpushq %rax\n");
   }
 }
 
@@ -46,8 +47,417 @@ static int get_shift_length(CType *ctype) {
     return 3;
 }
 
-int loop_start = -1;
-int loop_end = -1;
+// per-thread state of the function being generated
+static _Thread_local int loop_start = -1;
+static _Thread_local int loop_end = -1;
+static _Thread_local int next_label;
+static _Thread_local int return_label;  // of the epilogue with -O1
+static _Thread_local Map *function_table;
+
+// labels are numbered from the base given to each function, so that
+// functions can be generated in any order with the same result.
+static int new_label(void) {
+  return next_label++;
+}
+
+// builds lvalue = lvalue +/- 1 in the scope of the current function.
+static Ast *make_step_assign(int type, Ast *lvalue, Token token) {
+  Map *saved = symbol_table;
+  symbol_table = function_table;
+  Ast *right = make_ast_op(type, lvalue, make_ast_int(1), token);
+  Ast *node = make_ast_op(AST_OP_ASSIGN, lvalue, right, token);
+  node = semantic_analysis(node);
+  symbol_table = saved;
+  return node;
+}
+
+static int optimizing(void) {
+  return compilation->opts->optimize > 0;
+}
+
+// the size of the memory which holds a value of the type.
+static int access_size(CType *ctype) {
+  if (ctype->type == TYPE_CHAR)
+    return 1;
+  if (ctype->type == TYPE_INT)
+    return 4;
+  return 8;
+}
+
+static int lower(Ast *p);
+
+static int lower_op(int op, int dst, int src) {
+  ir_add(op, dst, src);
+  return dst;
+}
+
+static int lower_op_imm(int op, int dst, int imm) {
+  ir_add(op, dst, -1)->imm = imm;
+  return dst;
+}
+
+static int lower_load(int op, int src, int imm, int size) {
+  Ins *in = ir_add(op, ir_new_reg(), src);
+  in->imm = imm;
+  in->size = size;
+  return in->dst;
+}
+
+// the address of the lvalue in a virtual register, like emit_lvalue.
+static int lower_lvalue(Ast *p) {
+  if (p->type == AST_OP_DEREF)
+    return lower(p->left);
+  if (p->type == AST_VAR && p->symbol_table_entry->is_global) {
+    Ins *in = ir_add(IR_GLOBAL_ADDR, ir_new_reg(), -1);
+    in->sym = p->ident;
+    return in->dst;
+  }
+  if (p->type == AST_VAR)
+    return lower_load(IR_LOCAL_ADDR, -1, -p->symbol_table_entry->offset, 0);
+  if (p->type == AST_OP_DOT)
+    return lower_op_imm(IR_ADD, lower_lvalue(p->left), p->offset_from_bp);
+  error_with_token(p->token, "lvalue required");
+  return -1;
+}
+
+// stores v into the lvalue at addr, variables are written directly.
+static void lower_store(Ast *lvalue, int addr, int v) {
+  Ins *in;
+  if (lvalue->type == AST_VAR && lvalue->symbol_table_entry->is_global) {
+    in = ir_add(IR_STORE_GLOBAL, -1, v);
+    in->sym = lvalue->symbol_table_entry->ident;
+  } else if (lvalue->type == AST_VAR) {
+    in = ir_add(IR_STORE_LOCAL, -1, v);
+    in->imm = -lvalue->symbol_table_entry->offset;
+  } else {
+    in = ir_add(IR_STORE, addr, v);
+  }
+  // like the stack machine, everything but pointers and chars as int
+  in->size = lvalue->ctype->type == TYPE_PTR    ? 8
+             : lvalue->ctype->type == TYPE_CHAR ? 1
+                                                : 4;
+}
+
+// lvalue++ and the like, the old or the new value is the result.
+static int lower_step(Ast *p) {
+  int post = p->type == AST_OP_POST_INC || p->type == AST_OP_POST_DEC;
+  int inc = p->type == AST_OP_POST_INC || p->type == AST_OP_PRE_INC;
+  if (p->left->ctype->type != TYPE_INT) {
+    // a char is stored back truncated and a pointer steps by the size of
+    // its target, as in lvalue = lvalue +/- 1. The operand is a variable,
+    // so loading it again for the old value has no side effects.
+    int v = post ? lower(p->left) : -1;
+    int w = lower(make_step_assign(inc ? AST_OP_ADD : AST_OP_SUB, p->left,
+                                   p->token));
+    return post ? v : w;
+  }
+  int addr = lower_lvalue(p->left);
+  int v = post ? lower_load(IR_LOAD, addr, 0, 4) : -1;
+  ir_add(inc ? IR_INC : IR_DEC, -1, addr);
+  return post ? v : lower_load(IR_LOAD, addr, 0, 4);
+}
+
+// pointer arithmetic scales like the stack machine does.
+static int lower_add(Ast *p) {
+  CType *ltype = p->left->ctype, *rtype = p->right->ctype;
+  int op = p->type == AST_OP_ADD ? IR_ADD : IR_SUB;
+  int l = lower(p->left);
+  int r = lower(p->right);
+  if ((ltype->type == TYPE_INT || ltype->type == TYPE_CHAR) &&
+      (rtype->type == TYPE_INT || rtype->type == TYPE_CHAR))
+    return lower_op(op, l, r);
+  if (ltype->ptrof != NULL && ltype->ptrof->type == TYPE_ARRAY) {
+    lower_op_imm(IR_MUL, r, get_array_size(ltype->ptrof));
+    lower_op_imm(IR_SHL, r, get_shift_length(ltype));
+  } else if (rtype->ptrof != NULL && rtype->ptrof->type == TYPE_ARRAY) {
+    lower_op_imm(IR_MUL, l, get_array_size(rtype->ptrof));
+    lower_op_imm(IR_SHL, l, get_shift_length(rtype));
+  } else if (ltype->type == TYPE_PTR && rtype->type == TYPE_PTR) {
+    lower_op(IR_SUB, l, r);
+    return lower_op_imm(IR_SAR, l, get_shift_length(ltype));
+  } else if (ltype->type == TYPE_INT) {
+    lower_op_imm(IR_SHL, l, get_shift_length(rtype));
+  } else {
+    lower_op_imm(IR_SHL, r, get_shift_length(ltype));
+  }
+  return lower_op(op, l, r);
+}
+
+static int is_comparison(Ast *p) {
+  return p->type == AST_OP_LT || p->type == AST_OP_LE ||
+         p->type == AST_OP_EQUAL || p->type == AST_OP_NEQUAL;
+}
+
+// the condition code under which the comparison p holds, or fails.
+static char *condition_code(Ast *p, int holds) {
+  static char *codes[][2] = {
+      [AST_OP_LT] = {"ge", "l"},
+      [AST_OP_LE] = {"g", "le"},
+      [AST_OP_EQUAL] = {"ne", "e"},
+      [AST_OP_NEQUAL] = {"e", "ne"},
+  };
+  return codes[p->type][holds];
+}
+
+static int lower_compare(Ast *p) {
+  int l = lower(p->left);
+  int r = lower(p->right);
+  ir_add(IR_SET, l, r)->sym = condition_code(p, 1);
+  return l;
+}
+
+// jumps to label when the truth of p is jump_if and falls through
+// otherwise. The right operand of && and || is skipped when the left one
+// decides, and a comparison jumps on its flags.
+static void lower_branch(Ast *p, int jump_if, int label) {
+  if (p->type == AST_OP_L_NOT) {
+    lower_branch(p->left, !jump_if, label);
+    return;
+  }
+  if (p->type == AST_OP_L_AND || p->type == AST_OP_L_OR) {
+    if ((p->type == AST_OP_L_OR) == jump_if) {
+      lower_branch(p->left, jump_if, label);
+      lower_branch(p->right, jump_if, label);
+    } else {
+      int skip = new_label();
+      lower_branch(p->left, !jump_if, skip);
+      lower_branch(p->right, jump_if, label);
+      ir_add(IR_LABEL, -1, -1)->label = skip;
+    }
+    return;
+  }
+  Ins *in;
+  if (is_comparison(p)) {
+    int l = lower(p->left);
+    if (p->right->type == AST_INT) {
+      in = ir_add(IR_BRANCH, l, -1);
+      in->imm = p->right->ival;
+    } else {
+      in = ir_add(IR_BRANCH, l, lower(p->right));
+    }
+    in->sym = condition_code(p, jump_if);
+  } else {
+    in = ir_add(IR_BRANCH, lower(p), -1);
+    in->sym = jump_if ? "ne" : "e";
+  }
+  in->label = label;
+}
+
+// 1 or 0 of && and ||, after jumping out at the operand which decides.
+static int lower_logical(Ast *p) {
+  int jump_if = p->type == AST_OP_L_OR;
+  int decided = new_label();
+  int end = new_label();
+  int v = ir_new_reg();
+  lower_branch(p, jump_if, decided);
+  lower_op_imm(IR_IMM, v, !jump_if);
+  ir_add(IR_JMP, -1, -1)->label = end;
+  ir_add(IR_LABEL, -1, -1)->label = decided;
+  lower_op_imm(IR_IMM, v, jump_if);
+  ir_add(IR_LABEL, -1, -1)->label = end;
+  return v;
+}
+
+static int lower_call(Ast *p) {
+  // the arguments are evaluated from the last like on the stack machine
+  int n = p->args->size;
+  int *args = arena_alloc(&table_arena, (n + 1) * sizeof(int));
+  for (int i = n - 1; i >= 0; i--)
+    args[i] = lower(vector_at(p->args, i));
+  Ins *in = ir_add(IR_CALL, ir_new_reg(), -1);
+  in->sym = p->ident;
+  in->args = args;
+  in->num_args = n;
+  return in->dst;
+}
+
+// lowers the expression into instructions on virtual registers and returns
+// the register of its value, which the caller may overwrite.
+static int lower(Ast *p) {
+  static int binary_ops[] = {
+      [AST_OP_MUL] = IR_MUL,    [AST_OP_DIV] = IR_DIV,
+      [AST_OP_B_AND] = IR_AND,  [AST_OP_B_XOR] = IR_XOR,
+      [AST_OP_B_OR] = IR_OR,    [AST_OP_LSHIFT] = IR_SHL,
+      [AST_OP_RSHIFT] = IR_SAR,
+  };
+  switch (p->type) {
+    case AST_INT:
+      return lower_op_imm(IR_IMM, ir_new_reg(), p->ival);
+    case AST_STR:
+      return lower_load(IR_LABEL_ADDR, -1, p->label, 0);
+    case AST_OP_ADD:
+    case AST_OP_SUB:
+      return lower_add(p);
+    case AST_OP_MUL:
+    case AST_OP_DIV:
+    case AST_OP_B_AND:
+    case AST_OP_B_XOR:
+    case AST_OP_B_OR:
+    case AST_OP_LSHIFT:
+    case AST_OP_RSHIFT: {
+      int l = lower(p->left);
+      return lower_op(binary_ops[p->type], l, lower(p->right));
+    }
+    case AST_OP_ASSIGN: {
+      // the address is taken first, like on the stack machine
+      int addr = p->left->type == AST_VAR ? -1 : lower_lvalue(p->left);
+      int v = lower(p->right);
+      lower_store(p->left, addr, v);
+      return v;
+    }
+    case AST_OP_POST_INC:
+    case AST_OP_POST_DEC:
+    case AST_OP_PRE_INC:
+    case AST_OP_PRE_DEC:
+      return lower_step(p);
+    case AST_OP_L_AND:
+    case AST_OP_L_OR:
+      return lower_logical(p);
+    case AST_OP_B_NOT:
+      return lower_op(IR_NOT, lower(p->left), -1);
+    case AST_OP_L_NOT: {
+      int v = lower(p->left);
+      ir_add(IR_SET, v, -1)->sym = "e";
+      return v;
+    }
+    case AST_OP_REF:
+      return lower_lvalue(p->left);
+    case AST_OP_DEREF:
+      return lower_load(IR_LOAD, lower(p->left), 0, access_size(p->ctype));
+    case AST_OP_LT:
+    case AST_OP_LE:
+    case AST_OP_EQUAL:
+    case AST_OP_NEQUAL:
+      return lower_compare(p);
+    case AST_OP_DOT:
+      return lower_load(IR_LOAD, lower_lvalue(p->left), p->offset_from_bp,
+                        access_size(p->ctype));
+    case AST_VAR:
+      if (p->symbol_table_entry->is_global) {
+        Ins *in = ir_add(IR_LOAD_GLOBAL, ir_new_reg(), -1);
+        in->sym = p->symbol_table_entry->ident;
+        in->size = access_size(p->ctype);
+        return in->dst;
+      }
+      return lower_load(IR_LOAD_LOCAL, -1, -p->symbol_table_entry->offset,
+                        access_size(p->ctype));
+    case AST_CALL_FUNC:
+      return lower_call(p);
+  }
+  error_with_token(p->token, "cannot generate the expression");
+  return -1;
+}
+
+// evaluates the expression into %rax. Only its effects matter when value
+// is 0.
+static void codegen_expr(Ast *p, int value) {
+  if (!optimizing()) {
+    codegen(p);
+    emit_literal("\tpopq %rax\n");
+    return;
+  }
+  if (p != NULL) {
+    int v = lower(p);
+    ir_flush(value ? v : -1);
+  }
+}
+
+// jumps to label when the truth of the condition is jump_if and falls
+// through otherwise. && and || jump without computing 1 or 0, ! swaps the
+// targets and a comparison is a cmp and a jcc.
+static void codegen_branch(Ast *p, int jump_if, int label) {
+  if (optimizing()) {
+    lower_branch(p, jump_if, label);
+    ir_flush(-1);
+    return;
+  }
+  if (p->type == AST_OP_L_NOT) {
+    codegen_branch(p->left, !jump_if, label);
+    return;
+  }
+  if (is_comparison(p)) {
+    codegen(p->left);
+    if (p->right->type == AST_INT) {
+      emit_literal("\tpopq %rax\n");
+      emit("\tcmpq $%d, %%rax\n", p->right->ival);
+    } else {
+      codegen(p->right);
+      emit_literal("\tpopq %rdx\n");
+      emit_literal("\tpopq %rax\n");
+      emit_literal("\tcmpq %rdx, %rax\n");
+    }
+    emit("\tj%s .L%d\n", condition_code(p, jump_if), label);
+    return;
+  }
+  if (p->type == AST_OP_L_AND || p->type == AST_OP_L_OR) {
+    if ((p->type == AST_OP_L_OR) == jump_if) {
+      codegen_branch(p->left, jump_if, label);
+      codegen_branch(p->right, jump_if, label);
+    } else {
+      int skip = new_label();
+      codegen_branch(p->left, !jump_if, skip);
+      codegen_branch(p->right, jump_if, label);
+      emit(".L%d:\n", skip);
+    }
+    return;
+  }
+  codegen_expr(p, 1);
+  emit_literal("\ttest %rax, %rax\n");
+  emit("\t%s .L%d\n", jump_if ? "jnz" : "jz", label);
+}
+
+// the parameters are stored to their slots in the frame.
+static void store_params(Ast *p) {
+  for (int i = 0; i < (p->args->size > 6 ? 6 : p->args->size); i++) {
+    Ast *node = vector_at(p->args, i);
+    char *s = node->ident;
+    char *reg8[] = {"dil", "sil", "dl", "cl", "r8b", "r9b"};
+    char *reg32[] = {"edi", "esi", "edx", "ecx", "r8d", "r9d"};
+    char *reg64[] = {"rdi", "rsi", "rdx", "rcx", "r8", "r9"};
+    if (node->ctype->type == TYPE_CHAR)
+      emit("\tmovb %%%s, %d(%%rbp)\n", reg8[i],
+           -((SymbolTableEntry *)map_get(function_table, s)->val)->offset);
+    else if (node->ctype->type == TYPE_INT)
+      emit("\tmovl %%%s, %d(%%rbp)\n", reg32[i],
+           -((SymbolTableEntry *)map_get(function_table, s)->val)->offset);
+    else
+      emit("\tmovq %%%s, %d(%%rbp)\n", reg64[i],
+           -((SymbolTableEntry *)map_get(function_table, s)->val)->offset);
+  }
+}
+
+// like AST_DECL_FUNC, but the body is generated first so that the frame
+// has room for the spill slots and the callee saved registers in use are
+// known. Every return jumps to the shared epilogue.
+static void codegen_function(Ast *p) {
+  return_label = new_label();
+  ir_begin_function(p->offset_from_bp);
+  Output *out = asm_output;
+  Output body;
+  output_init(&body, -1);
+  asm_output = &body;
+  codegen(p->statement);
+  asm_output = out;
+
+  emit_literal(".text\n");
+  emit("%s:\n", p->ident);
+  emit_literal("\tpushq %rbp\n");
+  emit_literal("\tpushq %r12\n");
+  ir_save_registers();
+  emit_literal("\tmovq %rsp, %rbp\n");
+  int frame = (ir_frame_size() + 15) & ~15;
+  if (frame > 0)
+    emit("\tsub $%d, %%rsp\n", frame);
+  store_params(p);
+  output_write(asm_output, body.buf, body.len);
+  output_release(&body);
+  emit(".L%d:\n", return_label);
+  emit_literal("\tmovq %rbp, %rsp\n");
+  ir_restore_registers();
+  emit_literal("\tpopq %r12\n");
+  emit_literal("\tpopq %rbp\n");
+  emit_literal("\tret\n");
+}
 
 void codegen(Ast *p) {
   if (p == NULL)
@@ -58,89 +468,86 @@ void codegen(Ast *p) {
 
   switch (p->type) {
     case AST_INT:
-      printf("\tpushq $%d\n", p->ival);
+      emit("\tpushq $%d\n", p->ival);
       break;
     case AST_STR:
-      printf("\tpushq $.L%d\n", p->label);
+      emit("\tpushq $.L%d\n", p->label);
       break;
     case AST_OP_ADD:
     case AST_OP_SUB:
       codegen(p->left);
       codegen(p->right);
-      printf("\tpopq %%rdx\n");  // right
-      printf("\tpopq %%rax\n");  // left
+      emit_literal("\tpopq %rdx\n");  // right
+      emit_literal("\tpopq %rax\n");  // left
       if ((ltype->type == TYPE_INT || ltype->type == TYPE_CHAR) &&
           (rtype->type == TYPE_INT || rtype->type == TYPE_CHAR))
-        printf("\t%s %%rdx, %%rax\n", p->type == AST_OP_ADD ? "addq" : "subq");
+        emit("\t%s %%rdx, %%rax\n", p->type == AST_OP_ADD ? "addq" : "subq");
       else if (ltype->ptrof != NULL && ltype->ptrof->type == TYPE_ARRAY) {
-        printf("\timul $%d, %%rdx\n", get_array_size(ltype->ptrof));
-        printf("\tsalq $%d, %%rdx\n", get_shift_length(ltype));
-        printf("\t%s %%rdx, %%rax\n", p->type == AST_OP_ADD ? "addq" : "subq");
+        emit("\timul $%d, %%rdx\n", get_array_size(ltype->ptrof));
+        emit("\tsalq $%d, %%rdx\n", get_shift_length(ltype));
+        emit("\t%s %%rdx, %%rax\n", p->type == AST_OP_ADD ? "addq" : "subq");
       } else if (rtype->ptrof != NULL && rtype->ptrof->type == TYPE_ARRAY) {
-        printf("\timul $%d, %%rax\n", get_array_size(rtype->ptrof));
-        printf("\tsalq $%d, %%rax\n", get_shift_length(rtype));
-        printf("\t%s %%rdx, %%rax\n", p->type == AST_OP_ADD ? "addq" : "subq");
+        emit("\timul $%d, %%rax\n", get_array_size(rtype->ptrof));
+        emit("\tsalq $%d, %%rax\n", get_shift_length(rtype));
+        emit("\t%s %%rdx, %%rax\n", p->type == AST_OP_ADD ? "addq" : "subq");
       } else if (ltype->type == TYPE_PTR && rtype->type == TYPE_PTR) {
-        printf("\tsubq %%rdx, %%rax\n");
-        printf("\tsarq $%d, %%rax\n", get_shift_length(ltype));
+        emit_literal("\tsubq %rdx, %rax\n");
+        emit("\tsarq $%d, %%rax\n", get_shift_length(ltype));
       } else {
         if (ltype->type == TYPE_INT)
-          printf("\tsalq $%d, %%rax\n", get_shift_length(rtype));
+          emit("\tsalq $%d, %%rax\n", get_shift_length(rtype));
         else
-          printf("\tsalq $%d, %%rdx\n", get_shift_length(ltype));
-        printf("\t%s %%rdx, %%rax\n", p->type == AST_OP_ADD ? "addq" : "subq");
+          emit("\tsalq $%d, %%rdx\n", get_shift_length(ltype));
+        emit("\t%s %%rdx, %%rax\n", p->type == AST_OP_ADD ? "addq" : "subq");
       }
-      printf("\tpushq %%rax\n");
+      emit_literal("\tpushq %rax\n");
       break;
     case AST_OP_MUL:
     case AST_OP_DIV:
       codegen(p->left);
       codegen(p->right);
-      printf("\tpopq %%rdi\n");
-      printf("\tpopq %%rax\n");
+      emit_literal("\tpopq %rdi\n");
+      emit_literal("\tpopq %rax\n");
       if (p->type == AST_OP_MUL)
-        printf("\tmul %%rdi\n");
+        emit_literal("\tmul %rdi\n");
       else {
-        printf("\txor %%rdx, %%rdx\n");
-        printf("\tdiv %%rdi\n");
+        emit_literal("\txor %rdx, %rdx\n");
+        emit_literal("\tdiv %rdi\n");
       }
-      printf("\tpushq %%rax\n");
+      emit_literal("\tpushq %rax\n");
       break;
     case AST_OP_ASSIGN:
       emit_lvalue(p->left);
       codegen(p->right);
-      printf("\tpopq %%rdi\n");
-      printf("\tpopq %%rax\n");
+      emit_literal("\tpopq %rdi\n");
+      emit_literal("\tpopq %rax\n");
       if (p->left->ctype->type == TYPE_PTR)
-        printf("\tmovq %%rdi, (%%rax)\n");
+        emit_literal("\tmovq %rdi, (%rax)\n");
       else if (p->left->ctype->type == TYPE_CHAR) {
-        printf("\tmovb %%dil, (%%rax)\n");
+        emit_literal("\tmovb %dil, (%rax)\n");
       } else
-        printf("\tmovl %%edi, (%%rax)\n");
-      printf("\tpushq %%rdi\n");
+        emit_literal("\tmovl %edi, (%rax)\n");
+      emit_literal("\tpushq %rdi\n");
       break;
     case AST_OP_POST_INC:
     case AST_OP_POST_DEC:
       // TODO: char type
       emit_lvalue(p->left);
-      printf("\tpopq %%rax\n");
+      emit_literal("\tpopq %rax\n");
       if (ltype->type == TYPE_INT) {
-        printf("\tmovslq (%%rax), %%rdx\n");
-        printf("\tpushq %%rdx\n");
+        emit_literal("\tmovslq (%rax), %rdx\n");
+        emit_literal("\tpushq %rdx\n");
       } else {
-        printf("\tpushq (%%rax)\n");
+        emit_literal("\tpushq (%rax)\n");
       }
 
       if (ltype->type == TYPE_INT) {
-        printf("\t%s (%%rax)\n", p->type == AST_OP_POST_INC ? "incl" : "decl");
+        emit("\t%s (%%rax)\n", p->type == AST_OP_POST_INC ? "incl" : "decl");
       } else {
-        Ast *right =
-            make_ast_op(p->type == AST_OP_POST_INC ? AST_OP_ADD : AST_OP_SUB,
-                        p->left, make_ast_int(1), p->token);
-        Ast *node = make_ast_op(AST_OP_ASSIGN, p->left, right, p->token);
-        node = semantic_analysis(node);
-        codegen(node);
-        printf("\tpopq %%rax\n");
+        codegen(make_step_assign(
+            p->type == AST_OP_POST_INC ? AST_OP_ADD : AST_OP_SUB, p->left,
+            p->token));
+        emit_literal("\tpopq %rax\n");
       }
       break;
     case AST_OP_PRE_INC:
@@ -148,46 +555,43 @@ void codegen(Ast *p) {
       // TODO: char type
       if (ltype->type == TYPE_INT) {
         emit_lvalue(p->left);
-        printf("\tpopq %%rax\n");
-        printf("\t%s (%%rax)\n", p->type == AST_OP_PRE_INC ? "incl" : "decl");
-        printf("\tmovslq (%%rax), %%rax\n");
-        printf("\tpushq %%rax\n");
+        emit_literal("\tpopq %rax\n");
+        emit("\t%s (%%rax)\n", p->type == AST_OP_PRE_INC ? "incl" : "decl");
+        emit_literal("\tmovslq (%rax), %rax\n");
+        emit_literal("\tpushq %rax\n");
       } else {
-        Ast *right =
-            make_ast_op(p->type == AST_OP_PRE_INC ? AST_OP_ADD : AST_OP_SUB,
-                        p->left, make_ast_int(1), p->token);
-        Ast *node = make_ast_op(AST_OP_ASSIGN, p->left, right, p->token);
-        node = semantic_analysis(node);
-        codegen(node);
+        codegen(make_step_assign(
+            p->type == AST_OP_PRE_INC ? AST_OP_ADD : AST_OP_SUB, p->left,
+            p->token));
       }
       break;
     case AST_OP_B_NOT:
       codegen(p->left);
-      printf("\tpopq %%rax\n");
-      printf("\tnot %%rax\n");
-      printf("\tpushq %%rax\n");
+      emit_literal("\tpopq %rax\n");
+      emit_literal("\tnot %rax\n");
+      emit_literal("\tpushq %rax\n");
       break;
     case AST_OP_L_NOT:
       codegen(p->left);
-      printf("\tpopq %%rax\n");
-      printf("\tcmpq $0, %%rax\n");
-      printf("\tsete %%al\n");
-      printf("\tmovzbq %%al, %%rax\n");
-      printf("\tpushq %%rax\n");
+      emit_literal("\tpopq %rax\n");
+      emit_literal("\tcmpq $0, %rax\n");
+      emit_literal("\tsete %al\n");
+      emit_literal("\tmovzbq %al, %rax\n");
+      emit_literal("\tpushq %rax\n");
       break;
     case AST_OP_REF:
       emit_lvalue(p->left);
       break;
     case AST_OP_DEREF:
       codegen(p->left);
-      printf("\tpopq %%rax\n");
+      emit_literal("\tpopq %rax\n");
       if (p->ctype->type == TYPE_CHAR)
-        printf("\tmovsbq (%%rax), %%rax\n");
+        emit_literal("\tmovsbq (%rax), %rax\n");
       else if (p->ctype->type == TYPE_INT)
-        printf("\tmovslq (%%rax), %%rax\n");
+        emit_literal("\tmovslq (%rax), %rax\n");
       else
-        printf("\tmovq (%%rax), %%rax\n");
-      printf("\tpushq %%rax\n");
+        emit_literal("\tmovq (%rax), %rax\n");
+      emit_literal("\tpushq %rax\n");
       break;
     case AST_OP_B_AND:
     case AST_OP_B_XOR:
@@ -197,32 +601,34 @@ void codegen(Ast *p) {
       char *op = p->type == AST_OP_B_AND
                      ? "and"
                      : p->type == AST_OP_B_XOR ? "xor" : "or";
-      printf("\tpopq %%rdx\n");
-      printf("\tpopq %%rax\n");
-      printf("\t%s %%rdx, %%rax\n", op);
-      printf("\tpushq %%rax\n");
+      emit_literal("\tpopq %rdx\n");
+      emit_literal("\tpopq %rax\n");
+      emit("\t%s %%rdx, %%rax\n", op);
+      emit_literal("\tpushq %rax\n");
       break;
     }
     case AST_OP_L_AND:
-    case AST_OP_L_OR:
-      // TODO: short-circuit evaluation
-      codegen(p->left);
-      codegen(p->right);
-      char *op = p->type == AST_OP_L_AND ? "and" : "or";
-      printf("\tpopq %%rdx\n");
-      printf("\tpopq %%rax\n");
-      printf("\t%s %%rdx, %%rax\n", op);
-      printf("\tpushq %%rax\n");
+    case AST_OP_L_OR: {
+      int jump_if = p->type == AST_OP_L_OR;
+      int decided = new_label();
+      int end = new_label();
+      codegen_branch(p, jump_if, decided);
+      emit("\tpushq $%d\n", !jump_if);
+      emit("\tjmp .L%d\n", end);
+      emit(".L%d:\n", decided);
+      emit("\tpushq $%d\n", jump_if);
+      emit(".L%d:\n", end);
       break;
+    }
     case AST_OP_LSHIFT:
     case AST_OP_RSHIFT: {
       codegen(p->left);
       codegen(p->right);
       char *op = p->type == AST_OP_LSHIFT ? "salq" : "sarq";
-      printf("\tpopq %%rcx\n");
-      printf("\tpopq %%rax\n");
-      printf("\t%s %%cl, %%rax\n", op);
-      printf("\tpushq %%rax\n");
+      emit_literal("\tpopq %rcx\n");
+      emit_literal("\tpopq %rax\n");
+      emit("\t%s %%cl, %%rax\n", op);
+      emit_literal("\tpushq %rax\n");
       break;
     }
     case AST_OP_LT:
@@ -231,9 +637,9 @@ void codegen(Ast *p) {
     case AST_OP_NEQUAL:
       codegen(p->left);
       codegen(p->right);
-      printf("\tpopq %%rdx\n");
-      printf("\tpopq %%rax\n");
-      printf("\tcmpq %%rdx, %%rax\n");
+      emit_literal("\tpopq %rdx\n");
+      emit_literal("\tpopq %rax\n");
+      emit_literal("\tcmpq %rdx, %rax\n");
       char *s;
       if (p->type == AST_OP_LT)
         s = "setl";
@@ -243,48 +649,48 @@ void codegen(Ast *p) {
         s = "sete";
       else
         s = "setne";
-      printf("\t%s %%al\n", s);
-      printf("\tmovzbq %%al, %%rax\n");
-      printf("\tpushq %%rax\n");
+      emit("\t%s %%al\n", s);
+      emit_literal("\tmovzbq %al, %rax\n");
+      emit_literal("\tpushq %rax\n");
       break;
     case AST_OP_DOT:
       emit_lvalue(p->left);
-      printf("\tpopq %%rax\n");
+      emit_literal("\tpopq %rax\n");
       if (p->ctype->type == TYPE_CHAR) {
-        printf("\tmovsbq %d(%%rax), %%rdx\n", p->offset_from_bp);
-        printf("\tpushq %%rdx\n");
+        emit("\tmovsbq %d(%%rax), %%rdx\n", p->offset_from_bp);
+        emit_literal("\tpushq %rdx\n");
       } else if (p->ctype->type == TYPE_INT) {
-        printf("\tmovslq %d(%%rax), %%rdx\n", p->offset_from_bp);
-        printf("\tpushq %%rdx\n");
+        emit("\tmovslq %d(%%rax), %%rdx\n", p->offset_from_bp);
+        emit_literal("\tpushq %rdx\n");
       } else  // TODO: TYPE_STRUCT, TYPE_ARRAY
-        printf("\tpushq %d(%%rax)\n", p->offset_from_bp);
+        emit("\tpushq %d(%%rax)\n", p->offset_from_bp);
 
       break;
     case AST_VAR:
       if (p->symbol_table_entry->is_global) {
         if (p->ctype->type == TYPE_CHAR) {
-          printf("\tmovsbq %s(%%rip), %%rax\n", p->symbol_table_entry->ident);
-          printf("\tpushq %%rax\n");
+          emit("\tmovsbq %s(%%rip), %%rax\n", p->symbol_table_entry->ident);
+          emit_literal("\tpushq %rax\n");
         } else if (p->ctype->type == TYPE_INT) {
-          printf("\tmovslq %s(%%rip), %%rax\n", p->symbol_table_entry->ident);
-          printf("\tpushq %%rax\n");
+          emit("\tmovslq %s(%%rip), %%rax\n", p->symbol_table_entry->ident);
+          emit_literal("\tpushq %rax\n");
         } else
-          printf("\tpushq %s(%%rip)\n", p->symbol_table_entry->ident);
+          emit("\tpushq %s(%%rip)\n", p->symbol_table_entry->ident);
       } else {
         if (p->ctype->type == TYPE_CHAR) {
-          printf("\tmovsbq %d(%%rbp), %%rax\n", -p->symbol_table_entry->offset);
-          printf("\tpushq %%rax\n");
+          emit("\tmovsbq %d(%%rbp), %%rax\n", -p->symbol_table_entry->offset);
+          emit_literal("\tpushq %rax\n");
         } else if (p->ctype->type == TYPE_INT) {
-          printf("\tmovslq %d(%%rbp), %%rax\n", -p->symbol_table_entry->offset);
-          printf("\tpushq %%rax\n");
+          emit("\tmovslq %d(%%rbp), %%rax\n", -p->symbol_table_entry->offset);
+          emit_literal("\tpushq %rax\n");
         } else
-          printf("\tpushq %d(%%rbp)\n", -p->symbol_table_entry->offset);
+          emit("\tpushq %d(%%rbp)\n", -p->symbol_table_entry->offset);
       }
       break;
     case AST_DECL_GLOBAL_VAR:
-      printf(".data\n");
-      printf("%s:\n", p->ident);
-      printf("\t.zero %d\n", sizeof_ctype(p->ctype));
+      emit_literal(".data\n");
+      emit("%s:\n", p->ident);
+      emit("\t.zero %d\n", sizeof_ctype(p->ctype));
       break;
     case AST_CALL_FUNC:
       for (int i = p->args->size - 1; i >= 0; i--)
@@ -292,45 +698,34 @@ void codegen(Ast *p) {
 
       for (int i = 0; i < (p->args->size > 6 ? 6 : p->args->size); i++) {
         char *reg[] = {"rdi", "rsi", "rdx", "rcx", "r8", "r9"};
-        printf("\tpopq %%%s\n", reg[i]);
+        emit("\tpopq %%%s\n", reg[i]);
       }
-      printf("\txor %%al, %%al\n");
-      printf("\tmovq %%rsp, %%r12\n");
-      printf("\tand $0xfffffffffffffff0, %%rsp\n");
-      printf("\tcall %s\n", p->ident);
-      printf("\tmovq %%r12, %%rsp\n");
-      printf("\tpushq %%rax\n");
+      emit_literal("\txor %al, %al\n");
+      emit_literal("\tmovq %rsp, %r12\n");
+      emit_literal("\tand $0xfffffffffffffff0, %rsp\n");
+      emit("\tcall %s\n", p->ident);
+      emit_literal("\tmovq %r12, %rsp\n");
+      emit_literal("\tpushq %rax\n");
       break;
     case AST_DECL_FUNC:
-      symbol_table = p->symbol_table;
-      printf(".text\n");
-      printf("%s:\n", p->ident);
-      printf("\tpushq %%rbp\n");
-      printf("\tpushq %%r12\n");
-      printf("\tmovq %%rsp, %%rbp\n");
+      function_table = p->symbol_table;
+      next_label = p->label;
+      if (optimizing()) {
+        codegen_function(p);
+        break;
+      }
+      emit_literal(".text\n");
+      emit("%s:\n", p->ident);
+      emit_literal("\tpushq %rbp\n");
+      emit_literal("\tpushq %r12\n");
+      emit_literal("\tmovq %rsp, %rbp\n");
       if (p->offset_from_bp > 0 && (p->offset_from_bp) % 16 == 0)
-        printf("\tsub $%d, %%rsp\n", p->offset_from_bp);
+        emit("\tsub $%d, %%rsp\n", p->offset_from_bp);
       else if (p->offset_from_bp > 0)
-        printf("\tsub $%d, %%rsp\n",
-               (p->offset_from_bp) + (16 - p->offset_from_bp % 16));
-
-      for (int i = 0; i < (p->args->size > 6 ? 6 : p->args->size); i++) {
-        Ast *node = vector_at(p->args, i);
-        char *s = node->ident;
-        char *reg8[] = {"dil", "sil", "dl", "cl", "r8b", "r9b"};
-        char *reg32[] = {"edi", "esi", "edx", "ecx", "r8d", "r9d"};
-        char *reg64[] = {"rdi", "rsi", "rdx", "rcx", "r8", "r9"};
-        if (node->ctype->type == TYPE_CHAR)
-          printf("\tmovb %%%s, %d(%%rbp)\n", reg8[i],
-                 -((SymbolTableEntry *)map_get(symbol_table, s)->val)->offset);
-        else if (node->ctype->type == TYPE_INT)
-          printf("\tmovl %%%s, %d(%%rbp)\n", reg32[i],
-                 -((SymbolTableEntry *)map_get(symbol_table, s)->val)->offset);
-        else
-          printf("\tmovq %%%s, %d(%%rbp)\n", reg64[i],
-                 -((SymbolTableEntry *)map_get(symbol_table, s)->val)->offset);
-      }
+        emit("\tsub $%d, %%rsp\n",
+             (p->offset_from_bp) + (16 - p->offset_from_bp % 16));
 
+      store_params(p);
       codegen(p->statement);
       break;
     case AST_COMPOUND_STATEMENT:
@@ -338,41 +733,33 @@ void codegen(Ast *p) {
         codegen(vector_at(p->statements, i));
       break;
     case AST_EXPR_STATEMENT:
-      if (p->expr != NULL) {
-        codegen(p->expr);
-        printf("\tpopq %%rax\n");
-      }
+      if (p->expr != NULL)
+        codegen_expr(p->expr, 0);
       break;
     case AST_IF_STATEMENT:
-      codegen(p->cond);
-      printf("\tpopq %%rax\n");
-      printf("\ttest %%rax, %%rax\n");
-      int seq1 = get_sequence_num();
-      printf("\tjz .L%d\n", seq1);
+      int seq1 = new_label();
+      codegen_branch(p->cond, 0, seq1);
       codegen(p->left);
       if (p->right != NULL) {
-        int seq2 = get_sequence_num();
-        printf("\tjmp .L%d\n", seq2);
-        printf(".L%d:\n", seq1);
+        int seq2 = new_label();
+        emit("\tjmp .L%d\n", seq2);
+        emit(".L%d:\n", seq1);
         codegen(p->right);
-        printf(".L%d:\n", seq2);
+        emit(".L%d:\n", seq2);
       } else
-        printf(".L%d:\n", seq1);
+        emit(".L%d:\n", seq1);
       break;
     case AST_WHILE_STATEMENT: {
       int tmp_s = loop_start;
       int tmp_e = loop_end;
-      loop_start = get_sequence_num();
-      loop_end = get_sequence_num();
-
-      printf(".L%d:\n", loop_start);
-      codegen(p->cond);
-      printf("\tpopq %%rax\n");
-      printf("\ttest %%rax, %%rax\n");
-      printf("\tjz .L%d\n", loop_end);
+      loop_start = new_label();
+      loop_end = new_label();
+
+      emit(".L%d:\n", loop_start);
+      codegen_branch(p->cond, 0, loop_end);
       codegen(p->statement);
-      printf("\tjmp .L%d\n", loop_start);
-      printf(".L%d:\n", loop_end);
+      emit("\tjmp .L%d\n", loop_start);
+      emit(".L%d:\n", loop_end);
 
       // restore labels
       loop_start = tmp_s;
@@ -382,24 +769,19 @@ void codegen(Ast *p) {
     case AST_FOR_STATEMENT: {
       int tmp_s = loop_start;
       int tmp_e = loop_end;
-      loop_start = get_sequence_num();
-      loop_end = get_sequence_num();
-      int after_step = get_sequence_num();
-
-      codegen(p->init);
-      printf("\tpopq %%rax\n");
-      printf("\tjmp .L%d\n", after_step);
-      printf(".L%d:\n", loop_start);
-      codegen(p->step);
-      printf("\tpopq %%rax\n");
-      printf(".L%d:\n", after_step);
-      codegen(p->cond);
-      printf("\tpopq %%rax\n");
-      printf("\ttest %%rax, %%rax\n");
-      printf("\tjz .L%d\n", loop_end);
+      loop_start = new_label();
+      loop_end = new_label();
+      int after_step = new_label();
+
+      codegen_expr(p->init, 0);
+      emit("\tjmp .L%d\n", after_step);
+      emit(".L%d:\n", loop_start);
+      codegen_expr(p->step, 0);
+      emit(".L%d:\n", after_step);
+      codegen_branch(p->cond, 0, loop_end);
       codegen(p->statement);
-      printf("\tjmp .L%d\n", loop_start);
-      printf(".L%d:\n", loop_end);
+      emit("\tjmp .L%d\n", loop_start);
+      emit(".L%d:\n", loop_end);
 
       // restore labels
       loop_start = tmp_s;
@@ -407,26 +789,157 @@ void codegen(Ast *p) {
       break;
     }
     case AST_RETURN_STATEMENT:
-      if (p->expr != NULL) {
-        codegen(p->expr);
-        printf("\tpopq %%rax\n");
+      if (p->expr != NULL)
+        codegen_expr(p->expr, 1);
+      if (optimizing()) {
+        emit("\tjmp .L%d\n", return_label);
+        break;
       }
-      printf("\tmovq %%rbp, %%rsp\n");
-      printf("\tpopq %%r12\n");
-      printf("\tpopq %%rbp\n");
-      printf("\tret\n");
+      emit_literal("\tmovq %rbp, %rsp\n");
+      emit_literal("\tpopq %r12\n");
+      emit_literal("\tpopq %rbp\n");
+      emit_literal("\tret\n");
       break;
     case AST_BREAK_STATEMENT:
       if (loop_end == -1)
         error_with_token(p->token, "not within loop or switch");
 
-      printf("\tjmp .L%d\n", loop_end);
+      emit("\tjmp .L%d\n", loop_end);
       break;
     case AST_CONTINUE_STATEMENT:
       if (loop_start == -1)
         error_with_token(p->token, "not within a loop");
 
-      printf("\tjmp .L%d\n", loop_start);
+      emit("\tjmp .L%d\n", loop_start);
       break;
   }
 }
+
+// labels which codegen takes for the statement or the expression, a
+// statement takes them for its branches and && and || for their jumps.
+static int count_labels(Ast *p) {
+  if (p == NULL)
+    return 0;
+  switch (p->type) {
+    case AST_DECL_FUNC:
+      return count_labels(p->statement) + optimizing();  // the epilogue
+    case AST_COMPOUND_STATEMENT: {
+      int n = 0;
+      for (int i = 0; i < p->statements->size; i++)
+        n += count_labels(vector_at(p->statements, i));
+      return n;
+    }
+    case AST_EXPR_STATEMENT:
+    case AST_RETURN_STATEMENT:
+      return count_labels(p->expr);
+    case AST_IF_STATEMENT:
+      return (p->right != NULL ? 2 : 1) + count_labels(p->cond) +
+             count_labels(p->left) + count_labels(p->right);
+    case AST_WHILE_STATEMENT:
+      return 2 + count_labels(p->cond) + count_labels(p->statement);
+    case AST_FOR_STATEMENT:
+      return 3 + count_labels(p->init) + count_labels(p->cond) +
+             count_labels(p->step) + count_labels(p->statement);
+    case AST_OP_L_AND:
+    case AST_OP_L_OR:
+      return 2 + count_labels(p->left) + count_labels(p->right);
+    case AST_CALL_FUNC: {
+      int n = 0;
+      for (int i = 0; i < p->args->size; i++)
+        n += count_labels(vector_at(p->args, i));
+      return n;
+    }
+  }
+  if (p->type >= AST_OP_ADD && p->type <= AST_OP_ARROW)
+    return count_labels(p->left) + count_labels(p->right);
+  return 0;
+}
+
+// generates a function, through the peephole optimizer when it is on.
+static void codegen_peephole(Ast *p) {
+  if (!compilation->opts->peephole) {
+    codegen(p);
+    return;
+  }
+  Output *out = asm_output;
+  Output text;
+  output_init(&text, -1);
+  asm_output = &text;
+  codegen(p);
+  asm_output = out;
+  peephole(text.buf, text.len, out);
+  output_release(&text);
+}
+
+// generates a top level declaration. With -fcache= a function is taken
+// from the cache, or generated and kept there.
+static void codegen_decl(Ast *p) {
+  if (p == NULL || p->type != AST_DECL_FUNC || p->statement == NULL) {
+    codegen(p);
+    return;
+  }
+  long t = time_now();
+  if (compilation->opts->cache_dir == NULL) {
+    codegen_peephole(p);
+    time_function("codegen", p->ident, t);
+    return;
+  }
+  if (cache_load(p->digest, p->label, asm_output)) {
+    atomic_fetch_add(&compilation->cache_hits, 1);
+    time_function("codegen", p->ident, t);
+    return;
+  }
+  atomic_fetch_add(&compilation->cache_misses, 1);
+
+  Output *out = asm_output;
+  Output text;
+  output_init(&text, -1);
+  asm_output = &text;
+  codegen_peephole(p);
+  asm_output = out;
+  cache_store(p->digest, p->label, text.buf, text.len, time_now() - t);
+  output_write(out, text.buf, text.len);
+  output_release(&text);
+  time_function("codegen", p->ident, t);
+}
+
+typedef struct {
+  Vector *decls;
+  Output *outputs;
+} CodegenJob;
+
+static void codegen_job(int i, void *arg) {
+  CodegenJob *job = arg;
+  output_init(&job->outputs[i], -1);
+  asm_output = &job->outputs[i];
+  codegen_decl(vector_at(job->decls, i));
+}
+
+// generates the top level declarations into asm_output. With jobs > 1
+// each declaration is generated into its own buffer on a worker thread and
+// the buffers are written in order.
+void codegen_program(Vector *decls, int jobs) {
+  for (int i = 0; i < decls->size; i++) {
+    Ast *p = vector_at(decls, i);
+    if (p != NULL && p->type == AST_DECL_FUNC)
+      p->label = reserve_sequence_nums(count_labels(p));
+  }
+
+  if (jobs <= 1) {
+    for (int i = 0; i < decls->size; i++)
+      codegen_decl(vector_at(decls, i));
+    return;
+  }
+
+  Output *out = asm_output;
+  CodegenJob job = {decls, malloc(decls->size * sizeof(Output))};
+  if (job.outputs == NULL)
+    error("out of memory");
+  parallel_for(decls->size, jobs, codegen_job, &job);
+  asm_output = out;
+  for (int i = 0; i < decls->size; i++) {
+    output_write(out, job.outputs[i].buf, job.outputs[i].len);
+    output_release(&job.outputs[i]);
+  }
+  free(job.outputs);
+}
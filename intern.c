@@ -0,0 +1,162 @@
+#include <assert.h>
+#include <pthread.h>
+#include <string.h>
+#include "uoocc.h"
+
+// every interned string is preceded by its header in intern_arena.
+typedef struct {
+  unsigned int hash;
+  int len;
+  int id;
+  int pad;  // keep the string 8-byte aligned
+} InternHeader;
+
+// the table is shared by the threads of a batch compilation. Lookups of
+// strings already interned take no lock, only insertions do.
+typedef struct {
+  int capacity;
+  _Atomic(char *) slots[];
+} InternTable;
+
+static _Atomic(InternTable *) intern_table;
+static atomic_int intern_size;  // names up to it are readable
+static pthread_mutex_t intern_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// names are indexed by id in chunks which never move, chunk k holding
+// INTERN_INITIAL_CAPACITY << k names.
+#define INTERN_MAX_CHUNKS 20
+static char **intern_chunks[INTERN_MAX_CHUNKS];
+
+// FNV-1a
+unsigned int hash_string_n(char *s, int len) {
+  unsigned int h = 2166136261u;
+  for (int i = 0; i < len; i++) {
+    h ^= (unsigned char)s[i];
+    h *= 16777619u;
+  }
+  return h;
+}
+
+// 64-bit FNV-1a, continued from h. Start with DIGEST_INIT.
+unsigned long digest_n(unsigned long h, char *s, int len) {
+  for (int i = 0; i < len; i++) {
+    h ^= (unsigned char)s[i];
+    h *= 1099511628211ul;
+  }
+  return h;
+}
+
+static InternHeader *header_of(char *s) {
+  return (InternHeader *)s - 1;
+}
+
+static _Atomic(char *) *intern_find_slot(InternTable *t, char *s, int len,
+                                         unsigned int hash) {
+  int mask = t->capacity - 1;
+  for (int i = hash & mask;; i = (i + 1) & mask) {
+    _Atomic(char *) *slot = t->slots + i;
+    char *p = atomic_load_explicit(slot, memory_order_acquire);
+    if (p == NULL)
+      return slot;
+    InternHeader *h = header_of(p);
+    if (h->hash == hash && h->len == len && memcmp(p, s, len) == 0)
+      return slot;
+  }
+}
+
+// the old table is not freed, lookups may still be reading it. The old
+// tables take no more room than the current one together.
+static InternTable *intern_rehash(InternTable *old, int new_capacity) {
+  InternTable *t =
+      arena_alloc(&intern_arena, sizeof(InternTable) +
+                                     new_capacity * sizeof(_Atomic(char *)));
+  t->capacity = new_capacity;
+  for (int i = 0; old != NULL && i < old->capacity; i++) {
+    char *s = atomic_load_explicit(old->slots + i, memory_order_relaxed);
+    if (s != NULL) {
+      InternHeader *h = header_of(s);
+      atomic_store_explicit(intern_find_slot(t, s, h->len, h->hash), s,
+                            memory_order_relaxed);
+    }
+  }
+  atomic_store_explicit(&intern_table, t, memory_order_release);
+  return t;
+}
+
+static char **intern_name_slot(int id) {
+  int k = 0;
+  while (id >= INTERN_INITIAL_CAPACITY << k) {
+    id -= INTERN_INITIAL_CAPACITY << k;
+    k++;
+  }
+  assert(k < INTERN_MAX_CHUNKS);
+  if (intern_chunks[k] == NULL)
+    intern_chunks[k] = arena_alloc(
+        &intern_arena, (INTERN_INITIAL_CAPACITY << k) * sizeof(char *));
+  return intern_chunks[k] + id;
+}
+
+// returns the canonical copy of s[0..len), so that interned strings can be
+// compared by pointer.
+char *intern_string_n(char *s, int len) {
+  unsigned int hash = hash_string_n(s, len);
+  InternTable *t = atomic_load_explicit(&intern_table, memory_order_acquire);
+  if (t != NULL) {
+    char *p = atomic_load_explicit(intern_find_slot(t, s, len, hash),
+                                   memory_order_acquire);
+    if (p != NULL)
+      return p;
+  }
+
+  pthread_mutex_lock(&intern_lock);
+  // keep load factor <= 1/2
+  t = atomic_load_explicit(&intern_table, memory_order_relaxed);
+  int size = atomic_load_explicit(&intern_size, memory_order_relaxed);
+  if (t == NULL)
+    t = intern_rehash(NULL, INTERN_INITIAL_CAPACITY);
+  else if (t->capacity < (size + 1) * 2)
+    t = intern_rehash(t, t->capacity * 2);
+
+  _Atomic(char *) *slot = intern_find_slot(t, s, len, hash);
+  char *found = atomic_load_explicit(slot, memory_order_relaxed);
+  if (found != NULL) {
+    pthread_mutex_unlock(&intern_lock);
+    return found;
+  }
+
+  InternHeader *h =
+      arena_alloc(&intern_arena, sizeof(InternHeader) + len + 1);
+  h->hash = hash;
+  h->len = len;
+  h->id = size;
+  char *p = (char *)(h + 1);
+  memcpy(p, s, len);
+  p[len] = '\0';
+
+  *intern_name_slot(size) = p;
+  atomic_store_explicit(slot, p, memory_order_release);
+  atomic_store_explicit(&intern_size, size + 1, memory_order_release);
+  pthread_mutex_unlock(&intern_lock);
+  return p;
+}
+
+char *intern_string(char *s) {
+  return intern_string_n(s, strlen(s));
+}
+
+// s must be returned from intern_string.
+unsigned int intern_hash(char *s) {
+  return header_of(s)->hash;
+}
+
+// interned strings are numbered from 0 in the order of interning.
+int intern_id(char *s) {
+  return header_of(s)->id;
+}
+
+char *intern_name(int id) {
+  // the chunks and names below the size are written before it
+  if (id >= atomic_load_explicit(&intern_size, memory_order_acquire))
+    return NULL;
+  return *intern_name_slot(id);
+}
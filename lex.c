@@ -1,341 +1,276 @@
-#include <ctype.h>
-#include <stdio.h>
-#include <stdlib.h>
+#include <assert.h>
+#include <limits.h>
+#include <pthread.h>
 #include <string.h>
 #include "uoocc.h"
 
-TokenQueue token_queue;
+// character classes
+#define CHAR_SPACE 1
+#define CHAR_DIGIT 2
+#define CHAR_ALPHA 4  // [a-zA-Z_]
+#define CHAR_PUNCT 8
 
-// [0-9]+
-static char *read_number(FILE *fp, char c) {
-  char num[MAX_TOKEN_LENGTH];
-  int idx = 0;
+static unsigned char char_class[256];
 
-  while (c != EOF) {
-    if (!isdigit(c)) {
-      ungetc(c, fp);
-      break;
-    }
-    num[idx++] = c;
-    c = getc(fp);
-  }
+static struct {
+  char *text;
+  int type;
+} punctuators[] = {
+    {"+", TK_PLUS},    {"++", TK_INC},    {"-", TK_MINUS},   {"--", TK_DEC},
+    {"->", TK_ARROW},  {"*", TK_STAR},    {"/", TK_DIV},     {"&", TK_AMP},
+    {"&&", TK_L_AND},  {"|", TK_B_OR},    {"||", TK_L_OR},   {"^", TK_B_XOR},
+    {"~", TK_B_NOT},   {"(", TK_LPAR},    {")", TK_RPAR},    {"=", TK_ASSIGN},
+    {"==", TK_EQUAL},  {";", TK_SEMI},    {",", TK_COMMA},   {".", TK_DOT},
+    {"{", TK_LCUR},    {"}", TK_RCUR},    {"[", TK_LBRA},    {"]", TK_RBRA},
+    {"<", TK_LT},      {"<<", TK_LSHIFT}, {"<=", TK_LE},     {">", TK_GT},
+    {">>", TK_RSHIFT}, {">=", TK_GE},     {"!", TK_L_NOT},   {"!=", TK_NEQUAL},
+};
 
-  num[idx] = '\0';
-  return allocate_string(num);
-}
+#define NUM_PUNCTUATORS (int)(sizeof(punctuators) / sizeof(punctuators[0]))
+#define MAX_PUNCT_STATES (NUM_PUNCTUATORS + 1)
+
+// DFA recognizing the longest punctuator. State 0 is the start state and
+// a transition to state 0 means there is no longer punctuator.
+static unsigned char punct_trans[MAX_PUNCT_STATES][128];
+static int punct_accept[MAX_PUNCT_STATES];  // index of punctuators
+
+// perfect hash of the keywords: (first + last + 4 * length) & 31.
+// The slots below are collision free, empty slots have NULL text.
+#define KEYWORD_HASH(s, len) (((s)[0] + (s)[(len)-1] + 4 * (len)) & 31)
 
-// [a-zA-Z_] [0-9a-zA-Z_]*
-static char *read_ident(FILE *fp, char c) {
-  char ident[MAX_TOKEN_LENGTH];
-  int idx = 0;
+static struct {
+  char *text;
+  int type;
+} keywords[32] = {
+    [1] = {"break", TK_BREAK},
+    [2] = {"enum", TK_ENUM},
+    [4] = {"for", TK_FOR},
+    [5] = {"char", TK_CHAR},
+    [8] = {"continue", TK_CONTINUE},
+    [9] = {"int", TK_INT},
+    [10] = {"void", TK_VOID},
+    [16] = {"while", TK_WHILE},
+    [17] = {"sizeof", TK_SIZEOF},
+    [22] = {"typedef", TK_TYPEDEF},
+    [23] = {"if", TK_IF},
+    [24] = {"return", TK_RETURN},
+    [26] = {"else", TK_ELSE},
+    [31] = {"struct", TK_STRUCT},
+};
 
-  if (!(isalpha(c) || c == '_')) {
-    ungetc(c, fp);
-    ident[idx] = '\0';
-    return allocate_string(ident);
+static void init_lexer_tables(void) {
+  for (int c = 0; c < 256; c++) {
+    if (c == ' ' || c == '\t' || c == '\n' || c == '\v' || c == '\f' ||
+        c == '\r')
+      char_class[c] = CHAR_SPACE;
+    else if ('0' <= c && c <= '9')
+      char_class[c] = CHAR_DIGIT;
+    else if (('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') || c == '_')
+      char_class[c] = CHAR_ALPHA;
   }
 
-  while (c != EOF) {
-    if (!(isalpha(c) || isdigit(c) || c == '_')) {
-      ungetc(c, fp);
-      break;
+  int num_states = 1;
+  for (int i = 0; i < NUM_PUNCTUATORS; i++) {
+    int state = 0;
+    for (char *s = punctuators[i].text; *s != '\0'; s++) {
+      char_class[(int)*s] |= CHAR_PUNCT;
+      if (punct_trans[state][(int)*s] == 0)
+        punct_trans[state][(int)*s] = num_states++;
+      state = punct_trans[state][(int)*s];
     }
-    ident[idx++] = c;
-    c = getc(fp);
+    punct_accept[state] = i;
   }
-
-  ident[idx] = '\0';
-  return allocate_string(ident);
 }
 
-static Token *make_token(int row, int col, int type, char *text) {
-  Token *t = malloc(sizeof(Token));
-
-  t->row = row;
-  t->col = col;
-  t->type = type;
-  t->text = text;
-
-  if (t->type == TK_NUM)
-    t->number = atoi(text);
+// returns the keyword type of s, or TK_IDENT
+static int keyword_type(char *s, int len) {
+  int h = KEYWORD_HASH(s, len);
+  char *kw = keywords[h].text;
+  if (kw != NULL && strncmp(kw, s, len) == 0 && kw[len] == '\0')
+    return keywords[h].type;
+  return TK_IDENT;
+}
 
+static Token make_token(int type, char *start, char *end, int value) {
+  Token t = {type, start - compilation->token_queue.source.buf, end - start,
+             value};
   return t;
 }
 
-void init_token_queue(FILE *fp) {
-  token_queue.vec = vector_new();
-  token_queue.idx = 0;
+// lexes the token at q->pos. The end of the source yields TK_EOF forever.
+static Token lex_token(TokenQueue *q) {
+  char *p = q->pos, *end = q->end;
+  Token tk;
 
-  if (fp == NULL)
-    return;
+  for (;;) {
+    while (p < end && (char_class[(unsigned char)*p] & CHAR_SPACE))
+      p++;
 
-  char c;
-  Vector *v = token_queue.vec;
-  int now_row, now_col;
-  now_row = now_col = 1;
-  while ((c = getc(fp)) != EOF) {
-    if (c == '\n') {
-      now_row++;
-      now_col = 1;
-      continue;
-    } else if (isspace(c)) {
-      now_col++;
-      continue;
+    if (p + 1 < end && p[0] == '/' && p[1] == '/') {  // skip liner comment
+      while (p < end && *p != '\n')
+        p++;
+    } else if (p + 1 < end && p[0] == '/' && p[1] == '*') {  // block comment
+      Token comment = make_token(TK_MISC, p, p + 2, 0);
+      for (p += 2; p + 1 < end && !(p[0] == '*' && p[1] == '/'); p++)
+        ;
+      if (p + 1 >= end)
+        error_with_token(comment, "unterminated comment");
+      p += 2;
+    } else {
+      break;
     }
+  }
 
-    if (c == '/') {
-      char _c;
-      if ((_c = getc(fp)) == '/') {  // skip liner comment
-        while ((c = getc(fp)) != '\n')
-          ;
-        now_row++;
-        now_col = 1;
-        continue;
-      } else if (_c == '*') {  // skip block comment
-        Token *tk =
-            make_token(now_row, now_col, TK_MISC, allocate_string("/*"));
+  char *start = p;
+  if (p >= end)
+    return make_token(TK_EOF, p, p, 0);
 
-        char c2;
-        c = getc(fp);
-        c2 = getc(fp);
+  int c = (unsigned char)*p;
+  int cls = char_class[c];
+  if (cls & CHAR_PUNCT) {
+    // run the DFA as far as it goes
+    int state = punct_trans[0][c];
+    for (p++; p < end && (unsigned char)*p < 128; p++) {
+      int next = punct_trans[state][(int)*p];
+      if (next == 0)
+        break;
+      state = next;
+    }
+    tk = make_token(punctuators[punct_accept[state]].type, start, p, 0);
+  } else if (cls & CHAR_DIGIT) {  // [0-9]+
+    int number = 0;
+    for (; p < end && (char_class[(unsigned char)*p] & CHAR_DIGIT); p++)
+      number = number * 10 + (*p - '0');
+    tk = make_token(TK_NUM, start, p, number);
+  } else if (cls & CHAR_ALPHA) {  // [a-zA-Z_] [0-9a-zA-Z_]*
+    while (p < end &&
+           (char_class[(unsigned char)*p] & (CHAR_ALPHA | CHAR_DIGIT)))
+      p++;
+    int type = keyword_type(start, p - start);
+    if (type == TK_IDENT)
+      tk = make_token(type, start, p,
+                      intern_id(intern_string_n(start, p - start)));
+    else
+      tk = make_token(type, start, p, 0);
+  } else if (c == '"') {
+    for (p++; p < end && *p != '"'; p++)
+      ;
+    if (p >= end)
+      error_with_token(make_token(TK_MISC, start, start + 1, 0),
+                       "missing terminating '\"' character");
+    p++;
+    tk = make_token(TK_STR, start, p,
+                    intern_id(intern_string_n(start, p - start)));
+  } else {
+    error("unknown token has read");
+  }
 
-        now_col += 2;
-        if (c == '\n') {
-          now_row++;
-          now_col = 1;
-        } else
-          now_col++;
-        if (c2 == '\n') {
-          now_row++;
-          now_col = 1;
-        } else
-          now_col++;
+  q->pos = p;
+  return tk;
+}
 
-        while (!(c == '*' && c2 == '/') && c2 != EOF) {
-          c = c2;
-          c2 = getc(fp);
-          if (c2 == '\n') {
-            now_row++;
-            now_col = 1;
-          } else
-            now_col++;
-        }
-        if (c2 == EOF)
-          error_with_token(tk, "unterminated comment");
-        continue;
-      } else {
-        ungetc(_c, fp);
-      }
-    }
+// the token queue takes over the source.
+void init_token_queue_source(Source *src) {
+  TokenQueue *q = &compilation->token_queue;
+  q->idx = q->lexed = 0;
+  q->line_starts = NULL;
+  q->num_lines = 0;
+  q->digest = DIGEST_INIT;
+  q->source = *src;
+  if (q->source.len > UINT_MAX)
+    error("source is too large");
 
-    if (c == '+') {
-      if ((c = getc(fp)) == '+') {
-        now_col++;
-        vector_push_back(
-            v, make_token(now_row, now_col, TK_INC, allocate_string("++")));
-      } else {
-        ungetc(c, fp);
-        vector_push_back(
-            v, make_token(now_row, now_col, TK_PLUS, allocate_string("+")));
-      }
-    } else if (c == '-') {
-      if ((c = getc(fp)) == '-') {
-        now_col++;
-        vector_push_back(
-            v, make_token(now_row, now_col, TK_DEC, allocate_string("--")));
-      } else if (c == '>') {
-        now_col++;
-        vector_push_back(
-            v, make_token(now_row, now_col, TK_ARROW, allocate_string("->")));
-      } else {
-        ungetc(c, fp);
-        vector_push_back(
-            v, make_token(now_row, now_col, TK_MINUS, allocate_string("-")));
-      }
-    } else if (c == '*')
-      vector_push_back(
-          v, make_token(now_row, now_col, TK_STAR, allocate_string("*")));
-    else if (c == '/')
-      vector_push_back(
-          v, make_token(now_row, now_col, TK_DIV, allocate_string("/")));
-    else if (c == '&') {
-      if ((c = getc(fp)) == '&') {
-        now_col++;
-        vector_push_back(
-            v, make_token(now_row, now_col, TK_L_AND, allocate_string("&&")));
-      } else {
-        ungetc(c, fp);
-        vector_push_back(
-            v, make_token(now_row, now_col, TK_AMP, allocate_string("&")));
-      }
-    } else if (c == '|') {
-      if ((c = getc(fp)) == '|') {
-        now_col++;
-        vector_push_back(
-            v, make_token(now_row, now_col, TK_L_OR, allocate_string("||")));
-      } else {
-        ungetc(c, fp);
-        vector_push_back(
-            v, make_token(now_row, now_col, TK_B_OR, allocate_string("|")));
-      }
-    } else if (c == '^')
-      vector_push_back(
-          v, make_token(now_row, now_col, TK_B_XOR, allocate_string("^")));
-    else if (c == '~')
-      vector_push_back(
-          v, make_token(now_row, now_col, TK_B_NOT, allocate_string("~")));
-    else if (c == '(')
-      vector_push_back(
-          v, make_token(now_row, now_col, TK_LPAR, allocate_string("(")));
-    else if (c == ')')
-      vector_push_back(
-          v, make_token(now_row, now_col, TK_RPAR, allocate_string(")")));
-    else if (c == '=') {
-      if ((c = getc(fp)) == '=') {
-        now_col++;
-        vector_push_back(
-            v, make_token(now_row, now_col, TK_EQUAL, allocate_string("==")));
-      } else {
-        ungetc(c, fp);
-        vector_push_back(
-            v, make_token(now_row, now_col, TK_ASSIGN, allocate_string("=")));
-      }
-    } else if (c == ';')
-      vector_push_back(
-          v, make_token(now_row, now_col, TK_SEMI, allocate_string(";")));
-    else if (c == ',')
-      vector_push_back(
-          v, make_token(now_row, now_col, TK_COMMA, allocate_string(",")));
-    else if (c == '.')
-      vector_push_back(
-          v, make_token(now_row, now_col, TK_DOT, allocate_string(".")));
-    else if (c == '{')
-      vector_push_back(
-          v, make_token(now_row, now_col, TK_LCUR, allocate_string("{")));
-    else if (c == '}')
-      vector_push_back(
-          v, make_token(now_row, now_col, TK_RCUR, allocate_string("}")));
-    else if (c == '[')
-      vector_push_back(
-          v, make_token(now_row, now_col, TK_LBRA, allocate_string("[")));
-    else if (c == ']')
-      vector_push_back(
-          v, make_token(now_row, now_col, TK_RBRA, allocate_string("]")));
-    else if (c == '<') {
-      if ((c = getc(fp)) == '<') {
-        now_col++;
-        vector_push_back(
-            v, make_token(now_row, now_col, TK_LSHIFT, allocate_string("<<")));
-      } else if (c == '=') {
-        now_col++;
-        vector_push_back(
-            v, make_token(now_row, now_col, TK_LE, allocate_string("<=")));
-      } else {
-        ungetc(c, fp);
-        vector_push_back(
-            v, make_token(now_row, now_col, TK_LT, allocate_string("<")));
-      }
-    } else if (c == '>') {
-      if ((c = getc(fp)) == '>') {
-        now_col++;
-        vector_push_back(
-            v, make_token(now_row, now_col, TK_RSHIFT, allocate_string(">>")));
-      } else if (c == '=') {
-        now_col++;
-        vector_push_back(
-            v, make_token(now_row, now_col, TK_GE, allocate_string(">=")));
-      } else {
-        ungetc(c, fp);
-        vector_push_back(
-            v, make_token(now_row, now_col, TK_GT, allocate_string(">")));
-      }
-    } else if (c == '!') {
-      if ((c = getc(fp)) == '=') {
-        now_col++;
-        vector_push_back(
-            v, make_token(now_row, now_col, TK_NEQUAL, allocate_string("!=")));
-      } else {
-        ungetc(c, fp);
-        vector_push_back(
-            v, make_token(now_row, now_col, TK_L_NOT, allocate_string("!")));
-      }
-    } else if (isdigit(c)) {
-      char *s = read_number(fp, c);
-      vector_push_back(v, make_token(now_row, now_col, TK_NUM, s));
-      now_col += strlen(s) - 1;
-    } else if (isalpha(c) || c == '_') {
-      char *s = read_ident(fp, c);
-      if (strcmp(s, "sizeof") == 0)
-        vector_push_back(v, make_token(now_row, now_col, TK_SIZEOF, s));
-      else if (strcmp(s, "if") == 0)
-        vector_push_back(v, make_token(now_row, now_col, TK_IF, s));
-      else if (strcmp(s, "else") == 0)
-        vector_push_back(v, make_token(now_row, now_col, TK_ELSE, s));
-      else if (strcmp(s, "while") == 0)
-        vector_push_back(v, make_token(now_row, now_col, TK_WHILE, s));
-      else if (strcmp(s, "for") == 0)
-        vector_push_back(v, make_token(now_row, now_col, TK_FOR, s));
-      else if (strcmp(s, "int") == 0)
-        vector_push_back(v, make_token(now_row, now_col, TK_INT, s));
-      else if (strcmp(s, "char") == 0)
-        vector_push_back(v, make_token(now_row, now_col, TK_CHAR, s));
-      else if (strcmp(s, "void") == 0)
-        vector_push_back(v, make_token(now_row, now_col, TK_VOID, s));
-      else if (strcmp(s, "return") == 0)
-        vector_push_back(v, make_token(now_row, now_col, TK_RETURN, s));
-      else if (strcmp(s, "enum") == 0)
-        vector_push_back(v, make_token(now_row, now_col, TK_ENUM, s));
-      else if (strcmp(s, "struct") == 0)
-        vector_push_back(v, make_token(now_row, now_col, TK_STRUCT, s));
-      else if (strcmp(s, "typedef") == 0)
-        vector_push_back(v, make_token(now_row, now_col, TK_TYPEDEF, s));
-      else if (strcmp(s, "break") == 0)
-        vector_push_back(v, make_token(now_row, now_col, TK_BREAK, s));
-      else if (strcmp(s, "continue") == 0)
-        vector_push_back(v, make_token(now_row, now_col, TK_CONTINUE, s));
-      else
-        vector_push_back(v, make_token(now_row, now_col, TK_IDENT, s));
-      now_col += strlen(s) - 1;
-    } else if (c == '"') {
-      int row = now_row, col = now_col;
-      int len = 0;
-      char str[MAX_TOKEN_LENGTH];
-      str[len++] = c;
-      now_col++;
-      while ((c = getc(fp)) != '"') {
-        if (c == '\n') {
-          now_row++;
-          now_col = 1;
-        } else
-          now_col++;
+  static pthread_once_t tables_once = PTHREAD_ONCE_INIT;
+  pthread_once(&tables_once, init_lexer_tables);
+  q->pos = q->source.buf;
+  q->end = q->source.buf + q->source.len;
+}
 
-        str[len++] = c;
-      }
-      str[len++] = c;
-      str[len] = '\0';
-      now_col++;
-      vector_push_back(v, make_token(row, col, TK_STR, allocate_string(str)));
-    } else
-      error("unknown token has read");
+void init_token_queue(FILE *fp) {
+  Source src;
+  source_read(&src, fp);
+  init_token_queue_source(&src);
+}
 
-    now_col++;
+// tokens behind the current one are gone, only the lookahead is available.
+static Token token_at(int i) {
+  TokenQueue *q = &compilation->token_queue;
+  assert(q->idx <= i && i < q->idx + TOKEN_RING_SIZE);
+  while (q->lexed <= i) {
+    q->ring[q->lexed % TOKEN_RING_SIZE] = lex_token(q);
+    q->lexed++;
   }
-  vector_push_back(
-      v, make_token(now_row, now_col, TK_EOF, allocate_string("EOF")));
+  return q->ring[i % TOKEN_RING_SIZE];
 }
 
-Token *current_token(void) {
-  return vector_at(token_queue.vec, token_queue.idx);
+Token current_token(void) {
+  return token_at(compilation->token_queue.idx);
 }
 
-Token *second_token(void) {
-  return vector_at(token_queue.vec, token_queue.idx + 1);
+Token second_token(void) {
+  return token_at(compilation->token_queue.idx + 1);
 }
 
-Token *third_token(void) {
-  return vector_at(token_queue.vec, token_queue.idx + 2);
+Token third_token(void) {
+  return token_at(compilation->token_queue.idx + 2);
 }
 
-Token *next_token(void) {
-  return vector_at(token_queue.vec, ++token_queue.idx);
+Token next_token(void) {
+  TokenQueue *q = &compilation->token_queue;
+  if (q->digesting) {
+    Token tk = token_at(q->idx);
+    q->digest = digest_n(q->digest, (char *)&tk.type, sizeof(tk.type));
+    q->digest = digest_n(q->digest, q->source.buf + tk.offset, tk.length);
+  }
+  return token_at(++q->idx);
+}
+
+// returns the digest of the tokens consumed since the last call.
+unsigned long take_token_digest(void) {
+  TokenQueue *q = &compilation->token_queue;
+  unsigned long digest = q->digest;
+  q->digest = DIGEST_INIT;
+  return digest;
+}
+
+// returns the interned spelling of the token.
+char *token_text(Token tk) {
+  if (tk.type == TK_IDENT || tk.type == TK_STR)
+    return intern_name(tk.value);
+  char *buf = compilation->token_queue.source.buf;
+  return intern_string_n(buf + tk.offset, tk.length);
+}
+
+// computes 1-origin row and column of the token from the line start index.
+void token_position(Token tk, int *row, int *col) {
+  TokenQueue *q = &compilation->token_queue;
+  if (q->line_starts == NULL) {
+    int reserved = 64;
+    q->line_starts = arena_alloc(&token_arena, reserved * sizeof(unsigned int));
+    q->line_starts[q->num_lines++] = 0;
+    for (long i = 0; i < q->source.len; i++) {
+      if (q->source.buf[i] != '\n')
+        continue;
+      if (q->num_lines == reserved) {
+        q->line_starts =
+            arena_realloc(&token_arena, q->line_starts,
+                          reserved * sizeof(unsigned int),
+                          reserved * 2 * sizeof(unsigned int));
+        reserved *= 2;
+      }
+      q->line_starts[q->num_lines++] = i + 1;
+    }
+  }
+
+  // the last line starting at or before the token
+  int lo = 0, hi = q->num_lines;
+  while (hi - lo > 1) {
+    int mid = (lo + hi) / 2;
+    if (q->line_starts[mid] <= tk.offset)
+      lo = mid;
+    else
+      hi = mid;
+  }
+  *row = lo + 1;
+  *col = tk.offset - q->line_starts[lo] + 1;
 }
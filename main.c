@@ -1,19 +1,76 @@
+#include <stdlib.h>
+#include <unistd.h>
 #include "uoocc.h"
 
-int main(void) {
-  init_token_queue(stdin);
-  string_table = map_new(NULL);
-  symbol_table = map_new(NULL);
-  typedef_table = map_new(NULL);
-  Vector *v = program();
+// every file of a batch is compiled on one thread
+static Options batch_options;
 
-  for (int i = 0; i < v->size; i++)
-    v->data[i] = semantic_analysis(vector_at(v, i));
+static void compile_job(int i, void *arg) {
+  compile((Compilation *)arg + i, &batch_options);
+  arena_release_all();
+}
+
+int main(int argc, char **argv) {
+  Options opts;
+  Vector *inputs = vector_new();
+  char *output;
+  parse_options(argc - 1, argv + 1, &opts, inputs, &output);
+  if (opts.server != NULL) {
+    run_server(opts.server, opts.jobs);
+    return 0;
+  }
+
+  // one input goes to stdout unless -o or -c is given
+  if (inputs->size <= 1) {
+    Compilation c = {0};
+    c.input = vector_at(inputs, 0);
+    c.output = output;
+    if (opts.object && output == NULL) {
+      if (c.input == NULL)
+        error("-c requires an output file given by -o");
+      c.output = default_output(c.input, 1);
+    }
+    Source src;
+    read_input(c.input, &src);
+
+    // a running server saves the startup and keeps the headers warm
+    char *server = getenv("UOOCC_SERVER");
+    if (server != NULL) {
+      int status = remote_compile(server, argc - 1, argv + 1, &src, c.output);
+      if (status >= 0)
+        return status;
+    }
 
-  printf("\t.global main\n");
-  emit_string();
-  for (int i = 0; i < v->size; i++)
-    codegen(vector_at(v, i));
+    Output out;
+    int fd = open_output(c.output);
+    output_init(&out, fd);
+    compile_source(&c, &src, &opts, &out);
+    output_release(&out);
+    if (fd != 1)
+      close(fd);
+    if (opts.time_trace != NULL)
+      time_trace_write(opts.time_trace);
+    arena_release_all();
+    return 0;
+  }
 
+  // several inputs are compiled by a thread each, one output per input
+  if (output != NULL)
+    error("cannot specify -o with multiple files");
+  if (opts.preprocess_only)
+    error("cannot specify -E with multiple files");
+  Compilation *batch = calloc(inputs->size, sizeof(Compilation));
+  if (batch == NULL)
+    error("out of memory");
+  for (int i = 0; i < inputs->size; i++) {
+    batch[i].input = vector_at(inputs, i);
+    batch[i].output = default_output(batch[i].input, opts.object);
+  }
+  batch_options = opts;
+  batch_options.jobs = 1;
+  parallel_for(inputs->size, opts.jobs, compile_job, batch);
+  free(batch);
+  if (opts.time_trace != NULL)
+    time_trace_write(opts.time_trace);  // one trace for the whole batch
   return 0;
 }
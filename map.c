@@ -1,27 +1,68 @@
-#include <stdlib.h>
-#include <string.h>
 #include "uoocc.h"
 
 MapEntry *allocate_MapEntry(char *key, void *val) {
-  MapEntry *e = (MapEntry *)malloc(sizeof(MapEntry));
+  MapEntry *e = (MapEntry *)arena_alloc_tagged(&table_arena, MEM_MAP,
+                                              sizeof(MapEntry));
   e->key = key;
   e->val = val;
+  e->hash = intern_hash(key);
   return e;
 }
 
 Map *map_new(Map *next) {
-  Map *m = (Map *)malloc(sizeof(Map));
-  if (m == NULL)
-    return NULL;
+  Map *m = (Map *)arena_alloc_tagged(&table_arena, MEM_MAP, sizeof(Map));
   m->vec = vector_new();
   m->size = 0;
+  m->slots = NULL;  // allocated on the first map_put
+  m->capacity = 0;
   m->next = next;
   return m;
 }
 
+// returns the slot holding key, or the empty slot where it would be inserted.
+static int *map_find_slot(Map *m, char *key, unsigned int hash) {
+  int mask = m->capacity - 1;
+  for (int i = hash & mask;; i = (i + 1) & mask) {
+    int *slot = m->slots + i;
+    if (*slot == 0)
+      return slot;
+    MapEntry *e = m->vec->data[*slot - 1];
+    if (e->key == key)
+      return slot;
+  }
+}
+
+static int map_rehash(Map *m, int new_capacity) {
+  int *slots = (int *)arena_alloc_tagged(&table_arena, MEM_MAP,
+                                         new_capacity * sizeof(int));
+  arena_free_tagged(&table_arena, MEM_MAP, m->slots,
+                    m->capacity * sizeof(int));
+  m->slots = slots;
+  m->capacity = new_capacity;
+
+  for (int i = 0; i < m->size; i++) {
+    MapEntry *e = m->vec->data[i];
+    int *slot = map_find_slot(m, e->key, e->hash);
+    if (*slot == 0)  // keep the first entry of duplicated keys
+      *slot = i + 1;
+  }
+  return 1;
+}
+
 int map_put(Map *m, MapEntry *e) {
+  // keep load factor <= 1/2
+  if (m->capacity < (m->size + 1) * 2) {
+    int new_capacity =
+        m->capacity == 0 ? MAP_INITIAL_CAPACITY : m->capacity * 2;
+    if (map_rehash(m, new_capacity) == 0)
+      return 0;
+  }
+
   if (vector_push_back(m->vec, e)) {
     m->size++;
+    int *slot = map_find_slot(m, e->key, e->hash);
+    if (*slot == 0)
+      *slot = m->size;
     return 1;
   } else {
     return 0;
@@ -29,10 +70,8 @@ int map_put(Map *m, MapEntry *e) {
 }
 
 MapEntry *map_get(Map *m, char *key) {
-  for (int i = 0; i < m->size; i++) {
-    MapEntry *e = (MapEntry *)vector_at(m->vec, i);
-    if (strcmp(e->key, key) == 0)
-      return e;
-  }
-  return NULL;
+  if (m->size == 0)
+    return NULL;
+  int *slot = map_find_slot(m, key, intern_hash(key));
+  return *slot == 0 ? NULL : m->vec->data[*slot - 1];
 }
@@ -3,22 +3,28 @@
 #include <string.h>
 #include "uoocc.h"
 
+_Thread_local Compilation *compilation;
+
+// set while the server compiles a request
+_Thread_local jmp_buf *error_return;
+
 char *allocate_string(char *s) {
-  char *p = (char *)malloc(sizeof(char) * (strlen(s) + 1));
-  strcpy(p, s);
-  return p;
+  char *p = arena_alloc_tagged(&string_arena, MEM_STRING, strlen(s) + 1);
+  return strcpy(p, s);
 }
 
 char *allocate_concat_2string(char *s1, char *s2) {
-  char *p = (char *)malloc(sizeof(char) * (strlen(s1) + strlen(s2) + 1));
+  char *p = (char *)arena_alloc_tagged(
+      &string_arena, MEM_STRING, sizeof(char) * (strlen(s1) + strlen(s2) + 1));
   strcpy(p, s1);
   strcat(p, s2);
   return p;
 }
 
 char *allocate_concat_3string(char *s1, char *s2, char *s3) {
-  char *p =
-      (char *)malloc(sizeof(char) * (strlen(s1) + strlen(s2) + strlen(s3) + 1));
+  char *p = (char *)arena_alloc_tagged(
+      &string_arena, MEM_STRING,
+      sizeof(char) * (strlen(s1) + strlen(s2) + strlen(s3) + 1));
   strcpy(p, s1);
   strcat(p, s2);
   strcat(p, s3);
@@ -26,22 +32,36 @@ char *allocate_concat_3string(char *s1, char *s2, char *s3) {
 }
 
 int *allocate_integer(int n) {
-  int *p = (int *)malloc(sizeof(int));
+  int *p = (int *)arena_alloc(&table_arena, sizeof(int));
   *p = n;
   return p;
 }
 
+// ends the compilation with failure. The server goes on with the next
+// request, otherwise the process exits.
+_Noreturn void abort_compilation(void) {
+  if (error_return != NULL)
+    longjmp(*error_return, 1);
+  exit(1);
+}
+
 void error(char *s) {
   fprintf(stderr, "Error: %s.\n", s);
-  exit(1);
+  abort_compilation();
 }
 
-void error_with_token(Token *tk, char *s) {
-  fprintf(stderr, "%d:%d:<%s> Error: %s.\n", tk->row, tk->col, tk->text, s);
-  exit(1);
+void error_with_token(Token tk, char *s) {
+  int row, col;
+  token_position(tk, &row, &col);
+  if (tk.type == TK_EOF)
+    fprintf(stderr, "%d:%d:<EOF> Error: %s.\n", row, col, s);
+  else
+    fprintf(stderr, "%d:%d:<%.*s> Error: %s.\n", row, col, tk.length,
+            compilation->token_queue.source.buf + tk.offset, s);
+  abort_compilation();
 }
 
-void expect_token(Token *tk, int expect) {
+void expect_token(Token tk, int expect) {
   char *token[] = {"EOF",    "number",   "string",    "ident",   "'+'",
                    "'-'",    "'*'",      "'/'",       "'&'",     "'|'",
                    "'^'",    "'~'",      "'<<'",      "'>>'",    "'&&'",
@@ -52,14 +72,18 @@ void expect_token(Token *tk, int expect) {
                    "'->'",   "'sizeof'", "'if'",      "'else'",  "'while'",
                    "'for'",  "'int'",    "'char'",    "'void'",  "'return'",
                    "'enum'", "'struct'", "'typedef'", "'break'", "'continue'"};
-  if (tk == NULL)
-    error(allocate_concat_2string(token[expect], " was expected"));
-  else if (tk->type != expect)
+  if (tk.type != expect)
     error_with_token(tk,
                      allocate_concat_2string(token[expect], " was expected"));
 }
 
 int get_sequence_num(void) {
-  static int seq = 0;
-  return seq++;
+  return compilation->seq++;
+}
+
+// returns the first of n consecutive sequence numbers.
+int reserve_sequence_nums(int n) {
+  int first = compilation->seq;
+  compilation->seq += n;
+  return first;
 }
@@ -0,0 +1,96 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "uoocc.h"
+
+_Thread_local Output *asm_output;
+
+// fd < 0 keeps the whole output in memory.
+void output_init(Output *out, int fd) {
+  out->fd = fd;
+  out->len = 0;
+  out->cap = OUTPUT_BUFFER_SIZE;
+  out->buf = malloc(out->cap);
+  if (out->buf == NULL)
+    error("out of memory");
+}
+
+void output_flush(Output *out) {
+  if (out->fd < 0)
+    return;
+  for (char *p = out->buf; p < out->buf + out->len;) {
+    ssize_t n = write(out->fd, p, out->buf + out->len - p);
+    if (n < 0)
+      error("cannot write the output");
+    p += n;
+  }
+  out->len = 0;
+}
+
+void output_release(Output *out) {
+  output_flush(out);
+  free(out->buf);
+  out->buf = NULL;
+  out->len = out->cap = 0;
+}
+
+static void output_reserve(Output *out, int size) {
+  if (out->len + size <= out->cap)
+    return;
+  output_flush(out);
+  if (out->len + size <= out->cap)
+    return;
+
+  while (out->cap < out->len + size)
+    out->cap *= 2;
+  out->buf = realloc(out->buf, out->cap);
+  if (out->buf == NULL)
+    error("out of memory");
+}
+
+void output_write(Output *out, char *s, int len) {
+  output_reserve(out, len);
+  memcpy(out->buf + out->len, s, len);
+  out->len += len;
+}
+
+void output_int(Output *out, long n) {
+  char tmp[24];
+  int i = sizeof(tmp);
+  unsigned long u = n < 0 ? -(unsigned long)n : (unsigned long)n;
+  do {
+    tmp[--i] = '0' + u % 10;
+    u /= 10;
+  } while (u != 0);
+  if (n < 0)
+    tmp[--i] = '-';
+  output_write(out, tmp + i, sizeof(tmp) - i);
+}
+
+// printf for assembly: supports only %d, %s and %%.
+void emit(char *fmt, ...) {
+  va_list ap;
+  va_start(ap, fmt);
+  while (*fmt != '\0') {
+    char *p = strchr(fmt, '%');
+    if (p == NULL) {
+      output_write(asm_output, fmt, strlen(fmt));
+      break;
+    }
+    output_write(asm_output, fmt, p - fmt);
+    if (p[1] == 'd') {
+      output_int(asm_output, va_arg(ap, int));
+    } else if (p[1] == 's') {
+      char *s = va_arg(ap, char *);
+      output_write(asm_output, s, strlen(s));
+    } else if (p[1] == '%') {
+      output_write(asm_output, "%", 1);
+    } else {
+      error("unknown conversion in emit");
+    }
+    fmt = p + 2;
+  }
+  va_end(ap);
+}
@@ -1,11 +1,7 @@
-#include <stdlib.h>
 #include "uoocc.h"
 
-Map *string_table;
-Map *typedef_table;
-
 CType *make_ctype(int type, CType *ptrof) {
-  CType *p = (CType *)malloc(sizeof(CType));
+  CType *p = (CType *)arena_alloc_tagged(&ast_arena, MEM_CTYPE, sizeof(CType));
   p->type = type;
   p->ptrof = ptrof;
   p->array_size = 0;
@@ -15,8 +11,8 @@ CType *make_ctype(int type, CType *ptrof) {
   return p;
 }
 
-Ast *make_ast_op(int type, Ast *left, Ast *right, Token *token) {
-  Ast *p = malloc(sizeof(Ast));
+Ast *make_ast_op(int type, Ast *left, Ast *right, Token token) {
+  Ast *p = arena_alloc_tagged(&ast_arena, MEM_AST, sizeof(Ast));
   p->type = type;
   p->left = left;
   p->right = right;
@@ -25,7 +21,7 @@ Ast *make_ast_op(int type, Ast *left, Ast *right, Token *token) {
 }
 
 Ast *make_ast_int(int val) {
-  Ast *p = malloc(sizeof(Ast));
+  Ast *p = arena_alloc_tagged(&ast_arena, MEM_AST, sizeof(Ast));
   p->type = AST_INT;
   p->ctype = make_ctype(TYPE_INT, NULL);
   p->ival = val;
@@ -33,31 +29,31 @@ Ast *make_ast_int(int val) {
 }
 
 Ast *make_ast_str(int label) {
-  Ast *p = malloc(sizeof(Ast));
+  Ast *p = arena_alloc_tagged(&ast_arena, MEM_AST, sizeof(Ast));
   p->type = AST_STR;
   p->ctype = make_ctype(TYPE_PTR, make_ctype(TYPE_CHAR, NULL));
   p->label = label;
   return p;
 }
 
-static Ast *make_ast_var(char *ident, Token *token) {
-  Ast *p = malloc(sizeof(Ast));
+static Ast *make_ast_var(char *ident, Token token) {
+  Ast *p = arena_alloc_tagged(&ast_arena, MEM_AST, sizeof(Ast));
   p->type = AST_VAR;
   p->ident = ident;
   p->token = token;
   return p;
 }
 
-static Ast *make_ast_enum(CType *ctype, Token *token) {
-  Ast *p = malloc(sizeof(Ast));
+static Ast *make_ast_enum(CType *ctype, Token token) {
+  Ast *p = arena_alloc_tagged(&ast_arena, MEM_AST, sizeof(Ast));
   p->type = AST_ENUM;
   p->ctype = ctype;
   p->token = token;
   return p;
 }
 
-static Ast *make_ast_decl_var(CType *ctype, char *ident, Token *token) {
-  Ast *p = malloc(sizeof(Ast));
+static Ast *make_ast_decl_var(CType *ctype, char *ident, Token token) {
+  Ast *p = arena_alloc_tagged(&ast_arena, MEM_AST, sizeof(Ast));
   p->type = AST_DECL_LOCAL_VAR;
   p->ctype = ctype;
   p->ident = ident;
@@ -66,7 +62,7 @@ static Ast *make_ast_decl_var(CType *ctype, char *ident, Token *token) {
 }
 
 static Ast *make_ast_call_func(char *ident) {
-  Ast *p = malloc(sizeof(Ast));
+  Ast *p = arena_alloc_tagged(&ast_arena, MEM_AST, sizeof(Ast));
   p->type = AST_CALL_FUNC;
   p->ctype = make_ctype(TYPE_INT, NULL);
   p->ident = ident;
@@ -74,8 +70,8 @@ static Ast *make_ast_call_func(char *ident) {
   return p;
 }
 
-static Ast *make_ast_decl_func(CType *ctype, char *ident, Token *token) {
-  Ast *p = malloc(sizeof(Ast));
+static Ast *make_ast_decl_func(CType *ctype, char *ident, Token token) {
+  Ast *p = arena_alloc_tagged(&ast_arena, MEM_AST, sizeof(Ast));
   p->type = AST_DECL_FUNC;
   p->ctype = ctype;
   p->ident = ident;
@@ -87,14 +83,14 @@ static Ast *make_ast_decl_func(CType *ctype, char *ident, Token *token) {
 }
 
 static Ast *make_ast_compound_statement(void) {
-  Ast *p = malloc(sizeof(Ast));
+  Ast *p = arena_alloc_tagged(&ast_arena, MEM_AST, sizeof(Ast));
   p->type = AST_COMPOUND_STATEMENT;
   p->statements = vector_new();
   return p;
 }
 
-static Ast *make_ast_statement(int type, Token *token) {
-  Ast *p = malloc(sizeof(Ast));
+static Ast *make_ast_statement(int type, Token token) {
+  Ast *p = arena_alloc_tagged(&ast_arena, MEM_AST, sizeof(Ast));
   p->type = type;
   p->token = token;
   return p;
@@ -116,10 +112,10 @@ static Ast *expr(void);
 
 // <call_function> = <ident> '(' [ <expr> { ',' <expr> } ] ')'
 static Ast *call_function(void) {
-  Ast *p = make_ast_call_func(current_token()->text);
+  Ast *p = make_ast_call_func(token_text(current_token()));
   expect_token(next_token(), TK_LPAR);
 
-  if (second_token()->type == TK_RPAR) {
+  if (second_token().type == TK_RPAR) {
     next_token();
     next_token();
     return p;
@@ -128,7 +124,7 @@ static Ast *call_function(void) {
   do {
     next_token();
     vector_push_back(p->args, (void *)expr());
-  } while (current_token()->type == TK_COMMA);
+  } while (current_token().type == TK_COMMA);
 
   expect_token(current_token(), TK_RPAR);
 
@@ -139,7 +135,7 @@ static Ast *call_function(void) {
 // <primary_expr> = <ident> | <number> | '(' <expr> ')' | <call_function>
 //   | <string>
 static Ast *primary_expr(void) {
-  int type = current_token()->type;
+  int type = current_token().type;
   Ast *ret = NULL;
   if (type == TK_LPAR) {
     next_token();
@@ -147,19 +143,20 @@ static Ast *primary_expr(void) {
     expect_token(current_token(), TK_RPAR);
     next_token();
   } else if (type == TK_NUM) {
-    ret = make_ast_int(current_token()->number);
+    ret = make_ast_int(current_token().value);
     next_token();
-  } else if (type == TK_IDENT && second_token()->type == TK_LPAR) {
+  } else if (type == TK_IDENT && second_token().type == TK_LPAR) {
     ret = call_function();
   } else if (type == TK_IDENT) {
-    ret = make_ast_var(current_token()->text, current_token());
+    ret = make_ast_var(token_text(current_token()), current_token());
     next_token();
   } else if (type == TK_STR) {
-    MapEntry *e = map_get(string_table, current_token()->text);
+    MapEntry *e =
+        map_get(compilation->string_table, token_text(current_token()));
     if (e == NULL) {
       int seq = get_sequence_num();
-      e = allocate_MapEntry(current_token()->text, allocate_integer(seq));
-      map_put(string_table, e);
+      e = allocate_MapEntry(token_text(current_token()), allocate_integer(seq));
+      map_put(compilation->string_table, e);
     }
     next_token();
     ret = make_ast_str(*(int *)e->val);
@@ -179,20 +176,20 @@ static Ast *primary_expr(void) {
     '[' <expr> ']' <postfix_expr_tail>
 */
 static Ast *postfix_expr_tail(Ast *left) {
-  Token *tk = current_token();
-  int type = tk->type;
+  Token tk = current_token();
+  int type = tk.type;
   if (type == TK_DOT) {
     expect_token(next_token(), TK_IDENT);
-    Token *ident = current_token();
+    Token ident = current_token();
     next_token();
-    Ast *right = make_ast_var(ident->text, ident);
+    Ast *right = make_ast_var(token_text(ident), ident);
     Ast *p = make_ast_op(AST_OP_DOT, left, right, tk);
     return postfix_expr_tail(p);
   } else if (type == TK_ARROW) {
     expect_token(next_token(), TK_IDENT);
-    Token *ident = current_token();
+    Token ident = current_token();
     next_token();
-    Ast *right = make_ast_var(ident->text, ident);
+    Ast *right = make_ast_var(token_text(ident), ident);
     Ast *p = make_ast_op(AST_OP_ARROW, left, right, tk);
     return postfix_expr_tail(p);
   } else if (type == TK_INC || type == TK_DEC) {
@@ -217,7 +214,7 @@ static Ast *postfix_expr(void) {
   return postfix_expr_tail(p);
 }
 
-static int is_type_specifier(Token *);
+static int is_type_specifier(Token);
 static CType *type_name(void);
 
 /*
@@ -226,8 +223,8 @@ static CType *type_name(void);
     'sizeof' <unary_expr> | 'sizeof' '(' <type_name> ')'
 */
 static Ast *unary_expr(void) {
-  Token *tk = current_token();
-  int type = tk->type;
+  Token tk = current_token();
+  int type = tk.type;
   int ast_op;
 
   if (type == TK_INC)
@@ -247,7 +244,7 @@ static Ast *unary_expr(void) {
   else
     ast_op = -1;
 
-  if (ast_op == AST_OP_SIZEOF && second_token()->type == TK_LPAR &&
+  if (ast_op == AST_OP_SIZEOF && second_token().type == TK_LPAR &&
       is_type_specifier(third_token())) {
     next_token();
     next_token();
@@ -271,8 +268,8 @@ static Ast *unary_expr(void) {
     | '/' <unary_expr> <multiplicative_expr_tail>
 */
 static Ast *multiplicative_expr_tail(Ast *left) {
-  Token *tk = current_token();
-  int type = tk->type;
+  Token tk = current_token();
+  int type = tk.type;
   if (type == TK_STAR || type == TK_DIV) {
     next_token();
     Ast *right = unary_expr();
@@ -295,8 +292,8 @@ static Ast *multiplicative_expr(Ast *unary) {
     '-' <multiplicative_expr> <additive_expr_tail>
 */
 static Ast *additive_expr_tail(Ast *left) {
-  Token *tk = current_token();
-  int type = tk->type;
+  Token tk = current_token();
+  int type = tk.type;
   if (type == TK_PLUS || type == TK_MINUS) {
     next_token();
     Ast *right = multiplicative_expr(NULL);
@@ -319,8 +316,8 @@ static Ast *additive_expr(Ast *unary) {
     '>>' <additive_expr> <shift_expr_tail>
 */
 static Ast *shift_expr_tail(Ast *left) {
-  Token *tk = current_token();
-  int type = tk->type;
+  Token tk = current_token();
+  int type = tk.type;
   if (type == TK_LSHIFT || type == TK_RSHIFT) {
     next_token();
     Ast *right = additive_expr(NULL);
@@ -345,8 +342,8 @@ static Ast *shift_expr(Ast *unary) {
     '>=' <shift_expr> <relational_expr_tail>
 */
 static Ast *relational_expr_tail(Ast *left) {
-  Token *tk = current_token();
-  int type = tk->type;
+  Token tk = current_token();
+  int type = tk.type;
   if (type == TK_LT || type == TK_LE || type == TK_GT || type == TK_GE) {
     next_token();
     Ast *p, *right = shift_expr(NULL);
@@ -375,8 +372,8 @@ static Ast *relational_expr(Ast *unary) {
     '!=' <relational_expr> <equality_expr_tail>
 */
 static Ast *equality_expr_tail(Ast *left) {
-  Token *tk = current_token();
-  int type = tk->type;
+  Token tk = current_token();
+  int type = tk.type;
   if (type == TK_EQUAL || type == TK_NEQUAL) {
     next_token();
     Ast *right = relational_expr(NULL);
@@ -398,8 +395,8 @@ static Ast *equality_expr(Ast *unary) {
   <and_expr_tail> = ε | '&' <equality_expr> <and_expr_tail>
 */
 static Ast *and_expr_tail(Ast *left) {
-  Token *tk = current_token();
-  if (tk->type == TK_AMP) {
+  Token tk = current_token();
+  if (tk.type == TK_AMP) {
     next_token();
     Ast *right = relational_expr(NULL);
     Ast *p = make_ast_op(AST_OP_B_AND, left, right, tk);
@@ -419,8 +416,8 @@ static Ast *and_expr(Ast *unary) {
   <exclusive_or_expr_tail> = ε | '^' <and_expr> <exclusive_or_expr_tail>
 */
 static Ast *exclusive_or_expr_tail(Ast *left) {
-  Token *tk = current_token();
-  if (tk->type == TK_B_XOR) {
+  Token tk = current_token();
+  if (tk.type == TK_B_XOR) {
     next_token();
     Ast *right = and_expr(NULL);
     Ast *p = make_ast_op(AST_OP_B_XOR, left, right, tk);
@@ -441,8 +438,8 @@ static Ast *exclusive_or_expr(Ast *unary) {
     <inclusive_or_expr_tail>
 */
 static Ast *inclusive_or_expr_tail(Ast *left) {
-  Token *tk = current_token();
-  if (tk->type == TK_B_OR) {
+  Token tk = current_token();
+  if (tk.type == TK_B_OR) {
     next_token();
     Ast *right = exclusive_or_expr(NULL);
     Ast *p = make_ast_op(AST_OP_B_OR, left, right, tk);
@@ -463,8 +460,8 @@ static Ast *inclusive_or_expr(Ast *unary) {
     <logical_and_expr_tail>
 */
 static Ast *logical_and_expr_tail(Ast *left) {
-  Token *tk = current_token();
-  if (tk->type == TK_L_AND) {
+  Token tk = current_token();
+  if (tk.type == TK_L_AND) {
     next_token();
     Ast *right = inclusive_or_expr(NULL);
     Ast *p = make_ast_op(AST_OP_L_AND, left, right, tk);
@@ -485,8 +482,8 @@ static Ast *logical_and_expr(Ast *unary) {
     <logical_or_expr_tail>
 */
 static Ast *logical_or_expr_tail(Ast *left) {
-  Token *tk = current_token();
-  if (tk->type == TK_L_OR) {
+  Token tk = current_token();
+  if (tk.type == TK_L_OR) {
     next_token();
     Ast *right = logical_and_expr(NULL);
     Ast *p = make_ast_op(AST_OP_L_OR, left, right, tk);
@@ -504,8 +501,8 @@ static Ast *logical_or_expr(Ast *unary) {
 // <expr> = <unary_expr> '=' <expr> | <logical_or_expr>
 static Ast *expr(void) {
   Ast *p = unary_expr();
-  if (current_token()->type == TK_ASSIGN) {
-    Token *tk = current_token();
+  if (current_token().type == TK_ASSIGN) {
+    Token tk = current_token();
     next_token();
     return make_ast_op(AST_OP_ASSIGN, p, expr(), tk);
   } else {
@@ -517,22 +514,22 @@ static Ast *expr(void) {
 static CType *pointer(CType *ctype) {
   // current token is '*' when enter this function.
   ctype = make_ctype(TYPE_PTR, ctype);
-  if (next_token()->type == TK_STAR)
+  if (next_token().type == TK_STAR)
     return pointer(ctype);
   else
     return ctype;
 }
 
-static Ast *decl_function(CType *, Token *);
+static Ast *decl_function(CType *, Token);
 
 // <direct_declarator_tail> = ε | '[' <number> ']' <direct_declarator_tail> |
 //   <decl_function>
-static Ast *direct_declarator_tail(Token *ident, CType *ctype) {
-  if (current_token()->type == TK_LBRA) {
+static Ast *direct_declarator_tail(Token ident, CType *ctype) {
+  if (current_token().type == TK_LBRA) {
     expect_token(next_token(), TK_NUM);
     if (ctype->type != TYPE_ARRAY) {
       ctype = make_ctype(TYPE_ARRAY, ctype);
-      ctype->array_size = current_token()->number;
+      ctype->array_size = current_token().value;
     } else {
       CType *p = ctype, *q = ctype->ptrof;
       while (q->type == TYPE_ARRAY) {
@@ -540,49 +537,51 @@ static Ast *direct_declarator_tail(Token *ident, CType *ctype) {
         q = q->ptrof;
       }
       CType *new = make_ctype(TYPE_ARRAY, q);
-      new->array_size = current_token()->number;
+      new->array_size = current_token().value;
       p->ptrof = new;
     }
     expect_token(next_token(), TK_RBRA);
     next_token();
     return direct_declarator_tail(ident, ctype);
-  } else if (current_token()->type == TK_LPAR) {
+  } else if (current_token().type == TK_LPAR) {
     return decl_function(ctype, ident);
   } else
-    return make_ast_decl_var(ctype, ident->text, ident);
+    return make_ast_decl_var(ctype, token_text(ident), ident);
 }
 
 // <direct_declarator> = <ident> <direct_declarator_tail>
 static Ast *direct_declarator(CType *ctype) {
   expect_token(current_token(), TK_IDENT);
-  Token *tk = current_token();
+  Token tk = current_token();
   next_token();
   return direct_declarator_tail(tk, ctype);
 }
 
 // <declarator> = <pointer_opt> <direct_declarator>
 static Ast *declarator(CType *ctype) {
-  if (current_token()->type == TK_STAR)
+  if (current_token().type == TK_STAR)
     ctype = pointer(ctype);
   return direct_declarator(ctype);
 }
 
-static int is_storage_class_cpecifier(Token *tk) {
-  int t = tk->type;
+static int is_storage_class_cpecifier(Token tk) {
+  int t = tk.type;
   return t == TK_TYPEDEF;
 }
 
-static int is_type_specifier(Token *tk) {
-  int t = tk->type;
+static int is_type_specifier(Token tk) {
+  int t = tk.type;
   return t == TK_INT || t == TK_CHAR || t == TK_VOID || t == TK_STRUCT ||
-         t == TK_ENUM || typedeftable_get(typedef_table, tk->text) != NULL;
+         t == TK_ENUM ||
+         (t == TK_IDENT &&
+          typedeftable_get(compilation->typedef_table, token_text(tk)) != NULL);
 }
 
 // <enumerator_list_tail> = ε | ',' ident
 static void enumerator_list_tail(Vector *list) {
-  if (current_token()->type == TK_COMMA && second_token()->type == TK_IDENT) {
+  if (current_token().type == TK_COMMA && second_token().type == TK_IDENT) {
     expect_token(next_token(), TK_IDENT);
-    vector_push_back(list, current_token()->text);
+    vector_push_back(list, token_text(current_token()));
     next_token();
     enumerator_list_tail(list);
   }
@@ -594,7 +593,7 @@ static void enumerator_list_tail(Vector *list) {
 static Vector *enumerator_list(void) {
   Vector *list = vector_new();
   expect_token(current_token(), TK_IDENT);
-  vector_push_back(list, current_token()->text);
+  vector_push_back(list, token_text(current_token()));
   next_token();
   enumerator_list_tail(list);
   return list;
@@ -606,7 +605,7 @@ static Vector *enum_specifier(void) {
   expect_token(next_token(), TK_LCUR);
   next_token();
   Vector *list = enumerator_list();
-  if (current_token()->type == TK_COMMA)
+  if (current_token().type == TK_COMMA)
     next_token();
   expect_token(current_token(), TK_RCUR);
   next_token();
@@ -620,7 +619,8 @@ static Ast *declaration(void);
 static StructMember *struct_declaration() {
   Ast *p = declaration();
   if (p->type == AST_DECL_LOCAL_VAR) {
-    StructMember *ret = malloc(sizeof(StructMember));
+    StructMember *ret =
+        arena_alloc_tagged(&ast_arena, MEM_CTYPE, sizeof(StructMember));
     ret->ctype = p->ctype;
     ret->name = p->ident;
     return ret;
@@ -658,9 +658,9 @@ static Vector *struct_declaration_list() {
 static CType *struct_specifier() {
   char *tag = NULL;
   expect_token(current_token(), TK_STRUCT);
-  if (next_token()->type == TK_IDENT) {
-    tag = current_token()->text;
-    if (next_token()->type != TK_LCUR) {
+  if (next_token().type == TK_IDENT) {
+    tag = token_text(current_token());
+    if (next_token().type != TK_LCUR) {
       CType *ret = make_ctype(TYPE_STRUCT, NULL);
       ret->struct_tag = tag;
       return ret;
@@ -680,22 +680,27 @@ static CType *struct_specifier() {
 //   <enum_specifier> | <defined_type>
 static CType *type_specifier(void) {
   CType *ret;
-  if (current_token()->type == TK_INT) {
+  if (current_token().type == TK_INT) {
     ret = make_ctype(TYPE_INT, NULL);
     next_token();
-  } else if (current_token()->type == TK_CHAR) {
+  } else if (current_token().type == TK_CHAR) {
     ret = make_ctype(TYPE_CHAR, NULL);
     next_token();
-  } else if (current_token()->type == TK_VOID) {
+  } else if (current_token().type == TK_VOID) {
     ret = make_ctype(TYPE_VOID, NULL);
     next_token();
-  } else if (current_token()->type == TK_STRUCT) {
+  } else if (current_token().type == TK_STRUCT) {
     ret = struct_specifier();
-  } else if (current_token()->type == TK_ENUM) {
+  } else if (current_token().type == TK_ENUM) {
     ret = make_ctype(TYPE_ENUM, NULL);
     ret->enumerator_list = enum_specifier();
   } else {
-    CType *p = typedeftable_get(typedef_table, current_token()->text);
+    if (current_token().type != TK_IDENT)
+      error_with_token(current_token(), "type_specifier was expected");
+    CType *p = typedeftable_get(compilation->typedef_table,
+                                token_text(current_token()));
+    if (p == NULL)
+      error_with_token(current_token(), "unknown type name");
     ret = p->ptrof;
     next_token();
   }
@@ -704,20 +709,18 @@ static CType *type_specifier(void) {
 }
 
 // <storage_class_cpecifier> = 'typedef'
-static Token *storage_class_cpecifier(void) {
-  if (current_token()->type == TK_TYPEDEF) {
-    Token *tk = current_token();
+static int storage_class_cpecifier(void) {
+  if (current_token().type == TK_TYPEDEF) {
     next_token();
-    return tk;
+    return 1;
   } else {
-    return NULL;
+    return 0;
   }
 }
 
 // <declaration_specifiers> = [ <storage_class_cpecifier> ] <type_specifier>
 static CType *declaration_specifiers(void) {
-  Token *tk = storage_class_cpecifier();
-  if (tk == NULL)
+  if (!storage_class_cpecifier())
     return type_specifier();
   else
     return make_ctype(TYPE_TYPEDEF, type_specifier());
@@ -726,9 +729,9 @@ static CType *declaration_specifiers(void) {
 // <declaration> = <declaration_specifiers> [ <declarator> ] ';'
 static Ast *declaration(void) {
   Ast *p;
-  Token *tk = current_token();
+  Token tk = current_token();
   CType *ctype = declaration_specifiers();
-  if (current_token()->type == TK_SEMI) {
+  if (current_token().type == TK_SEMI) {
     if (ctype->type != TYPE_ENUM)  // only enum can skip <declarator>
       error_with_token(current_token(), "declarator was expected");
     p = make_ast_enum(ctype, tk);
@@ -743,8 +746,8 @@ static Ast *declaration(void) {
   if (ctype->type == TYPE_TYPEDEF) {
     // register type
     MapEntry *e = allocate_MapEntry(p->ident, ctype);
-    if (map_get(typedef_table, e->key) == NULL)
-      map_put(typedef_table, e);
+    if (map_get(compilation->typedef_table, e->key) == NULL)
+      map_put(compilation->typedef_table, e);
     else
       error_with_token(
           p->token, allocate_concat_3string("redefinition of '", e->key, "'"));
@@ -758,7 +761,7 @@ static Ast *declaration(void) {
 // <type_name> = <type_specifier> <pointer_opt>
 static CType *type_name(void) {
   CType *ret = type_specifier();
-  if (current_token()->type == TK_STAR)
+  if (current_token().type == TK_STAR)
     ret = pointer(ret);
   return ret;
 }
@@ -766,30 +769,29 @@ static CType *type_name(void) {
 // <decl_function> =
 //   '(' [ <declaration_specifiers> <pointer_opt> [ <ident> ]
 //   { ',' <declaration_specifiers> <pointer_opt> [ <ident> ] } ] ')'
-static Ast *decl_function(CType *ctype, Token *tk) {
+static Ast *decl_function(CType *ctype, Token tk) {
   // current token is '(' when enter this function.
-  Ast *p = make_ast_decl_func(ctype, tk->text, tk);
+  Ast *p = make_ast_decl_func(ctype, token_text(tk), tk);
 
-  if (second_token()->type != TK_RPAR) {
+  if (second_token().type != TK_RPAR) {
     do {
       next_token();
       if (!is_type_specifier(current_token()))
         error_with_token(current_token(), "type_specifier was expected");
       CType *ctype = declaration_specifiers();
 
-      if (current_token()->type == TK_STAR)
+      if (current_token().type == TK_STAR)
         ctype = pointer(ctype);
 
       // TODO: check exist ident when function declaration
       // skip ident when function prototype
-      if (current_token()->type == TK_IDENT) {
+      if (current_token().type == TK_IDENT) {
         expect_token(current_token(), TK_IDENT);
-        vector_push_back(
-            p->args,
-            make_ast_decl_var(ctype, current_token()->text, current_token()));
+        Token tk = current_token();
+        vector_push_back(p->args, make_ast_decl_var(ctype, token_text(tk), tk));
         next_token();
       }
-    } while (current_token()->type == TK_COMMA);
+    } while (current_token().type == TK_COMMA);
     expect_token(current_token(), TK_RPAR);
   } else
     next_token();
@@ -813,7 +815,7 @@ static Ast *selection_statement(void) {
   next_token();
   p->left = statement();
 
-  if (current_token()->type == TK_ELSE) {
+  if (current_token().type == TK_ELSE) {
     next_token();
     p->right = statement();
   }
@@ -830,7 +832,7 @@ static Ast *iteration_statement(void) {
   // current token is 'while' or 'for' when enter this function.
   Ast *p;
 
-  if (current_token()->type == TK_WHILE) {
+  if (current_token().type == TK_WHILE) {
     p = make_ast_statement(AST_WHILE_STATEMENT, current_token());
 
     expect_token(next_token(), TK_LPAR);
@@ -863,10 +865,10 @@ static Ast *iteration_statement(void) {
 static Ast *compound_statement(void) {
   // current token is '{' when enter this function.
   Ast *p = make_ast_compound_statement();
-  typedef_table = map_new(typedef_table);
+  compilation->typedef_table = map_new(compilation->typedef_table);
 
   next_token();
-  while (current_token()->type != TK_RCUR) {
+  while (current_token().type != TK_RCUR) {
     if (is_storage_class_cpecifier(current_token()) ||
         is_type_specifier(current_token()))
       vector_push_back(p->statements, declaration());
@@ -875,14 +877,14 @@ static Ast *compound_statement(void) {
   }
   next_token();
 
-  typedef_table = typedef_table->next;
+  compilation->typedef_table = compilation->typedef_table->next;
   return p;
 }
 
 // <expr_statement> = <expr_opt> ';'
 static Ast *expr_statement(void) {
-  if (current_token()->type != TK_SEMI) {
-    Ast *p = make_ast_statement(AST_EXPR_STATEMENT, NULL);
+  if (current_token().type != TK_SEMI) {
+    Ast *p = make_ast_statement(AST_EXPR_STATEMENT, current_token());
     p->expr = expr();
     expect_token(current_token(), TK_SEMI);
     next_token();
@@ -898,10 +900,10 @@ static Ast *expr_statement(void) {
 static Ast *jump_statement(void) {
   // current token is 'return', 'break' or 'continue' when enter this function.
   Ast *p;
-  if (current_token()->type == TK_RETURN) {
+  if (current_token().type == TK_RETURN) {
     p = make_ast_statement(AST_RETURN_STATEMENT, current_token());
     next_token();
-    if (current_token()->type != TK_SEMI) {
+    if (current_token().type != TK_SEMI) {
       p->expr = expr();
       expect_token(current_token(), TK_SEMI);
       next_token();
@@ -910,7 +912,7 @@ static Ast *jump_statement(void) {
       p->expr = NULL;
     }
   } else {
-    if (current_token()->type == TK_BREAK)
+    if (current_token().type == TK_BREAK)
       p = make_ast_statement(AST_BREAK_STATEMENT, current_token());
     else
       p = make_ast_statement(AST_CONTINUE_STATEMENT, current_token());
@@ -924,7 +926,7 @@ static Ast *jump_statement(void) {
 // <statement> = <selection_statement> | <iteration_statement> |
 //   <compound_statement> | <jump_statement> | <expr_statement>
 static Ast *statement(void) {
-  int type = current_token()->type;
+  int type = current_token().type;
   if (type == TK_IF)
     return selection_statement();
   else if (type == TK_WHILE || type == TK_FOR)
@@ -942,14 +944,19 @@ static Ast *statement(void) {
 Vector *program(void) {
   Vector *v = vector_new();
 
-  while (current_token()->type != TK_EOF) {
+  // the tokens of the declarations so far, function bodies left out, so
+  // that a function is digested with everything it can see
+  unsigned long visible = DIGEST_INIT;
+  while (current_token().type != TK_EOF) {
+    unsigned long decl = take_token_digest();
+    visible = digest_n(visible, (char *)&decl, sizeof(decl));
     if (!is_storage_class_cpecifier(current_token()) &&
         !is_type_specifier(current_token()))
       error_with_token(current_token(), "type_specifier was expected");
     Ast *p;
-    Token *tk = current_token();
+    Token tk = current_token();
     CType *ctype = declaration_specifiers();
-    if (current_token()->type == TK_SEMI) {
+    if (current_token().type == TK_SEMI) {
       if (ctype->type != TYPE_ENUM)  // only enum can skip <declarator>
         error_with_token(current_token(), "declarator was expected");
       p = make_ast_enum(ctype, tk);
@@ -965,14 +972,18 @@ Vector *program(void) {
     if (ctype->type == TYPE_TYPEDEF) {
       // register type
       MapEntry *e = allocate_MapEntry(p->ident, ctype);
-      if (map_get(typedef_table, e->key) == NULL)
-        map_put(typedef_table, e);
+      if (map_get(compilation->typedef_table, e->key) == NULL)
+        map_put(compilation->typedef_table, e);
       else
         error_with_token(p->token, allocate_concat_3string("redefinition of '",
                                                            e->key, "'"));
 
+      // kept for the analysis to lay the type out in the file scope
+      p->type = AST_DECL_TYPEDEF;
+      p->ctype = ctype;
       expect_token(current_token(), TK_SEMI);
       next_token();
+      vector_push_back(v, p);
       continue;
     }
 
@@ -981,12 +992,16 @@ Vector *program(void) {
       expect_token(current_token(), TK_SEMI);
       next_token();
     } else if (p->type == AST_DECL_FUNC) {
-      if (current_token()->type == TK_SEMI) {
+      if (current_token().type == TK_SEMI) {
         p->statement = NULL;
         next_token();
       } else {
         expect_token(current_token(), TK_LCUR);
+        unsigned long signature = take_token_digest();
+        visible = digest_n(visible, (char *)&signature, sizeof(signature));
         p->statement = compound_statement();
+        unsigned long body = take_token_digest();
+        p->digest = digest_n(visible, (char *)&body, sizeof(body));
       }
     } else {
       error("declaration for variable or function was expected");
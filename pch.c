@@ -0,0 +1,354 @@
+#include <stdlib.h>
+#include <string.h>
+#include "uoocc.h"
+
+// A snapshot is the file scope after a header: typedefs, struct tags,
+// enumerators, prototypes and global variables. A translation unit whose
+// first tokens are those of the header takes the snapshot instead of
+// parsing them again. All numbers are in the byte order of the compiler,
+// which the compiler id pins down.
+//
+//   "UOOCCPCH" version compiler_id num_tokens token_digest
+//   strings:  count { length bytes }
+//   types:    count { type ptrof array_size tag num_enumerators { name }
+//                     num_members { type name offset } }
+//   typedefs: count { name type }
+//   symbols:  count { name type offset is_global is_constant constant_value
+//                     is_struct_tag ident }
+//   globals:  count { name type }
+//
+// References to strings and types are indices, -1 for NULL.
+
+#define PCH_MAGIC "UOOCCPCH"
+#define PCH_VERSION 1
+
+typedef struct {
+  Output *out;
+  Vector *strings;
+  Vector *ctypes;
+} Writer;
+
+static void put_int(Output *out, int n) {
+  output_write(out, (char *)&n, sizeof(n));
+}
+
+static void put_long(Output *out, unsigned long n) {
+  output_write(out, (char *)&n, sizeof(n));
+}
+
+static int index_of(Vector *v, void *p) {
+  for (int i = 0; i < v->size; i++)
+    if (v->data[i] == p)
+      return i;
+  return -1;
+}
+
+static void put_string(Writer *w, char *s) {
+  int i = s == NULL ? -1 : index_of(w->strings, s);
+  if (s != NULL && i < 0) {
+    vector_push_back(w->strings, s);
+    i = w->strings->size - 1;
+  }
+  put_int(w->out, i);
+}
+
+// numbers the type and the types it refers to.
+static void collect_ctype(Writer *w, CType *ctype) {
+  if (ctype == NULL || index_of(w->ctypes, ctype) >= 0)
+    return;
+  vector_push_back(w->ctypes, ctype);
+  collect_ctype(w, ctype->ptrof);
+  if (ctype->struct_decl != NULL)
+    for (int i = 0; i < ctype->struct_decl->size; i++)
+      collect_ctype(w, ((StructMember *)ctype->struct_decl->data[i])->ctype);
+}
+
+static void put_ctype(Writer *w, CType *ctype) {
+  put_int(w->out, ctype == NULL ? -1 : index_of(w->ctypes, ctype));
+}
+
+// the digest of the next n tokens, or of the tokens up to EOF when n < 0.
+// Returns the number of tokens in *n.
+static unsigned long digest_tokens(int *n) {
+  unsigned long digest = DIGEST_INIT;
+  int i = 0;
+  for (; *n < 0 || i < *n; i++) {
+    Token tk = current_token();
+    if (tk.type == TK_EOF)
+      break;
+    digest = digest_n(digest, (char *)&tk.type, sizeof(tk.type));
+    digest = digest_n(digest, token_text(tk), tk.length);
+    next_token();
+  }
+  *n = i;
+  return digest;
+}
+
+// writes the file scope left by the declarations of the header to out.
+// The header must not define functions, their code is not kept.
+void write_snapshot(Vector *decls, Output *out) {
+  Vector *globals = vector_new();
+  for (int i = 0; i < decls->size; i++) {
+    Ast *p = vector_at(decls, i);
+    if (p != NULL && p->type == AST_DECL_FUNC)
+      error_with_token(p->token, "a snapshot cannot hold function bodies");
+    if (p != NULL && p->type == AST_DECL_GLOBAL_VAR)
+      vector_push_back(globals, p);
+  }
+
+  // the tokens are lexed again to be compared with those of later units
+  TokenQueue *q = &compilation->token_queue;
+  init_token_queue_source(&q->source);
+  int num_tokens = -1;
+  unsigned long digest = digest_tokens(&num_tokens);
+
+  Output body;
+  output_init(&body, -1);
+  Writer w = {&body, vector_new(), vector_new()};
+  Vector *typedefs = compilation->typedef_table->vec;
+  Vector *symbols = symbol_table->vec;
+  for (int i = 0; i < typedefs->size; i++)
+    collect_ctype(&w, ((MapEntry *)typedefs->data[i])->val);
+  for (int i = 0; i < symbols->size; i++)
+    collect_ctype(&w,
+                  ((SymbolTableEntry *)((MapEntry *)symbols->data[i])->val)
+                      ->ctype);
+  for (int i = 0; i < globals->size; i++)
+    collect_ctype(&w, ((Ast *)globals->data[i])->ctype);
+
+  put_int(&body, w.ctypes->size);
+  for (int i = 0; i < w.ctypes->size; i++) {
+    CType *t = w.ctypes->data[i];
+    put_int(&body, t->type);
+    put_ctype(&w, t->ptrof);
+    put_int(&body, t->array_size);
+    put_string(&w, t->struct_tag);
+    Vector *v = t->enumerator_list;
+    put_int(&body, v == NULL ? -1 : v->size);
+    for (int j = 0; v != NULL && j < v->size; j++)
+      put_string(&w, v->data[j]);
+    v = t->struct_decl;
+    put_int(&body, v == NULL ? -1 : v->size);
+    for (int j = 0; v != NULL && j < v->size; j++) {
+      StructMember *m = v->data[j];
+      put_ctype(&w, m->ctype);
+      put_string(&w, m->name);
+      put_int(&body, m->offset);
+    }
+  }
+
+  put_int(&body, typedefs->size);
+  for (int i = 0; i < typedefs->size; i++) {
+    MapEntry *e = typedefs->data[i];
+    put_string(&w, e->key);
+    put_ctype(&w, e->val);
+  }
+
+  put_int(&body, symbols->size);
+  for (int i = 0; i < symbols->size; i++) {
+    MapEntry *e = symbols->data[i];
+    SymbolTableEntry *s = e->val;
+    put_string(&w, e->key);
+    put_ctype(&w, s->ctype);
+    put_int(&body, s->offset);
+    put_int(&body, s->is_global);
+    put_int(&body, s->is_constant);
+    put_int(&body, s->constant_value);
+    put_int(&body, s->is_struct_tag);
+    put_string(&w, s->ident);
+  }
+
+  put_int(&body, globals->size);
+  for (int i = 0; i < globals->size; i++) {
+    Ast *p = globals->data[i];
+    put_string(&w, p->ident);
+    put_ctype(&w, p->ctype);
+  }
+
+  output_write(out, PCH_MAGIC, strlen(PCH_MAGIC));
+  put_int(out, PCH_VERSION);
+  put_long(out, compiler_id());
+  put_int(out, num_tokens);
+  put_long(out, digest);
+  put_int(out, w.strings->size);
+  for (int i = 0; i < w.strings->size; i++) {
+    char *s = w.strings->data[i];
+    put_int(out, strlen(s));
+    output_write(out, s, strlen(s));
+  }
+  output_write(out, body.buf, body.len);
+  output_release(&body);
+}
+
+typedef struct {
+  char *p;
+  char *end;
+  int bad;  // read past the end or found a broken reference
+  char **strings;
+  int num_strings;
+  CType **ctypes;
+  int num_ctypes;
+} Reader;
+
+static void get_bytes(Reader *r, void *buf, int len) {
+  if (r->end - r->p < len) {
+    r->bad = 1;
+    memset(buf, 0, len);
+    return;
+  }
+  memcpy(buf, r->p, len);
+  r->p += len;
+}
+
+static int get_int(Reader *r) {
+  int n;
+  get_bytes(r, &n, sizeof(n));
+  return n;
+}
+
+static unsigned long get_long(Reader *r) {
+  unsigned long n;
+  get_bytes(r, &n, sizeof(n));
+  return n;
+}
+
+// counts are bounded by the bytes left, each element takes at least one
+// int
+static int get_count(Reader *r) {
+  int n = get_int(r);
+  if (n < -1 || n > (r->end - r->p) / (int)sizeof(int)) {
+    r->bad = 1;
+    return 0;
+  }
+  return n;
+}
+
+static char *get_string(Reader *r) {
+  int i = get_int(r);
+  if (i < -1 || i >= r->num_strings)
+    r->bad = 1;
+  return i < 0 || r->bad ? NULL : r->strings[i];
+}
+
+static CType *get_ctype(Reader *r) {
+  int i = get_int(r);
+  if (i < -1 || i >= r->num_ctypes)
+    r->bad = 1;
+  return i < 0 || r->bad ? NULL : r->ctypes[i];
+}
+
+static void read_ctype(Reader *r, CType *t) {
+  t->type = get_int(r);
+  t->ptrof = get_ctype(r);
+  t->array_size = get_int(r);
+  t->struct_tag = get_string(r);
+  int n = get_count(r);
+  if (n >= 0) {
+    t->enumerator_list = vector_new();
+    for (int i = 0; i < n && !r->bad; i++)
+      vector_push_back(t->enumerator_list, get_string(r));
+  }
+  n = get_count(r);
+  if (n >= 0) {
+    t->struct_decl = vector_new();
+    for (int i = 0; i < n && !r->bad; i++) {
+      StructMember *m =
+          arena_alloc_tagged(&ast_arena, MEM_CTYPE, sizeof(StructMember));
+      m->ctype = get_ctype(r);
+      m->name = get_string(r);
+      m->offset = get_int(r);
+      vector_push_back(t->struct_decl, m);
+    }
+  }
+}
+
+// registers the typedefs and symbols of the snapshot at path and returns
+// the declarations of its global variables, or NULL when the snapshot does
+// not fit the source. The tokens of the header are skipped then.
+Vector *adopt_snapshot(char *path) {
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL)
+    error(allocate_concat_3string("cannot open '", path, "'"));
+  Source src;
+  source_read(&src, fp);
+  fclose(fp);
+
+  Reader r = {src.buf, src.buf + src.len};
+  char magic[sizeof(PCH_MAGIC) - 1];
+  get_bytes(&r, magic, sizeof(magic));
+  int version = get_int(&r);
+  unsigned long id = get_long(&r);
+  int num_tokens = get_int(&r);
+  unsigned long digest = get_long(&r);
+  char *stale = NULL;
+  if (r.bad || memcmp(magic, PCH_MAGIC, sizeof(magic)) != 0)
+    stale = "is not a snapshot";
+  else if (version != PCH_VERSION || id != compiler_id())
+    stale = "was made by another compiler";
+  else if (num_tokens < 0 || digest_tokens(&num_tokens) != digest)
+    stale = "does not match the source";
+
+  if (stale == NULL) {
+    r.num_strings = get_count(&r);
+    r.strings = arena_alloc(&table_arena, r.num_strings * sizeof(char *) + 1);
+    for (int i = 0; i < r.num_strings && !r.bad; i++) {
+      int len = get_int(&r);
+      if (len < 0 || len > r.end - r.p)
+        r.bad = 1;
+      else
+        r.strings[i] = intern_string_n(r.p, len);
+      r.p += r.bad ? 0 : len;
+    }
+
+    r.num_ctypes = get_count(&r);
+    r.ctypes = arena_alloc(&table_arena, r.num_ctypes * sizeof(CType *) + 1);
+    for (int i = 0; i < r.num_ctypes; i++)
+      r.ctypes[i] = make_ctype(0, NULL);
+    for (int i = 0; i < r.num_ctypes && !r.bad; i++)
+      read_ctype(&r, r.ctypes[i]);
+    if (r.bad)
+      stale = "is broken";
+  }
+  if (stale != NULL) {
+    fprintf(stderr, "warning: '%s' %s, the header is parsed.\n", path, stale);
+    source_release(&src);
+    init_token_queue_source(&compilation->token_queue.source);
+    return NULL;
+  }
+
+  // a broken file stops short, everything read so far is consistent
+  for (int n = get_count(&r); n > 0 && !r.bad; n--) {
+    char *name = get_string(&r);
+    CType *ctype = get_ctype(&r);
+    if (!r.bad && name != NULL)
+      map_put(compilation->typedef_table, allocate_MapEntry(name, ctype));
+  }
+  for (int n = get_count(&r); n > 0 && !r.bad; n--) {
+    char *name = get_string(&r);
+    SymbolTableEntry *s = arena_alloc_tagged(&table_arena, MEM_SYMBOL,
+                                             sizeof(SymbolTableEntry));
+    s->ctype = get_ctype(&r);
+    s->offset = get_int(&r);
+    s->is_global = get_int(&r);
+    s->is_constant = get_int(&r);
+    s->constant_value = get_int(&r);
+    s->is_struct_tag = get_int(&r);
+    s->ident = get_string(&r);
+    s->decl_order = -1;  // before every declaration of the unit
+    if (!r.bad && name != NULL)
+      map_put(symbol_table, allocate_MapEntry(name, s));
+  }
+  Vector *globals = vector_new();
+  for (int n = get_count(&r); n > 0 && !r.bad; n--) {
+    Ast *p = arena_alloc_tagged(&ast_arena, MEM_AST, sizeof(Ast));
+    p->type = AST_DECL_GLOBAL_VAR;
+    p->ident = get_string(&r);
+    p->ctype = get_ctype(&r);
+    if (!r.bad)
+      vector_push_back(globals, p);
+  }
+  if (r.bad)
+    error(allocate_concat_3string("'", path, "' is broken"));
+  source_release(&src);
+  return globals;
+}
@@ -0,0 +1,325 @@
+#include <stdlib.h>
+#include <string.h>
+#include "uoocc.h"
+
+// The assembly of a function is split into lines, which the rules of the
+// table below rewrite until none of them applies. The rules rely on how
+// gen.c and regalloc.c use the registers: %rcx, %rdx and %rdi only carry a
+// value within a straight run of instructions, never across a label, a
+// jump or the end of the function, and the argument registers of a call
+// are set in the run which ends with it.
+
+typedef struct {
+  char *op;  // mnemonic, NULL for labels and directives
+  char *args[2];
+  int num_args;
+  char *text;  // the whole line
+  int dead;
+} Line;
+
+typedef struct {
+  char *names[4];  // by size: 8, 4, 2 and 1 bytes
+  int scratch;
+  int caller_saved;
+} Register;
+
+enum { RAX, RCX, RDX, RDI };
+
+static Register registers[] = {
+    {{"%rax", "%eax", "%ax", "%al"}, 0, 1},
+    {{"%rcx", "%ecx", "%cx", "%cl"}, 1, 1},
+    {{"%rdx", "%edx", "%dx", "%dl"}, 1, 1},
+    {{"%rdi", "%edi", "%di", "%dil"}, 1, 1},
+    {{"%rbx", "%ebx", "%bx", "%bl"}, 0, 0},
+    {{"%rsi", "%esi", "%si", "%sil"}, 0, 1},
+    {{"%rsp", "%esp", "%sp", "%spl"}, 0, 0},
+    {{"%rbp", "%ebp", "%bp", "%bpl"}, 0, 0},
+    {{"%r8", "%r8d", "%r8w", "%r8b"}, 0, 1},
+    {{"%r9", "%r9d", "%r9w", "%r9b"}, 0, 1},
+    {{"%r10", "%r10d", "%r10w", "%r10b"}, 0, 1},
+    {{"%r11", "%r11d", "%r11w", "%r11b"}, 0, 1},
+    {{"%r12", "%r12d", "%r12w", "%r12b"}, 0, 0},
+    {{"%r13", "%r13d", "%r13w", "%r13b"}, 0, 0},
+    {{"%r14", "%r14d", "%r14w", "%r14b"}, 0, 0},
+    {{"%r15", "%r15d", "%r15w", "%r15b"}, 0, 0},
+};
+
+#define NUM_REGISTERS (int)(sizeof(registers) / sizeof(registers[0]))
+
+// the register whose 8 byte name is s, -1 for other operands.
+static int reg_of(char *s) {
+  for (int r = 0; r < NUM_REGISTERS; r++)
+    if (strcmp(registers[r].names[0], s) == 0)
+      return r;
+  return -1;
+}
+
+static int is_name_char(char c) {
+  return ('a' <= c && c <= 'z') || ('0' <= c && c <= '9');
+}
+
+// whether any part of register r appears in the operand.
+static int mentions(char *operand, int r) {
+  for (int i = 0; i < 4; i++) {
+    char *name = registers[r].names[i];
+    int len = strlen(name);
+    for (char *s = strstr(operand, name); s != NULL; s = strstr(s + 1, name))
+      if (!is_name_char(s[len]))
+        return 1;
+  }
+  return 0;
+}
+
+static int is_op(Line *l, char *op) {
+  return l->op != NULL && strcmp(l->op, op) == 0;
+}
+
+// whether the instruction reads or writes register r, div and mul use
+// %rax and %rdx without naming them.
+static int mentions_line(Line *l, int r) {
+  if ((r == RAX || r == RDX) &&
+      (strncmp(l->op, "div", 3) == 0 || strncmp(l->op, "mul", 3) == 0 ||
+       strncmp(l->op, "idiv", 4) == 0))
+    return 1;
+  for (int i = 0; i < l->num_args; i++)
+    if (mentions(l->args[i], r))
+      return 1;
+  return 0;
+}
+
+// whether the instruction sets all of register r without reading it.
+static int writes(Line *l, int r) {
+  static char *moves[] = {"movq", "movslq", "movsbq", "movzbq", "leaq"};
+  if (is_op(l, "popq"))
+    return reg_of(l->args[0]) == r;
+  if (l->num_args != 2)
+    return 0;
+  if ((is_op(l, "xor") || is_op(l, "xorq")) && reg_of(l->args[0]) == r &&
+      reg_of(l->args[1]) == r)
+    return 1;
+  if (is_op(l, "movl"))
+    return strcmp(l->args[1], registers[r].names[1]) == 0 &&
+           !mentions(l->args[0], r);
+  for (int i = 0; i < (int)(sizeof(moves) / sizeof(moves[0])); i++)
+    if (is_op(l, moves[i]))
+      return reg_of(l->args[1]) == r && !mentions(l->args[0], r);
+  return 0;
+}
+
+// labels, directives, jumps, calls and returns end a straight run.
+static int ends_run(Line *l) {
+  return l->op == NULL || l->op[0] == 'j' || is_op(l, "call") ||
+         is_op(l, "ret");
+}
+
+static int next_line(Line *lines, int n, int i) {
+  for (i++; i < n && lines[i].dead; i++)
+    ;
+  return i;
+}
+
+// whether the value of register r is not read after line i.
+static int dead_after(Line *lines, int n, int i, int r) {
+  for (int k = next_line(lines, n, i); k < n; k = next_line(lines, n, k)) {
+    Line *l = &lines[k];
+    if (is_op(l, "ret"))
+      return r != RAX && registers[r].caller_saved;
+    if (is_op(l, "call"))
+      return registers[r].caller_saved;
+    if (ends_run(l))
+      return registers[r].scratch;
+    if (mentions_line(l, r))
+      return writes(l, r);
+  }
+  return registers[r].scratch;
+}
+
+// pushq X; popq Y becomes movq X, Y, or nothing when X is Y.
+static int push_pop(Line *lines, int n, int i) {
+  Line *l = &lines[i];
+  int j = next_line(lines, n, i);
+  if (!is_op(l, "pushq") || j == n || !is_op(&lines[j], "popq"))
+    return 0;
+  Line *m = &lines[j];
+  if (strcmp(l->args[0], m->args[0]) == 0) {
+    l->dead = m->dead = 1;
+    return 1;
+  }
+  // the address of a label stays on pushq, memory cannot move to memory
+  if (strncmp(l->args[0], "$.", 2) == 0 ||
+      (strchr(l->args[0], '(') != NULL && strchr(m->args[0], '(') != NULL))
+    return 0;
+  l->op = "movq";
+  l->args[1] = m->args[0];
+  l->num_args = 2;
+  m->dead = 1;
+  return 1;
+}
+
+// movq $N, %R; ...; addq %R, D becomes addq $N, D when nothing in between
+// touches %R and %R is not read afterwards. Likewise for the other
+// arithmetic instructions and cmpq.
+static int fold_immediate(Line *lines, int n, int i) {
+  static char *ops[] = {"addq", "subq", "cmpq", "andq", "orq", "xorq",
+                        "add",  "sub",  "cmp",  "and",  "or",  "xor"};
+  Line *l = &lines[i];
+  if (!is_op(l, "movq") || l->args[0][0] != '$' || l->args[0][1] == '.')
+    return 0;
+  long imm = strtol(l->args[0] + 1, NULL, 0);
+  int r = reg_of(l->args[1]);
+  if (r < 0 || imm < -2147483648L || imm > 2147483647L)
+    return 0;
+  for (int j = next_line(lines, n, i); j < n; j = next_line(lines, n, j)) {
+    Line *m = &lines[j];
+    if (ends_run(m))
+      return 0;
+    if (!mentions_line(m, r))
+      continue;
+    int alu = 0;
+    for (int k = 0; k < (int)(sizeof(ops) / sizeof(ops[0])); k++)
+      alu |= is_op(m, ops[k]);
+    if (!alu || m->num_args != 2 || reg_of(m->args[0]) != r ||
+        mentions(m->args[1], r) || !dead_after(lines, n, j, r))
+      return 0;
+    m->args[0] = l->args[0];
+    l->dead = 1;
+    return 1;
+  }
+  return 0;
+}
+
+// a load right after a store to the same place takes the stored register,
+// and disappears when it loads into that register.
+static int store_load(Line *lines, int n, int i) {
+  static char *pairs[][2] = {
+      {"movl", "movslq"}, {"movb", "movsbq"}, {"movq", "movq"}};
+  Line *l = &lines[i];
+  int j = next_line(lines, n, i);
+  if (l->op == NULL || l->num_args != 2 || l->args[0][0] != '%' ||
+      strchr(l->args[1], '(') == NULL || j == n)
+    return 0;
+  Line *m = &lines[j];
+  for (int k = 0; k < (int)(sizeof(pairs) / sizeof(pairs[0])); k++) {
+    if (!is_op(l, pairs[k][0]) || !is_op(m, pairs[k][1]) ||
+        m->num_args != 2 || strcmp(l->args[1], m->args[0]) != 0 ||
+        m->args[1][0] != '%')
+      continue;
+    if (strcmp(l->args[0], m->args[1]) == 0)
+      m->dead = 1;
+    else
+      m->args[0] = l->args[0];
+    return 1;
+  }
+  return 0;
+}
+
+// a jump to a label which follows it.
+static int jump_next(Line *lines, int n, int i) {
+  Line *l = &lines[i];
+  if (l->op == NULL || l->op[0] != 'j' || l->num_args != 1)
+    return 0;
+  int len = strlen(l->args[0]);
+  for (int j = next_line(lines, n, i); j < n; j = next_line(lines, n, j)) {
+    char *text = lines[j].text;
+    if (lines[j].op != NULL || text[0] == '\0' ||
+        text[strlen(text) - 1] != ':')
+      return 0;
+    if (strncmp(text, l->args[0], len) == 0 && text[len] == ':' &&
+        text[len + 1] == '\0') {
+      l->dead = 1;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+static struct {
+  char *name;
+  int (*apply)(Line *, int, int);
+} rules[] = {
+    {"push-pop", push_pop},
+    {"immediate", fold_immediate},
+    {"store-load", store_load},
+    {"jump-next", jump_next},
+};
+
+_Static_assert(sizeof(rules) / sizeof(rules[0]) == NUM_PEEPHOLE_RULES,
+               "NUM_PEEPHOLE_RULES is the size of the rule table");
+
+// splits an instruction into its mnemonic and operands, in place.
+static void parse_line(Line *l, char *s) {
+  memset(l, 0, sizeof(Line));
+  l->text = s;
+  if (*s++ != '\t')
+    return;
+  l->op = s;
+  s += strcspn(s, " ");
+  if (*s == '\0')
+    return;
+  *s++ = '\0';
+  l->args[l->num_args++] = s;
+  for (int depth = 0; *s != '\0'; s++) {
+    if (*s == '(')
+      depth++;
+    else if (*s == ')')
+      depth--;
+    else if (*s == ',' && depth == 0 && l->num_args < 2) {
+      *s = '\0';
+      l->args[l->num_args++] = s + 1 + strspn(s + 1, " ");
+    }
+  }
+}
+
+// rewrites the assembly of a function in buf into out.
+void peephole(char *buf, int len, Output *out) {
+  char *text = arena_strndup(&table_arena, buf, len);
+  int n = 0;
+  for (int i = 0; i < len; i++)
+    n += text[i] == '\n';
+  Line *lines = arena_alloc(&table_arena, (n + 1) * sizeof(Line));
+  n = 0;
+  for (char *s = text; *s != '\0';) {
+    char *end = s + strcspn(s, "\n");
+    int last = *end == '\0';
+    *end = '\0';
+    parse_line(&lines[n++], s);
+    s = last ? end : end + 1;
+  }
+
+  for (int changed = 1; changed;) {
+    changed = 0;
+    for (int i = 0; i < n; i++)
+      for (int r = 0; r < NUM_PEEPHOLE_RULES && !lines[i].dead; r++)
+        if (rules[r].apply(lines, n, i)) {
+          atomic_fetch_add(&compilation->peephole_hits[r], 1);
+          changed = 1;
+        }
+  }
+
+  for (int i = 0; i < n; i++) {
+    Line *l = &lines[i];
+    if (l->dead)
+      continue;
+    if (l->op == NULL) {
+      output_write(out, l->text, strlen(l->text));
+    } else {
+      output_write(out, "\t", 1);
+      output_write(out, l->op, strlen(l->op));
+      for (int k = 0; k < l->num_args; k++) {
+        output_write(out, k == 0 ? " " : ", ", k == 0 ? 1 : 2);
+        output_write(out, l->args[k], strlen(l->args[k]));
+      }
+    }
+    output_write(out, "\n", 1);
+  }
+  arena_free(&table_arena, lines, (n + 1) * sizeof(Line));
+  arena_free(&table_arena, text, len + 1);
+}
+
+// prints the hits of each rule in the current compilation.
+void peephole_report(FILE *fp) {
+  fprintf(fp, "%-18s %8s\n", "peephole rule", "hits");
+  for (int r = 0; r < NUM_PEEPHOLE_RULES; r++)
+    fprintf(fp, "%-18s %8d\n", rules[r].name,
+            atomic_load(&compilation->peephole_hits[r]));
+}
@@ -0,0 +1,104 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include "uoocc.h"
+
+// a range of job indices, lo in the low half and hi in the high half, so
+// that both ends move with a single compare-and-swap.
+typedef _Atomic unsigned long Range;
+
+#define RANGE(lo, hi) ((unsigned long)(hi) << 32 | (unsigned int)(lo))
+#define RANGE_LO(r) (int)((r)&0xffffffff)
+#define RANGE_HI(r) (int)((r) >> 32)
+
+typedef struct {
+  void (*fn)(int, void *);
+  void *arg;
+  int num_workers;
+  struct _Worker *workers;
+  Compilation *compilation;  // of the calling thread
+} Pool;
+
+typedef struct _Worker {
+  Pool *pool;
+  int id;
+  Range range;  // jobs not claimed yet
+  Arena saved[NUM_THREAD_ARENAS];  // what the thread allocated
+} Worker;
+
+// the owner takes jobs from the front of its range.
+static int take_job(Worker *w) {
+  unsigned long r = atomic_load(&w->range);
+  while (RANGE_LO(r) < RANGE_HI(r))
+    if (atomic_compare_exchange_weak(&w->range, &r,
+                                     RANGE(RANGE_LO(r) + 1, RANGE_HI(r))))
+      return RANGE_LO(r);
+  return -1;
+}
+
+// a thief takes the back half of the victim's range, runs its first job
+// and keeps the rest as its own range.
+static int steal_jobs(Worker *w, Worker *victim) {
+  unsigned long r = atomic_load(&victim->range);
+  while (RANGE_LO(r) < RANGE_HI(r)) {
+    int mid = RANGE_HI(r) - (RANGE_HI(r) - RANGE_LO(r) + 1) / 2;
+    if (atomic_compare_exchange_weak(&victim->range, &r,
+                                     RANGE(RANGE_LO(r), mid))) {
+      atomic_store(&w->range, RANGE(mid + 1, RANGE_HI(r)));
+      return mid;
+    }
+  }
+  return -1;
+}
+
+static void run_jobs(Worker *w) {
+  Pool *pool = w->pool;
+  compilation = pool->compilation;
+  for (;;) {
+    int i = take_job(w);
+    for (int k = 1; i < 0 && k < pool->num_workers; k++)
+      i = steal_jobs(w, &pool->workers[(w->id + k) % pool->num_workers]);
+    if (i < 0)
+      return;  // nothing is left anywhere
+    pool->fn(i, pool->arg);
+  }
+}
+
+static void *worker(void *arg) {
+  Worker *w = arg;
+  run_jobs(w);
+  arena_save_thread(w->saved);
+  return NULL;
+}
+
+// calls fn(i, arg) for 0 <= i < n on up to jobs threads, the calling thread
+// included, and returns when all calls have finished. Every thread starts
+// with an equal share of the indices and steals from the others when it
+// runs out. Memory the workers allocated from the arenas is handed over to
+// the calling thread.
+void parallel_for(int n, int jobs, void (*fn)(int, void *), void *arg) {
+  if (jobs > n)
+    jobs = n;
+  if (jobs < 1)
+    jobs = 1;
+
+  Worker workers[jobs];
+  Pool pool = {fn, arg, jobs, workers, compilation};
+  for (int i = 0; i < jobs; i++) {
+    workers[i].pool = &pool;
+    workers[i].id = i;
+    atomic_init(&workers[i].range,
+                RANGE((long)n * i / jobs, (long)n * (i + 1) / jobs));
+  }
+
+  // workers[0] is the calling thread
+  pthread_t threads[jobs];
+  int started = 1;
+  for (; started < jobs; started++)
+    if (pthread_create(&threads[started], NULL, worker, &workers[started]))
+      break;  // the others steal the jobs of the missing threads
+  run_jobs(&workers[0]);
+  for (int i = 1; i < started; i++) {
+    pthread_join(threads[i], NULL);
+    arena_adopt_thread(workers[i].saved);
+  }
+}
@@ -0,0 +1,1408 @@
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include "uoocc.h"
+
+enum {
+  PP_IDENT,
+  PP_NUMBER,
+  PP_CHAR,
+  PP_STRING,
+  PP_HEADER_NAME,  // <stdio.h> in #include
+  PP_PUNCT,
+  PP_NEWLINE,
+  PP_EOF,
+};
+
+typedef struct _HideSet {
+  char *name;
+  struct _HideSet *next;
+} HideSet;
+
+// preprocessing token. The tokens of a file are linked in order and shared
+// by every inclusion of the file, so they are never modified.
+typedef struct _PPToken {
+  int kind;
+  int len;
+  char *text;  // interned for identifiers
+  int line;
+  int bol;    // first token of its line
+  int space;  // number of white space characters before the token
+  int param;  // 1-origin parameter index in a macro body, otherwise 0
+  int expanded;  // comes from a macro expansion
+  int cached;    // belongs to the header cache
+  HideSet *hideset;
+  struct _PPToken *next;
+} PPToken;
+
+// tokenized header, shared by every translation unit of the process.
+typedef struct {
+  char *path;
+  PPToken *tokens;
+  char *guard;  // the macro of the include guard, or NULL
+  long mtime;
+  long size;
+  long ino;  // relative paths of server clients may name other files
+} Header;
+
+typedef struct {
+  char *name;
+  int is_function;
+  int is_variadic;
+  Vector *params;  // interned names, __VA_ARGS__ for "..."
+  Vector *body;    // PPToken *
+  int builtin;
+} Macro;
+
+enum {
+  BUILTIN_NONE,
+  BUILTIN_FILE,
+  BUILTIN_LINE,
+};
+
+typedef struct _Frame {
+  PPToken *tok;              // the next token of a cached header
+  struct _PPLexer *lexer;    // lexes the file on demand otherwise
+  char *path;
+  int cond_depth;  // number of open conditionals when the file was entered
+  struct _Frame *next;
+} Frame;
+
+// tokens come from pending first (the last one is the next token), then
+// from the innermost file.
+typedef struct {
+  Vector *pending;
+  Frame *frame;
+} Reader;
+
+typedef struct {
+  int active;  // the current group is processed
+  int taken;   // some group of the conditional has been processed
+  int seen_else;
+  int line;  // of the opening directive
+} Cond;
+
+#define PP_MAX_INCLUDE_DEPTH 200
+
+static char *system_include_paths[] = {"/usr/local/include", "/usr/include"};
+
+#define NUM_SYSTEM_INCLUDE_PATHS \
+  (int)(sizeof(system_include_paths) / sizeof(system_include_paths[0]))
+
+static char *predefined =
+    "#define __STDC__ 1\n"
+    "#define __STDC_HOSTED__ 1\n"
+    "#define __x86_64__ 1\n"
+    "#define __uoocc__ 1\n";
+
+// longest first, every other punctuator is a single character
+static char *punctuators[] = {
+    "...", "<<=", ">>=", "->", "++", "--", "<<", ">>", "<=", ">=", "==", "!=",
+    "&&",  "||",  "*=",  "/=", "%=", "+=", "-=", "&=", "^=", "|=", "##", NULL,
+};
+
+static char *single_punctuators = "!\"#%&'()*+,-./:;<=>?[\\]^{|}~";
+
+// options of the command line, kept for every translation unit
+static char **include_paths;
+static int num_include_paths;
+static char *command_line_macros;
+
+// header cache indexed by the intern id of the path
+static Header **headers;
+static int headers_capacity;
+
+// guards the header cache and header_arena
+static pthread_mutex_t header_lock = PTHREAD_MUTEX_INITIALIZER;
+static Source header_source;  // being tokenized under header_lock
+
+// state of the translation unit being preprocessed by this thread
+static _Thread_local Map *macros;
+static _Thread_local Map *once_table;  // headers with #pragma once
+static _Thread_local Vector *conds;
+static _Thread_local Reader main_reader;
+static _Thread_local int include_depth;
+// a macro has been expanded since the last output token
+static _Thread_local int expanded_since_output;
+static _Thread_local PPToken *eof_token;
+static _Thread_local Output *pp_out;
+static _Thread_local PPToken *last_output;  // on the current output line
+
+static void pp_error(char *path, int line, char *msg) {
+  fprintf(stderr, "%s:%d: Error: %s.\n", path, line, msg);
+  abort_compilation();
+}
+
+static void pp_error_at(PPToken *tok, char *msg) {
+  Frame *f = main_reader.frame;
+  pp_error(f != NULL ? f->path : "<command line>", tok->line, msg);
+}
+
+static int equals(PPToken *tok, char *s) {
+  return tok->kind != PP_IDENT && tok->kind != PP_EOF &&
+         strncmp(tok->text, s, tok->len) == 0 && s[tok->len] == '\0';
+}
+
+static int is_ident_char(int c) {
+  return ('a' <= c && c <= 'z') || ('A' <= c && c <= 'Z') ||
+         ('0' <= c && c <= '9') || c == '_';
+}
+
+static PPToken *new_token(Arena *arena, int kind, char *text, int len) {
+  PPToken *tok = arena_alloc_tagged(arena, MEM_TOKEN, sizeof(PPToken));
+  tok->kind = kind;
+  tok->text = text;
+  tok->len = len;
+  tok->cached = arena == &header_arena;
+  return tok;
+}
+
+static PPToken *copy_token(PPToken *tok) {
+  PPToken *t = arena_alloc_tagged(&token_arena, MEM_TOKEN, sizeof(PPToken));
+  *t = *tok;
+  t->bol = 0;
+  t->expanded = 1;
+  t->next = NULL;
+  return t;
+}
+
+// returns the shared spelling of the longest punctuator at p, or NULL for
+// an unknown character.
+static char *punct_spelling(char *p, char *end, int *len) {
+  if (end - p >= 2 && strchr("=.<>-+&|#", p[1]) != NULL) {
+    for (int i = 0; punctuators[i] != NULL; i++) {
+      *len = strlen(punctuators[i]);
+      if (end - p >= *len && strncmp(p, punctuators[i], *len) == 0)
+        return punctuators[i];
+    }
+  }
+  *len = 1;
+  if (*p != '\0' && strchr(single_punctuators, *p) != NULL)
+    return strchr(single_punctuators, *p);
+  return NULL;
+}
+
+// splits a source into preprocessing tokens one at a time. Comments become
+// white space and the lines they span are appended after the next newline,
+// so that the output keeps the line numbers of the source.
+typedef struct _PPLexer {
+  char *p;
+  char *end;
+  char *path;
+  Arena *arena;
+  int copy;  // copy spellings so that the source can be released
+  int line;
+  int bol;
+  int space;
+  int hidden_lines;   // lines joined by comments and backslashes
+  int queued_lines;   // hidden lines to be returned as newlines
+  int directive;      // 1 after '#', 2 after "#include", 3 after that
+} PPLexer;
+
+static void init_pp_lexer(PPLexer *lx, char *path, char *p, long len,
+                          Arena *arena) {
+  memset(lx, 0, sizeof(PPLexer));
+  lx->p = p;
+  lx->end = p + len;
+  lx->path = path;
+  lx->arena = arena;
+  lx->copy = arena == &header_arena;
+  lx->line = lx->bol = 1;
+}
+
+static PPToken *lex_pp_token(PPLexer *lx) {
+  char *p = lx->p, *end = lx->end;
+  PPToken *tok;
+
+  if (lx->queued_lines > 0) {
+    lx->queued_lines--;
+    tok = new_token(lx->arena, PP_NEWLINE, "\n", 1);
+    tok->line = lx->line;
+    return tok;
+  }
+
+  for (;;) {
+    if (p >= end) {
+      // every file ends with a newline so that directives are terminated
+      if (!lx->bol || lx->hidden_lines > 0) {
+        lx->queued_lines = lx->hidden_lines - lx->bol;
+        lx->bol = 1;
+        lx->hidden_lines = 0;
+        tok = new_token(lx->arena, PP_NEWLINE, "\n", 1);
+      } else {
+        tok = new_token(lx->arena, PP_EOF, "", 0);
+      }
+      tok->line = lx->line;
+      lx->p = p;
+      return tok;
+    }
+    if (*p == '\n') {
+      tok = new_token(lx->arena, PP_NEWLINE, "\n", 1);
+      tok->line = lx->line++;
+      lx->queued_lines = lx->hidden_lines;
+      lx->hidden_lines = lx->space = lx->directive = 0;
+      lx->bol = 1;
+      lx->p = p + 1;
+      return tok;
+    }
+    if (*p == '\\' && p + 1 < end && p[1] == '\n') {
+      p += 2;
+      lx->line++;
+      lx->hidden_lines++;
+    } else if (*p == ' ' || *p == '\t' || *p == '\v' || *p == '\f' ||
+               *p == '\r') {
+      p++;
+      lx->space++;
+    } else if (p + 1 < end && p[0] == '/' && p[1] == '/') {
+      while (p < end && *p != '\n')
+        p++;
+      lx->space++;
+    } else if (p + 1 < end && p[0] == '/' && p[1] == '*') {
+      int start_line = lx->line;
+      for (p += 2; p + 1 < end && !(p[0] == '*' && p[1] == '/'); p++) {
+        if (*p == '\n') {
+          lx->line++;
+          lx->hidden_lines++;
+        }
+      }
+      if (p + 1 >= end)
+        pp_error(lx->path, start_line, "unterminated comment");
+      p += 2;
+      lx->space++;
+    } else {
+      break;
+    }
+  }
+
+  char *start = p, *text = NULL;
+  int kind;
+  int c = (unsigned char)*p;
+  if (lx->directive == 2 && c == '<' && memchr(p, '>', end - p) != NULL) {
+    while (p < end && *p != '>' && *p != '\n')
+      p++;
+    if (p < end && *p == '>') {
+      kind = PP_HEADER_NAME;
+      p++;
+    } else {
+      kind = PP_PUNCT;
+      p = start + 1;
+      text = "<";
+    }
+  } else if (is_ident_char(c) && !('0' <= c && c <= '9')) {
+    while (p < end && is_ident_char((unsigned char)*p))
+      p++;
+    kind = PP_IDENT;
+    text = intern_string_n(start, p - start);
+  } else if (('0' <= c && c <= '9') ||
+             (c == '.' && p + 1 < end && '0' <= p[1] && p[1] <= '9')) {
+    for (p++; p < end; p++) {
+      if ((*p == '+' || *p == '-') && strchr("eEpP", p[-1]) != NULL)
+        continue;
+      if (!is_ident_char((unsigned char)*p) && *p != '.')
+        break;
+    }
+    kind = PP_NUMBER;
+  } else if (c == '"' || c == '\'') {
+    for (p++; p < end && *p != c && *p != '\n'; p++)
+      if (*p == '\\' && p + 1 < end)
+        p++;
+    if (p < end && *p == c)
+      p++;
+    kind = c == '"' ? PP_STRING : PP_CHAR;
+  } else {
+    int len;
+    kind = PP_PUNCT;
+    text = punct_spelling(p, end, &len);
+    p += len;
+  }
+
+  if (text == NULL)
+    text = lx->copy ? arena_strndup(lx->arena, start, p - start) : start;
+  tok = new_token(lx->arena, kind, text, p - start);
+  tok->line = lx->line;
+  tok->bol = lx->bol;
+  tok->space = lx->space;
+
+  if (lx->bol && equals(tok, "#"))
+    lx->directive = 1;
+  else if (lx->directive == 1 && kind == PP_IDENT &&
+           strcmp(text, "include") == 0)
+    lx->directive = 2;
+  else
+    lx->directive = 3;
+  lx->bol = lx->space = 0;
+  lx->p = p;
+  return tok;
+}
+
+// tokenizes the whole source into a linked list ending with PP_EOF.
+static PPToken *tokenize(Arena *arena, char *path, char *p, long len) {
+  PPLexer lx;
+  init_pp_lexer(&lx, path, p, len, arena);
+  PPToken head, *cur = &head;
+  do {
+    cur = cur->next = lex_pp_token(&lx);
+  } while (cur->kind != PP_EOF);
+  return head.next;
+}
+
+static int hideset_contains(HideSet *hs, char *name) {
+  for (; hs != NULL; hs = hs->next)
+    if (hs->name == name)
+      return 1;
+  return 0;
+}
+
+static HideSet *hideset_add(HideSet *hs, char *name) {
+  if (hideset_contains(hs, name))
+    return hs;
+  HideSet *h = arena_alloc(&token_arena, sizeof(HideSet));
+  h->name = name;
+  h->next = hs;
+  return h;
+}
+
+static HideSet *hideset_intersection(HideSet *a, HideSet *b) {
+  HideSet *hs = NULL;
+  for (; a != NULL; a = a->next)
+    if (hideset_contains(b, a->name))
+      hs = hideset_add(hs, a->name);
+  return hs;
+}
+
+static HideSet *hideset_union(HideSet *a, HideSet *b) {
+  for (; a != NULL; a = a->next)
+    b = hideset_add(b, a->name);
+  return b;
+}
+
+static Macro *find_macro(char *name) {
+  MapEntry *e = map_get(macros, name);
+  return e == NULL ? NULL : e->val;
+}
+
+static void set_macro(char *name, Macro *m) {
+  MapEntry *e = map_get(macros, name);
+  if (e != NULL)
+    e->val = m;
+  else if (m != NULL)
+    map_put(macros, allocate_MapEntry(name, m));
+}
+
+static void enter_file(Reader *r, PPToken *tokens, PPLexer *lexer,
+                       char *path) {
+  Frame *f = arena_alloc(&token_arena, sizeof(Frame));
+  f->tok = tokens;
+  f->lexer = lexer;
+  f->path = path;
+  f->cond_depth = conds->size;
+  f->next = r->frame;
+  r->frame = f;
+  include_depth++;
+}
+
+static void leave_file(Reader *r) {
+  Frame *f = r->frame;
+  if (conds->size > f->cond_depth)
+    pp_error(f->path, ((Cond *)conds->data[conds->size - 1])->line,
+             "unterminated conditional directive");
+  r->frame = f->next;
+  include_depth--;
+}
+
+static PPToken *read_token(Reader *r) {
+  if (r->pending->size > 0)
+    return r->pending->data[--r->pending->size];
+  while (r->frame != NULL) {
+    Frame *f = r->frame;
+    PPToken *tok = f->lexer != NULL ? lex_pp_token(f->lexer) : f->tok;
+    if (tok->kind != PP_EOF) {
+      if (f->lexer == NULL)
+        f->tok = tok->next;
+      return tok;
+    }
+    leave_file(r);
+  }
+  return eof_token;
+}
+
+static void unread_token(Reader *r, PPToken *tok) {
+  vector_push_back(r->pending, tok);
+}
+
+static void unread_tokens(Reader *r, Vector *tokens) {
+  for (int i = tokens->size - 1; i >= 0; i--)
+    unread_token(r, tokens->data[i]);
+}
+
+// the rest of the directive, the newline is consumed.
+static Vector *read_line(Reader *r) {
+  Vector *v = vector_new();
+  for (PPToken *tok = read_token(r);
+       tok->kind != PP_NEWLINE && tok->kind != PP_EOF; tok = read_token(r))
+    vector_push_back(v, tok);
+  return v;
+}
+
+static void skip_line(Reader *r) {
+  PPToken *tok;
+  do {
+    tok = read_token(r);
+  } while (tok->kind != PP_NEWLINE && tok->kind != PP_EOF);
+}
+
+static int expand_macro(Reader *, PPToken *);
+
+// fully macro-expands tokens on their own, as for arguments and #if.
+static Vector *expand_tokens(Vector *tokens) {
+  Reader r = {vector_new(), NULL};
+  unread_tokens(&r, tokens);
+  Vector *v = vector_new();
+  for (;;) {
+    PPToken *tok = read_token(&r);
+    if (tok->kind == PP_EOF)
+      return v;
+    if (tok->kind != PP_IDENT || !expand_macro(&r, tok))
+      vector_push_back(v, tok);
+  }
+}
+
+static PPToken *stringize(Vector *arg, PPToken *hash) {
+  Output out;
+  output_init(&out, -1);
+  output_write(&out, "\"", 1);
+  for (int i = 0; i < arg->size; i++) {
+    PPToken *tok = arg->data[i];
+    if (i > 0 && tok->space > 0)
+      output_write(&out, " ", 1);
+    for (int j = 0; j < tok->len; j++) {
+      char c = tok->text[j];
+      if ((tok->kind == PP_STRING || tok->kind == PP_CHAR) &&
+          (c == '"' || c == '\\'))
+        output_write(&out, "\\", 1);
+      output_write(&out, &c, 1);
+    }
+  }
+  output_write(&out, "\"", 1);
+
+  PPToken *tok = copy_token(hash);
+  tok->kind = PP_STRING;
+  tok->text = arena_strndup(&token_arena, out.buf, out.len);
+  tok->len = out.len;
+  output_release(&out);
+  return tok;
+}
+
+static PPToken *paste(PPToken *lhs, PPToken *rhs) {
+  int len = lhs->len + rhs->len;
+  char *buf = arena_alloc(&token_arena, len + 1);
+  memcpy(buf, lhs->text, lhs->len);
+  memcpy(buf + lhs->len, rhs->text, rhs->len);
+
+  PPToken *tok = tokenize(&token_arena, "<paste>", buf, len);
+  if (tok->kind == PP_NEWLINE || tok->next->kind != PP_NEWLINE)
+    pp_error_at(lhs, allocate_concat_3string("pasting \"", buf,
+                                             "\" does not give a valid "
+                                             "preprocessing token"));
+  tok->line = lhs->line;
+  tok->bol = 0;
+  tok->expanded = 1;
+  tok->space = lhs->space;
+  tok->hideset = lhs->hideset;
+  tok->next = NULL;
+  return tok;
+}
+
+static void append_tokens(Vector *v, Vector *tokens, int space) {
+  for (int i = 0; i < tokens->size; i++) {
+    PPToken *tok = copy_token(tokens->data[i]);
+    if (i == 0)
+      tok->space = space;
+    vector_push_back(v, tok);
+  }
+}
+
+// replaces the parameters in the body of m, handling '#' and '##'.
+static Vector *substitute(Macro *m, Vector *args) {
+  Vector *v = vector_new();
+  Vector *body = m->body;
+  int lhs_empty = 0;  // the left operand of a following '##' is empty
+
+  for (int i = 0; i < body->size; i++) {
+    PPToken *tok = body->data[i];
+    PPToken *next = i + 1 < body->size ? body->data[i + 1] : NULL;
+
+    if (m->is_function && equals(tok, "#")) {
+      vector_push_back(v, stringize(args->data[next->param - 1], tok));
+      i++;
+      lhs_empty = 0;
+      continue;
+    }
+
+    if (equals(tok, "##")) {
+      Vector *rhs = vector_new();
+      if (next->param == 0)
+        vector_push_back(rhs, next);
+      else
+        rhs = args->data[next->param - 1];
+      i++;
+
+      // GNU extension: ", ## __VA_ARGS__" drops the comma for no arguments
+      if (m->is_variadic && next->param == m->params->size && !lhs_empty &&
+          v->size > 0 && equals(v->data[v->size - 1], ",")) {
+        if (rhs->size == 0)
+          v->size--;
+        else
+          append_tokens(v, rhs, next->space);
+        continue;
+      }
+      if (rhs->size == 0)
+        continue;
+      if (lhs_empty || v->size == 0) {
+        append_tokens(v, rhs, next->space);
+      } else {
+        PPToken *lhs = v->data[--v->size];
+        vector_push_back(v, paste(lhs, rhs->data[0]));
+        for (int j = 1; j < rhs->size; j++)
+          vector_push_back(v, copy_token(rhs->data[j]));
+      }
+      lhs_empty = 0;
+      continue;
+    }
+
+    if (tok->param > 0) {
+      Vector *arg = args->data[tok->param - 1];
+      if (next == NULL || !equals(next, "##"))
+        arg = expand_tokens(arg);
+      append_tokens(v, arg, tok->space);
+      lhs_empty = arg->size == 0;
+      continue;
+    }
+
+    vector_push_back(v, copy_token(tok));
+    lhs_empty = 0;
+  }
+  return v;
+}
+
+// reads the arguments after '(' of a function-like macro invocation up to
+// the closing ')'. Newlines between them are collected into lines.
+static Vector *read_args(Reader *r, Macro *m, PPToken *name, Vector *lines,
+                         PPToken **rpar) {
+  Vector *args = vector_new();
+  Vector *arg = vector_new();
+  int depth = 0;
+  for (;;) {
+    PPToken *tok = read_token(r);
+    if (tok->kind == PP_EOF)
+      pp_error_at(name, allocate_concat_3string(
+                            "unterminated argument list invoking macro \"",
+                            name->text, "\""));
+    if (tok->kind == PP_NEWLINE) {
+      vector_push_back(lines, tok);
+      continue;
+    }
+    if (depth == 0 && equals(tok, ")")) {
+      *rpar = tok;
+      break;
+    }
+    if (depth == 0 && equals(tok, ",") &&
+        !(m->is_variadic && args->size == m->params->size - 1)) {
+      vector_push_back(args, arg);
+      arg = vector_new();
+      continue;
+    }
+    if (equals(tok, "("))
+      depth++;
+    else if (equals(tok, ")"))
+      depth--;
+    vector_push_back(arg, tok);
+  }
+  vector_push_back(args, arg);
+
+  if (m->params->size == 0 && args->size == 1 && arg->size == 0)
+    args->size = 0;
+  if (m->is_variadic && args->size == m->params->size - 1)
+    vector_push_back(args, vector_new());
+  if (args->size != m->params->size)
+    pp_error_at(name, allocate_concat_3string("wrong number of arguments to "
+                                              "macro \"",
+                                              name->text, "\""));
+  return args;
+}
+
+static PPToken *builtin_token(Macro *m, PPToken *name) {
+  Output out;
+  output_init(&out, -1);
+  PPToken *tok = copy_token(name);
+  if (m->builtin == BUILTIN_LINE) {
+    output_int(&out, name->line);
+    tok->kind = PP_NUMBER;
+  } else {
+    Frame *f = main_reader.frame;
+    char *path = f != NULL ? f->path : "<command line>";
+    output_write(&out, "\"", 1);
+    output_write(&out, path, strlen(path));
+    output_write(&out, "\"", 1);
+    tok->kind = PP_STRING;
+  }
+  tok->text = arena_strndup(&token_arena, out.buf, out.len);
+  tok->len = out.len;
+  output_release(&out);
+  return tok;
+}
+
+// pushes the expansion of the macro named by tok back to the reader so that
+// it is rescanned. Returns 0 when tok is not a macro invocation.
+static int expand_macro(Reader *r, PPToken *tok) {
+  Macro *m = find_macro(tok->text);
+  if (m == NULL || hideset_contains(tok->hideset, m->name))
+    return 0;
+  if (m->builtin != BUILTIN_NONE) {
+    unread_token(r, builtin_token(m, tok));
+    return 1;
+  }
+
+  Vector *lines = vector_new();
+  Vector *args = NULL;
+  HideSet *hs = tok->hideset;
+  if (m->is_function) {
+    // a function-like macro name without '(' is an ordinary identifier
+    PPToken *lpar = read_token(r);
+    while (lpar->kind == PP_NEWLINE) {
+      vector_push_back(lines, lpar);
+      lpar = read_token(r);
+    }
+    if (!equals(lpar, "(")) {
+      unread_token(r, lpar);
+      unread_tokens(r, lines);
+      return 0;
+    }
+    PPToken *rpar;
+    args = read_args(r, m, tok, lines, &rpar);
+    hs = hideset_intersection(hs, rpar->hideset);
+  }
+
+  Vector *v = substitute(m, args);
+  hs = hideset_add(hs, m->name);
+  for (int i = 0; i < v->size; i++) {
+    PPToken *t = v->data[i];
+    t->hideset = hideset_union(t->hideset, hs);
+    t->line = tok->line;
+    if (i == 0)
+      t->space = tok->space;
+  }
+  // swallowed newlines follow the expansion to keep the line numbers
+  unread_tokens(r, lines);
+  unread_tokens(r, v);
+  expanded_since_output = 1;
+  return 1;
+}
+
+static void define_macro(Reader *r) {
+  PPToken *name = read_token(r);
+  if (name->kind != PP_IDENT)
+    pp_error_at(name, "macro names must be identifiers");
+
+  Macro *m = arena_alloc(&table_arena, sizeof(Macro));
+  m->name = name->text;
+  m->params = vector_new();
+  m->body = vector_new();
+
+  PPToken *tok = read_token(r);
+  if (equals(tok, "(") && tok->space == 0) {
+    m->is_function = 1;
+    tok = read_token(r);
+    while (!equals(tok, ")")) {
+      if (equals(tok, "...")) {
+        m->is_variadic = 1;
+        vector_push_back(m->params, intern_string("__VA_ARGS__"));
+        tok = read_token(r);
+      } else if (tok->kind == PP_IDENT) {
+        vector_push_back(m->params, tok->text);
+        tok = read_token(r);
+        if (equals(tok, "...")) {
+          m->is_variadic = 1;
+          tok = read_token(r);
+        }
+      } else {
+        pp_error_at(tok, "expected parameter name");
+      }
+      if (equals(tok, ",") && !m->is_variadic)
+        tok = read_token(r);
+      else if (!equals(tok, ")"))
+        pp_error_at(tok, "expected ',' or ')' in macro parameter list");
+    }
+    tok = read_token(r);
+  }
+
+  for (; tok->kind != PP_NEWLINE && tok->kind != PP_EOF; tok = read_token(r)) {
+    PPToken *t = copy_token(tok);
+    for (int i = 0; t->kind == PP_IDENT && i < m->params->size; i++)
+      if (m->params->data[i] == t->text)
+        t->param = i + 1;
+    vector_push_back(m->body, t);
+  }
+
+  Vector *body = m->body;
+  if (body->size > 0 && (equals(body->data[0], "##") ||
+                         equals(body->data[body->size - 1], "##")))
+    pp_error_at(name, "'##' cannot appear at either end of a macro expansion");
+  for (int i = 0; i < body->size; i++) {
+    PPToken *t = body->data[i];
+    PPToken *next = i + 1 < body->size ? body->data[i + 1] : NULL;
+    if (m->is_function && equals(t, "#") && (next == NULL || next->param == 0))
+      pp_error_at(t, "'#' is not followed by a macro parameter");
+  }
+  set_macro(m->name, m);
+}
+
+// #if expression
+static _Thread_local Vector *expr_tokens;
+static _Thread_local int expr_pos;
+// above 0 in an operand whose value does not matter, as in 0 && 1 / 0
+static _Thread_local int expr_unevaluated;
+
+static PPToken *expr_peek(void) {
+  return expr_pos < expr_tokens->size ? expr_tokens->data[expr_pos]
+                                      : eof_token;
+}
+
+static int expr_consume(char *op) {
+  if (!equals(expr_peek(), op))
+    return 0;
+  expr_pos++;
+  return 1;
+}
+
+static void expr_expect(char *op) {
+  if (!expr_consume(op))
+    pp_error_at(expr_peek(), allocate_concat_3string("'", op,
+                                                     "' was expected in "
+                                                     "preprocessor "
+                                                     "expression"));
+}
+
+static long eval_char(PPToken *tok) {
+  char *p = tok->text + 1;
+  if (*p != '\\')
+    return *p;
+  switch (p[1]) {
+    case 'n':
+      return '\n';
+    case 't':
+      return '\t';
+    case 'r':
+      return '\r';
+    case '0':
+      return '\0';
+    default:
+      return p[1];
+  }
+}
+
+static long eval_conditional(void);
+
+static long eval_primary(void) {
+  PPToken *tok = expr_peek();
+  expr_pos++;
+  if (equals(tok, "(")) {
+    long val = eval_conditional();
+    expr_expect(")");
+    return val;
+  }
+  if (tok->kind == PP_NUMBER)
+    return strtol(arena_strndup(&string_arena, tok->text, tok->len), NULL, 0);
+  if (tok->kind == PP_CHAR)
+    return eval_char(tok);
+  // identifiers which are not macros are 0
+  if (tok->kind == PP_IDENT)
+    return 0;
+  pp_error_at(tok, "invalid token in preprocessor expression");
+  return 0;
+}
+
+static long eval_unary(void) {
+  if (expr_consume("+"))
+    return eval_unary();
+  if (expr_consume("-"))
+    return -eval_unary();
+  if (expr_consume("!"))
+    return !eval_unary();
+  if (expr_consume("~"))
+    return ~eval_unary();
+  return eval_primary();
+}
+
+static long eval_binary(int prec);
+
+// binary operators by precedence, from the loosest
+static char *binary_ops[][5] = {
+    {"||"},          {"&&"},       {"|"},      {"^"},
+    {"&"},           {"==", "!="}, {"<", "<=", ">", ">="},
+    {"<<", ">>"},    {"+", "-"},   {"*", "/", "%"},
+};
+
+#define NUM_BINARY_PRECS (int)(sizeof(binary_ops) / sizeof(binary_ops[0]))
+
+static long apply_binary(PPToken *op, long l, long r) {
+  if ((equals(op, "/") || equals(op, "%")) && r == 0) {
+    if (expr_unevaluated > 0)
+      return 0;
+    pp_error_at(op, "division by zero in preprocessor expression");
+  }
+  switch (op->len == 1 ? op->text[0] : op->text[0] * 256 + op->text[1]) {
+    case '|' * 256 + '|':
+      return l || r;
+    case '&' * 256 + '&':
+      return l && r;
+    case '|':
+      return l | r;
+    case '^':
+      return l ^ r;
+    case '&':
+      return l & r;
+    case '=' * 256 + '=':
+      return l == r;
+    case '!' * 256 + '=':
+      return l != r;
+    case '<':
+      return l < r;
+    case '<' * 256 + '=':
+      return l <= r;
+    case '>':
+      return l > r;
+    case '>' * 256 + '=':
+      return l >= r;
+    case '<' * 256 + '<':
+      return l << r;
+    case '>' * 256 + '>':
+      return l >> r;
+    case '+':
+      return l + r;
+    case '-':
+      return l - r;
+    case '*':
+      return l * r;
+    case '/':
+      return l / r;
+    default:  // '%'
+      return l % r;
+  }
+}
+
+static long eval_binary(int prec) {
+  if (prec == NUM_BINARY_PRECS)
+    return eval_unary();
+  long val = eval_binary(prec + 1);
+  for (;;) {
+    PPToken *op = expr_peek();
+    int i = 0;
+    while (i < 5 && binary_ops[prec][i] != NULL &&
+           !equals(op, binary_ops[prec][i]))
+      i++;
+    if (i == 5 || binary_ops[prec][i] == NULL)
+      return val;
+    expr_pos++;
+    int decided = (equals(op, "&&") && !val) || (equals(op, "||") && val);
+    expr_unevaluated += decided;
+    long r = eval_binary(prec + 1);
+    expr_unevaluated -= decided;
+    val = apply_binary(op, val, r);
+  }
+}
+
+static long eval_conditional(void) {
+  long cond = eval_binary(0);
+  if (!expr_consume("?"))
+    return cond;
+  expr_unevaluated += !cond;
+  long then = eval_conditional();
+  expr_unevaluated -= !cond;
+  expr_expect(":");
+  expr_unevaluated += !!cond;
+  long els = eval_conditional();
+  expr_unevaluated -= !!cond;
+  return cond ? then : els;
+}
+
+static PPToken *number_token(PPToken *base, int val) {
+  PPToken *tok = copy_token(base);
+  tok->kind = PP_NUMBER;
+  tok->text = val ? "1" : "0";
+  tok->len = 1;
+  return tok;
+}
+
+static int eval_if(Reader *r, PPToken *hash) {
+  Vector *line = read_line(r);
+  Vector *v = vector_new();
+  for (int i = 0; i < line->size; i++) {
+    PPToken *tok = line->data[i];
+    if (tok->kind != PP_IDENT || strcmp(tok->text, "defined") != 0) {
+      vector_push_back(v, tok);
+      continue;
+    }
+    int paren = i + 1 < line->size && equals(line->data[i + 1], "(");
+    PPToken *name = vector_at(line, i + 1 + paren);
+    if (name == NULL || name->kind != PP_IDENT)
+      pp_error_at(tok, "macro names must be identifiers");
+    i += 1 + paren;
+    if (paren && (++i >= line->size || !equals(line->data[i], ")")))
+      pp_error_at(tok, "missing ')' after \"defined\"");
+    vector_push_back(v, number_token(tok, find_macro(name->text) != NULL));
+  }
+
+  expr_tokens = expand_tokens(v);
+  expr_pos = 0;
+  expr_unevaluated = 0;
+  eof_token->line = hash->line;  // reported for a truncated expression
+  if (expr_tokens->size == 0)
+    pp_error_at(hash, "#if with no expression");
+  long val = eval_conditional();
+  if (expr_pos != expr_tokens->size)
+    pp_error_at(expr_peek(), "missing binary operator in preprocessor "
+                             "expression");
+  return val != 0;
+}
+
+static int skipping(void) {
+  return conds->size > 0 && !((Cond *)conds->data[conds->size - 1])->active;
+}
+
+static void push_cond(int active, PPToken *hash) {
+  Cond *c = arena_alloc(&table_arena, sizeof(Cond));
+  c->active = active;
+  c->line = hash->line;
+  // a conditional in a skipped group never becomes active
+  c->taken = active || skipping();
+  vector_push_back(conds, c);
+}
+
+static Cond *top_cond(PPToken *tok) {
+  Frame *f = main_reader.frame;
+  if (conds->size <= (f != NULL ? f->cond_depth : 0))
+    pp_error_at(tok, allocate_concat_3string("#", tok->text, " without #if"));
+  return conds->data[conds->size - 1];
+}
+
+static void release_token(PPToken *tok) {
+  if (!tok->cached && tok != eof_token)
+    arena_free_tagged(&token_arena, MEM_TOKEN, tok, sizeof(PPToken));
+}
+
+static void output_newline(void) {
+  if (pp_out != NULL)
+    output_write(pp_out, "\n", 1);
+  if (last_output != NULL)
+    release_token(last_output);
+  last_output = NULL;
+}
+
+static int is_word(PPToken *tok) {
+  return tok->kind == PP_IDENT || tok->kind == PP_NUMBER;
+}
+
+// whether writing tok right after prev would make different tokens.
+static int needs_space(PPToken *prev, PPToken *tok) {
+  if (is_word(prev))
+    return is_word(tok) || (prev->kind == PP_NUMBER && tok->kind == PP_PUNCT &&
+                            strchr(".+-", tok->text[0]) != NULL);
+  if (prev->kind != PP_PUNCT || tok->kind != PP_PUNCT)
+    return 0;
+  char s[3] = {prev->text[prev->len - 1], tok->text[0], '\0'};
+  if (strcmp(s, "//") == 0 || strcmp(s, "/*") == 0 || strcmp(s, "..") == 0)
+    return 1;
+  for (int i = 0; punctuators[i] != NULL; i++)
+    if (strncmp(punctuators[i], s, 2) == 0)
+      return 1;
+  return 0;
+}
+
+static void output_token(PPToken *tok) {
+  static char spaces[] = "                ";
+  if (pp_out == NULL)
+    return;
+  int space = tok->space;
+  // tokens adjacent in the source are never glued by writing them together
+  if (space == 0 && last_output != NULL &&
+      (tok->expanded || last_output->expanded || expanded_since_output) &&
+      needs_space(last_output, tok))
+    space = 1;
+  for (; space > 0; space -= sizeof(spaces) - 1)
+    output_write(pp_out, spaces,
+                 space < (int)sizeof(spaces) - 1 ? space : sizeof(spaces) - 1);
+  output_write(pp_out, tok->text, tok->len);
+  if (last_output != NULL)
+    release_token(last_output);
+  last_output = tok;
+  expanded_since_output = 0;
+}
+
+static int file_exists(char *path, struct stat *st) {
+  return stat(path, st) == 0 && S_ISREG(st->st_mode);
+}
+
+static char *join_path(char *dir, int dir_len, char *name) {
+  if (dir_len == 0)
+    return intern_string(name);
+  char *p = arena_alloc(&string_arena, dir_len + strlen(name) + 2);
+  memcpy(p, dir, dir_len);
+  p[dir_len] = '/';
+  strcpy(p + dir_len + 1, name);
+  return intern_string(p);
+}
+
+// "name" is looked up next to the including file first, then like <name>.
+static char *find_include(char *name, int angled, char *from,
+                          struct stat *st) {
+  if (name[0] == '/')
+    return file_exists(name, st) ? intern_string(name) : NULL;
+
+  if (!angled) {
+    char *slash = strrchr(from, '/');
+    char *path = join_path(from, slash == NULL ? 0 : slash - from, name);
+    if (file_exists(path, st))
+      return path;
+  }
+  for (int i = 0; i < num_include_paths; i++) {
+    char *path = join_path(include_paths[i], strlen(include_paths[i]), name);
+    if (file_exists(path, st))
+      return path;
+  }
+  for (int i = 0; i < NUM_SYSTEM_INCLUDE_PATHS; i++) {
+    char *dir = system_include_paths[i];
+    char *path = join_path(dir, strlen(dir), name);
+    if (file_exists(path, st))
+      return path;
+  }
+  return NULL;
+}
+
+// returns X when every token of the file is inside "#ifndef X ... #endif".
+// Including the file again is a no-op while X is defined.
+static char *find_guard(PPToken *tok) {
+  while (tok->kind == PP_NEWLINE)
+    tok = tok->next;
+  if (!equals(tok, "#") || tok->next->kind != PP_IDENT ||
+      strcmp(tok->next->text, "ifndef") != 0 ||
+      tok->next->next->kind != PP_IDENT)
+    return NULL;
+  char *guard = tok->next->next->text;
+
+  int depth = 0, closed = 0;
+  for (; tok->kind != PP_EOF; tok = tok->next) {
+    if (tok->kind == PP_NEWLINE)
+      continue;
+    if (!tok->bol || !equals(tok, "#") || tok->next->kind != PP_IDENT) {
+      if (depth == 0)
+        return NULL;
+      continue;
+    }
+    char *name = tok->next->text;
+    if (depth == 0 && closed)
+      return NULL;
+    if (strncmp(name, "if", 2) == 0) {
+      depth++;
+    } else if (strcmp(name, "endif") == 0) {
+      closed = --depth == 0;
+    } else if (depth == 1 &&
+               (strcmp(name, "else") == 0 || strcmp(name, "elif") == 0)) {
+      return NULL;
+    }
+    // skip to the end of the directive
+    while (tok->next->kind != PP_NEWLINE)
+      tok = tok->next;
+  }
+  return closed ? guard : NULL;
+}
+
+// tokenizes the header once, it is reloaded only when the file changes.
+// Cached tokens are never modified, so threads share them.
+static Header *load_header(char *path, struct stat *st) {
+  pthread_mutex_lock(&header_lock);
+  int id = intern_id(path);
+  if (id >= headers_capacity) {
+    int capacity = headers_capacity == 0 ? 64 : headers_capacity;
+    while (capacity <= id)
+      capacity *= 2;
+    headers = arena_realloc(&header_arena, headers,
+                            headers_capacity * sizeof(Header *),
+                            capacity * sizeof(Header *));
+    headers_capacity = capacity;
+  }
+
+  Header *h = headers[id];
+  if (h != NULL && h->mtime == st->st_mtime && h->size == st->st_size &&
+      h->ino == st->st_ino) {
+    pthread_mutex_unlock(&header_lock);
+    return h;
+  }
+
+  // an error in the header must not leave the lock held for the next
+  // request of the server
+  jmp_buf env, *outer = error_return;
+  error_return = &env;
+  if (setjmp(env) != 0) {
+    error_return = outer;
+    source_release(&header_source);
+    pthread_mutex_unlock(&header_lock);
+    abort_compilation();
+  }
+
+  FILE *fp = fopen(path, "r");
+  if (fp == NULL)
+    error(allocate_concat_3string("cannot open '", path, "'"));
+  source_read(&header_source, fp);
+  fclose(fp);
+
+  h = arena_alloc(&header_arena, sizeof(Header));
+  h->path = path;
+  h->tokens = tokenize(&header_arena, path, header_source.buf,
+                       header_source.len);
+  h->guard = find_guard(h->tokens);
+  h->mtime = st->st_mtime;
+  h->size = st->st_size;
+  h->ino = st->st_ino;
+  headers[id] = h;
+  source_release(&header_source);
+  error_return = outer;
+  pthread_mutex_unlock(&header_lock);
+  return h;
+}
+
+static void include_file(Reader *r, PPToken *hash) {
+  Vector *line = read_line(r);
+  if (line->size > 0 && ((PPToken *)line->data[0])->kind == PP_IDENT)
+    line = expand_tokens(line);
+
+  PPToken *tok = vector_at(line, 0);
+  char *name = NULL;
+  int angled = 0;
+  if (tok != NULL && tok->kind == PP_STRING && tok->len >= 2) {
+    name = arena_strndup(&string_arena, tok->text + 1, tok->len - 2);
+  } else if (tok != NULL && tok->kind == PP_HEADER_NAME) {
+    name = arena_strndup(&string_arena, tok->text + 1, tok->len - 2);
+    angled = 1;
+  } else if (tok != NULL && equals(tok, "<")) {
+    // <name> built by macro expansion
+    name = "";
+    int i;
+    for (i = 1; i < line->size && !equals(line->data[i], ">"); i++) {
+      PPToken *t = line->data[i];
+      name = allocate_concat_2string(
+          name, arena_strndup(&string_arena, t->text, t->len));
+    }
+    if (i == line->size)
+      name = NULL;
+    angled = 1;
+  }
+  if (name == NULL)
+    pp_error_at(hash, "#include expects \"FILENAME\" or <FILENAME>");
+
+  struct stat st;
+  char *path = find_include(name, angled, r->frame->path, &st);
+  if (path == NULL)
+    pp_error_at(hash, allocate_concat_3string("'", name, "' file not found"));
+  if (map_get(once_table, path) != NULL)
+    return;
+  Header *h = load_header(path, &st);
+  if (h->guard != NULL && find_macro(h->guard) != NULL)
+    return;
+  if (include_depth >= PP_MAX_INCLUDE_DEPTH)
+    pp_error_at(hash, "#include nested too deeply");
+  enter_file(r, h->tokens, NULL, path);
+}
+
+static void directive(Reader *r, PPToken *hash) {
+  PPToken *tok = read_token(r);
+  if (tok->kind == PP_NEWLINE) {  // null directive
+    output_newline();
+    return;
+  }
+  char *name = tok->kind == PP_IDENT ? tok->text : "";
+
+  if (strcmp(name, "if") == 0 || strcmp(name, "ifdef") == 0 ||
+      strcmp(name, "ifndef") == 0) {
+    if (skipping()) {
+      skip_line(r);
+      push_cond(0, hash);
+    } else if (name[2] == '\0') {
+      push_cond(eval_if(r, hash), hash);
+    } else {
+      PPToken *macro = read_token(r);
+      if (macro->kind != PP_IDENT)
+        pp_error_at(macro, "macro names must be identifiers");
+      skip_line(r);
+      push_cond((find_macro(macro->text) != NULL) == (name[2] == 'd'), hash);
+    }
+  } else if (strcmp(name, "elif") == 0) {
+    Cond *c = top_cond(tok);
+    if (c->seen_else)
+      pp_error_at(tok, "#elif after #else");
+    if (c->taken) {
+      c->active = 0;
+      skip_line(r);
+    } else {
+      c->active = c->taken = eval_if(r, hash);
+    }
+  } else if (strcmp(name, "else") == 0) {
+    Cond *c = top_cond(tok);
+    if (c->seen_else)
+      pp_error_at(tok, "#else after #else");
+    c->active = !c->taken;
+    c->taken = c->seen_else = 1;
+    skip_line(r);
+  } else if (strcmp(name, "endif") == 0) {
+    top_cond(tok);
+    conds->size--;
+    skip_line(r);
+  } else if (skipping()) {
+    skip_line(r);
+  } else if (strcmp(name, "define") == 0) {
+    define_macro(r);
+  } else if (strcmp(name, "undef") == 0) {
+    PPToken *macro = read_token(r);
+    if (macro->kind != PP_IDENT)
+      pp_error_at(macro, "macro names must be identifiers");
+    set_macro(macro->text, NULL);
+    skip_line(r);
+  } else if (strcmp(name, "include") == 0) {
+    // the included lines follow the line of the directive
+    output_newline();
+    include_file(r, hash);
+    return;
+  } else if (strcmp(name, "error") == 0) {
+    Vector *line = read_line(r);
+    char *msg = "#error";
+    for (int i = 0; i < line->size; i++) {
+      PPToken *t = line->data[i];
+      msg = allocate_concat_3string(
+          msg, " ", arena_strndup(&string_arena, t->text, t->len));
+    }
+    pp_error_at(tok, msg);
+  } else if (strcmp(name, "pragma") == 0) {
+    PPToken *arg = read_token(r);
+    if (arg->kind == PP_IDENT && strcmp(arg->text, "once") == 0)
+      map_put(once_table, allocate_MapEntry(r->frame->path, r->frame->path));
+    if (arg->kind != PP_NEWLINE)
+      skip_line(r);
+  } else if (strcmp(name, "line") == 0 || strcmp(name, "warning") == 0) {
+    skip_line(r);
+  } else {
+    pp_error_at(tok, "invalid preprocessing directive");
+  }
+  output_newline();
+}
+
+// tokens which have been processed are recycled, so that the memory does
+// not grow with the size of the source.
+static void preprocess_file(char *path, char *buf, long len) {
+  PPLexer lx;
+  init_pp_lexer(&lx, path, buf, len, &token_arena);
+  Reader *r = &main_reader;
+  r->pending = vector_new();
+  r->frame = NULL;
+  enter_file(r, NULL, &lx, path);
+
+  for (;;) {
+    PPToken *tok = read_token(r);
+    if (tok->kind == PP_EOF)
+      break;
+    if (tok->bol && equals(tok, "#")) {
+      directive(r, tok);
+    } else if (tok->kind == PP_NEWLINE) {
+      output_newline();
+    } else if (!skipping() &&
+               (tok->kind != PP_IDENT || !expand_macro(r, tok))) {
+      output_token(tok);
+      continue;
+    }
+    release_token(tok);
+  }
+}
+
+static void define_builtin(char *name, int builtin) {
+  Macro *m = arena_alloc(&table_arena, sizeof(Macro));
+  m->name = intern_string(name);
+  m->params = m->body = vector_new();
+  m->builtin = builtin;
+  set_macro(m->name, m);
+}
+
+void pp_add_include_path(char *dir) {
+  include_paths =
+      realloc(include_paths, (num_include_paths + 1) * sizeof(char *));
+  if (include_paths == NULL)
+    error("out of memory");
+  include_paths[num_include_paths++] = dir;
+}
+
+static void add_command_line(char *s1, char *s2, char *s3) {
+  int len = command_line_macros == NULL ? 0 : strlen(command_line_macros);
+  command_line_macros = realloc(
+      command_line_macros, len + strlen(s1) + strlen(s2) + strlen(s3) + 2);
+  if (command_line_macros == NULL)
+    error("out of memory");
+  sprintf(command_line_macros + len, "%s%s%s\n", s1, s2, s3);
+}
+
+// -D name or -D name=value
+void pp_define(char *arg) {
+  char *eq = strchr(arg, '=');
+  if (eq == NULL) {
+    add_command_line("#define ", arg, " 1");
+  } else {
+    char *name = arena_strndup(&string_arena, arg, eq - arg);
+    add_command_line("#define ", name, allocate_concat_2string(" ", eq + 1));
+  }
+}
+
+void pp_undef(char *name) {
+  add_command_line("#undef ", name, "");
+}
+
+// forgets -I, -D and -U, the server takes new ones with every request.
+void pp_reset_options(void) {
+  free(include_paths);
+  free(command_line_macros);
+  include_paths = NULL;
+  num_include_paths = 0;
+  command_line_macros = NULL;
+}
+
+// plain C with no directive, no command line macro and no predefined name
+// comes out of the preprocessor unchanged.
+int preprocess_needed(Source *src) {
+  if (command_line_macros != NULL || memchr(src->buf, '#', src->len) != NULL)
+    return 1;
+  for (char *p = src->buf, *end = src->buf + src->len;
+       (p = memchr(p, '_', end - p)) != NULL; p++)
+    if (p + 1 < end && p[1] == '_')
+      return 1;
+  return 0;
+}
+
+// writes the preprocessed source to out. Line numbers are kept except for
+// the lines added by #include.
+void preprocess(Source *src, char *path, Output *out) {
+  macros = map_new(NULL);
+  once_table = map_new(NULL);
+  conds = vector_new();
+  include_depth = 0;
+  eof_token = new_token(&token_arena, PP_EOF, "", 0);
+  define_builtin("__FILE__", BUILTIN_FILE);
+  define_builtin("__LINE__", BUILTIN_LINE);
+
+  pp_out = NULL;
+  preprocess_file("<built-in>", predefined, strlen(predefined));
+  if (command_line_macros != NULL)
+    preprocess_file("<command line>", command_line_macros,
+                    strlen(command_line_macros));
+
+  pp_out = out;
+  last_output = NULL;
+  preprocess_file(intern_string(path), src->buf, src->len);
+}
@@ -0,0 +1,410 @@
+#include <stdlib.h>
+#include <string.h>
+#include "uoocc.h"
+
+// With -O1 gen.c lowers every expression into instructions on virtual
+// registers and ir_flush maps them onto the machine by linear scan. A
+// virtual register lives from its first to its last mention. When no
+// register is free, the live one whose interval ends last goes to a stack
+// slot below the local variables. Values live across a call take the
+// callee saved registers. %rax, %rcx and %rdx are scratch registers of the
+// emitted code, the argument registers are left alone and %r12 keeps the
+// stack pointer around calls. Jumps only go forward within an expression,
+// or out of the condition of a statement, so a value keeps its register
+// from its first to its last mention on every path.
+
+typedef struct {
+  char *name[9];  // by size: 1, 4 and 8
+  int callee_saved;
+} Register;
+
+// caller saved first, they are preferred for short intervals
+static Register registers[] = {
+    {{[1] = "%r10b", [4] = "%r10d", [8] = "%r10"}, 0},
+    {{[1] = "%r11b", [4] = "%r11d", [8] = "%r11"}, 0},
+    {{[1] = "%bl", [4] = "%ebx", [8] = "%rbx"}, 1},
+    {{[1] = "%r13b", [4] = "%r13d", [8] = "%r13"}, 1},
+    {{[1] = "%r14b", [4] = "%r14d", [8] = "%r14"}, 1},
+    {{[1] = "%r15b", [4] = "%r15d", [8] = "%r15"}, 1},
+};
+
+#define NUM_REGS (int)(sizeof(registers) / sizeof(registers[0]))
+
+static Register rax = {{[1] = "%al", [4] = "%eax", [8] = "%rax"}, 0};
+static Register rdx = {{[1] = "%dl", [4] = "%edx", [8] = "%rdx"}, 0};
+
+static char *arg_registers[] = {"%rdi", "%rsi", "%rdx", "%rcx", "%r8", "%r9"};
+
+typedef struct {
+  int start;  // first mention, -1 when unused
+  int end;    // last mention
+  int reg;    // index into registers, -1 when spilled
+  int slot;
+} Interval;
+
+// per-thread state of the function being generated
+static _Thread_local Ins *code;
+static _Thread_local int code_len;
+static _Thread_local int code_cap;
+static _Thread_local int num_vregs;
+static _Thread_local Interval *intervals;
+static _Thread_local int frame_base;  // bytes of the local variables
+static _Thread_local int num_slots;   // most spill slots of an expression
+static _Thread_local int used_saved;  // callee saved registers, a bit each
+
+// starts a function whose local variables take locals bytes of the frame.
+void ir_begin_function(int locals) {
+  code = NULL;
+  code_len = code_cap = 0;
+  num_vregs = 0;
+  frame_base = (locals + 7) & ~7;
+  num_slots = 0;
+  used_saved = 0;
+}
+
+int ir_new_reg(void) {
+  return num_vregs++;
+}
+
+// appends an instruction, the caller fills in what op needs.
+Ins *ir_add(int op, int dst, int src) {
+  if (code_len == code_cap) {
+    int cap = code_cap == 0 ? 64 : code_cap * 2;
+    code = arena_realloc(&table_arena, code, code_cap * sizeof(Ins),
+                         cap * sizeof(Ins));
+    code_cap = cap;
+  }
+  Ins *in = &code[code_len++];
+  memset(in, 0, sizeof(Ins));
+  in->op = op;
+  in->dst = dst;
+  in->src = src;
+  return in;
+}
+
+// the virtual registers an instruction mentions are passed to fn.
+static void for_each_vreg(Ins *in, void (*fn)(int, int), int pos) {
+  if (in->dst >= 0)
+    fn(in->dst, pos);
+  if (in->src >= 0)
+    fn(in->src, pos);
+  for (int i = 0; i < in->num_args; i++)
+    fn(in->args[i], pos);
+}
+
+static void extend_interval(int v, int pos) {
+  if (intervals[v].start < 0)
+    intervals[v].start = pos;
+  intervals[v].end = pos;
+}
+
+static int compare_start(const void *a, const void *b) {
+  return (*(Interval **)a)->start - (*(Interval **)b)->start;
+}
+
+static void spill(Interval *iv, int *slots) {
+  iv->reg = -1;
+  iv->slot = (*slots)++;
+}
+
+static void linear_scan(void) {
+  // calls_before[i] is the number of calls in front of instruction i
+  int *calls_before = arena_alloc(&table_arena, (code_len + 1) * sizeof(int));
+  for (int i = 0; i < code_len; i++)
+    calls_before[i + 1] = calls_before[i] + (code[i].op == IR_CALL);
+
+  Interval **order = arena_alloc(&table_arena, num_vregs * sizeof(Interval *));
+  int n = 0;
+  for (int v = 0; v < num_vregs; v++)
+    if (intervals[v].start >= 0)
+      order[n++] = &intervals[v];
+  qsort(order, n, sizeof(Interval *), compare_start);
+
+  Interval *owner[NUM_REGS] = {0};
+  int slots = 0;
+  for (int i = 0; i < n; i++) {
+    Interval *iv = order[i];
+    for (int r = 0; r < NUM_REGS; r++)
+      if (owner[r] != NULL && owner[r]->end < iv->start)
+        owner[r] = NULL;
+    int crosses_call = iv->start < iv->end &&
+                       calls_before[iv->end] > calls_before[iv->start + 1];
+
+    int reg = -1;
+    for (int r = 0; r < NUM_REGS && reg < 0; r++)
+      if (owner[r] == NULL && (!crosses_call || registers[r].callee_saved))
+        reg = r;
+    if (reg < 0) {
+      Interval *victim = NULL;
+      for (int r = 0; r < NUM_REGS; r++)
+        if ((!crosses_call || registers[r].callee_saved) &&
+            (victim == NULL || owner[r]->end > victim->end)) {
+          victim = owner[r];
+          reg = r;
+        }
+      if (victim == NULL || victim->end <= iv->end) {
+        spill(iv, &slots);
+        continue;
+      }
+      spill(victim, &slots);
+    }
+    owner[reg] = iv;
+    iv->reg = reg;
+    if (registers[reg].callee_saved)
+      used_saved |= 1 << reg;
+  }
+  if (num_slots < slots)
+    num_slots = slots;
+  arena_free(&table_arena, order, num_vregs * sizeof(Interval *));
+  arena_free(&table_arena, calls_before, (code_len + 1) * sizeof(int));
+}
+
+// operands are formatted into a few rotating buffers
+static _Thread_local char operand_bufs[4][32];
+static _Thread_local int next_buf;
+
+static char *new_buf(void) {
+  return operand_bufs[next_buf++ % 4];
+}
+
+static int in_memory(int v) {
+  return intervals[v].reg < 0;
+}
+
+// the register or the stack slot of v.
+static char *loc(int v, int size) {
+  Interval *iv = &intervals[v];
+  if (iv->reg >= 0)
+    return registers[iv->reg].name[size];
+  char *buf = new_buf();
+  snprintf(buf, 32, "%d(%%rbp)", -(frame_base + 8 * (iv->slot + 1)));
+  return buf;
+}
+
+// the source operand, an immediate when src is absent.
+static char *src_operand(Ins *in) {
+  if (in->src >= 0)
+    return loc(in->src, 8);
+  char *buf = new_buf();
+  snprintf(buf, 32, "$%d", in->imm);
+  return buf;
+}
+
+// a register with the value of v, scratch when v lives in memory.
+static char *use(int v, Register *scratch, int size) {
+  if (!in_memory(v))
+    return loc(v, size);
+  emit("\tmovq %s, %s\n", loc(v, 8), scratch->name[8]);
+  return scratch->name[size];
+}
+
+// the register to compute v in. finish stores it when v lives in memory.
+static char *target(int v) {
+  return in_memory(v) ? "%rax" : loc(v, 8);
+}
+
+static void finish(int v) {
+  if (in_memory(v))
+    emit("\tmovq %%rax, %s\n", loc(v, 8));
+}
+
+// like target, but with the value of v loaded.
+static char *modify(int v) {
+  return in_memory(v) ? use(v, &rax, 8) : loc(v, 8);
+}
+
+static char *load_op(int size) {
+  return size == 1 ? "movsbq" : size == 4 ? "movslq" : "movq";
+}
+
+static char *store_op(int size) {
+  return size == 1 ? "movb" : size == 4 ? "movl" : "movq";
+}
+
+static void emit_call(Ins *in) {
+  for (int i = 0; i < in->num_args && i < 6; i++)
+    emit("\tmovq %s, %s\n", loc(in->args[i], 8), arg_registers[i]);
+  emit_literal("\txor %al, %al\n");
+  emit_literal("\tmovq %rsp, %r12\n");
+  emit_literal("\tand $0xfffffffffffffff0, %rsp\n");
+  if (in->num_args > 6 && (in->num_args - 6) % 2 != 0)
+    emit_literal("\tsubq $8, %rsp\n");
+  for (int i = in->num_args - 1; i >= 6; i--)
+    emit("\tpushq %s\n", loc(in->args[i], 8));
+  emit("\tcall %s\n", in->sym);
+  emit_literal("\tmovq %r12, %rsp\n");
+  if (in->dst >= 0)
+    emit("\tmovq %%rax, %s\n", loc(in->dst, 8));
+}
+
+// sets the flags by dst - src.
+static void emit_compare(Ins *in) {
+  if (in->src >= 0 && in_memory(in->src) && in_memory(in->dst))
+    emit("\tcmpq %s, %s\n", loc(in->src, 8), use(in->dst, &rax, 8));
+  else
+    emit("\tcmpq %s, %s\n", src_operand(in), loc(in->dst, 8));
+}
+
+static void emit_ins(Ins *in) {
+  static char *alu[] = {[IR_ADD] = "addq", [IR_SUB] = "subq",
+                        [IR_AND] = "andq", [IR_OR] = "orq",
+                        [IR_XOR] = "xorq", [IR_SHL] = "salq",
+                        [IR_SAR] = "sarq"};
+  char *r;
+  switch (in->op) {
+    case IR_IMM:
+      emit("\tmovq $%d, %s\n", in->imm, loc(in->dst, 8));
+      break;
+    case IR_LABEL_ADDR:
+      r = target(in->dst);
+      emit("\tleaq .L%d(%%rip), %s\n", in->imm, r);
+      finish(in->dst);
+      break;
+    case IR_LOCAL_ADDR:
+      r = target(in->dst);
+      emit("\tleaq %d(%%rbp), %s\n", in->imm, r);
+      finish(in->dst);
+      break;
+    case IR_GLOBAL_ADDR:
+      r = target(in->dst);
+      emit("\tleaq %s(%%rip), %s\n", in->sym, r);
+      finish(in->dst);
+      break;
+    case IR_LOAD: {
+      char *addr = use(in->src, &rax, 8);
+      r = target(in->dst);
+      emit("\t%s %d(%s), %s\n", load_op(in->size), in->imm, addr, r);
+      finish(in->dst);
+      break;
+    }
+    case IR_LOAD_LOCAL:
+      r = target(in->dst);
+      emit("\t%s %d(%%rbp), %s\n", load_op(in->size), in->imm, r);
+      finish(in->dst);
+      break;
+    case IR_LOAD_GLOBAL:
+      r = target(in->dst);
+      emit("\t%s %s(%%rip), %s\n", load_op(in->size), in->sym, r);
+      finish(in->dst);
+      break;
+    case IR_STORE: {
+      char *val = use(in->src, &rdx, in->size);
+      char *addr = use(in->dst, &rax, 8);
+      emit("\t%s %s, %d(%s)\n", store_op(in->size), val, in->imm, addr);
+      break;
+    }
+    case IR_STORE_LOCAL:
+      emit("\t%s %s, %d(%%rbp)\n", store_op(in->size),
+           use(in->src, &rdx, in->size), in->imm);
+      break;
+    case IR_STORE_GLOBAL:
+      emit("\t%s %s, %s(%%rip)\n", store_op(in->size),
+           use(in->src, &rdx, in->size), in->sym);
+      break;
+    case IR_ADD:
+    case IR_SUB:
+    case IR_AND:
+    case IR_OR:
+    case IR_XOR:
+      if (in->src >= 0 && in_memory(in->src) && in_memory(in->dst)) {
+        emit("\tmovq %s, %%rax\n", loc(in->src, 8));
+        emit("\t%s %%rax, %s\n", alu[in->op], loc(in->dst, 8));
+      } else {
+        emit("\t%s %s, %s\n", alu[in->op], src_operand(in), loc(in->dst, 8));
+      }
+      break;
+    case IR_SHL:
+    case IR_SAR:
+      if (in->src < 0) {
+        emit("\t%s $%d, %s\n", alu[in->op], in->imm, loc(in->dst, 8));
+      } else {
+        emit("\tmovq %s, %%rcx\n", loc(in->src, 8));
+        emit("\t%s %%cl, %s\n", alu[in->op], loc(in->dst, 8));
+      }
+      break;
+    case IR_MUL:
+      r = modify(in->dst);
+      emit("\timulq %s, %s\n", src_operand(in), r);
+      finish(in->dst);
+      break;
+    case IR_DIV:
+      // unsigned, like the stack machine
+      emit("\tmovq %s, %%rax\n", loc(in->dst, 8));
+      emit_literal("\txor %rdx, %rdx\n");
+      if (in->src < 0) {
+        emit("\tmovq $%d, %%rcx\n", in->imm);
+        emit_literal("\tdivq %rcx\n");
+      } else {
+        emit("\tdivq %s\n", loc(in->src, 8));
+      }
+      emit("\tmovq %%rax, %s\n", loc(in->dst, 8));
+      break;
+    case IR_NOT:
+      emit("\tnotq %s\n", loc(in->dst, 8));
+      break;
+    case IR_SET:
+      emit_compare(in);
+      emit("\tset%s %%al\n", in->sym);
+      r = target(in->dst);
+      emit("\tmovzbq %%al, %s\n", r);
+      finish(in->dst);
+      break;
+    case IR_INC:
+    case IR_DEC:
+      emit("\t%s %d(%s)\n", in->op == IR_INC ? "incl" : "decl", in->imm,
+           use(in->src, &rax, 8));
+      break;
+    case IR_CALL:
+      emit_call(in);
+      break;
+    case IR_LABEL:
+      emit(".L%d:\n", in->label);
+      break;
+    case IR_JMP:
+      emit("\tjmp .L%d\n", in->label);
+      break;
+    case IR_BRANCH:
+      emit_compare(in);
+      emit("\tj%s .L%d\n", in->sym, in->label);
+      break;
+  }
+}
+
+// allocates registers for the instructions added since the last flush and
+// emits them. The value of result, unless it is negative, ends up in %rax.
+void ir_flush(int result) {
+  intervals = arena_alloc(&table_arena, (num_vregs + 1) * sizeof(Interval));
+  for (int v = 0; v < num_vregs; v++)
+    intervals[v].start = -1;
+  for (int i = 0; i < code_len; i++)
+    for_each_vreg(&code[i], extend_interval, i);
+  linear_scan();
+
+  for (int i = 0; i < code_len; i++)
+    emit_ins(&code[i]);
+  if (result >= 0)
+    emit("\tmovq %s, %%rax\n", loc(result, 8));
+
+  arena_free(&table_arena, intervals, (num_vregs + 1) * sizeof(Interval));
+  code_len = 0;
+  num_vregs = 0;
+}
+
+// bytes of the frame, the local variables and the spill slots below them.
+int ir_frame_size(void) {
+  return frame_base + 8 * num_slots;
+}
+
+// the callee saved registers the function uses are kept by its prologue
+// and restored by its epilogue.
+void ir_save_registers(void) {
+  for (int r = 0; r < NUM_REGS; r++)
+    if (used_saved & 1 << r)
+      emit("\tpushq %s\n", registers[r].name[8]);
+}
+
+void ir_restore_registers(void) {
+  for (int r = NUM_REGS - 1; r >= 0; r--)
+    if (used_saved & 1 << r)
+      emit("\tpopq %s\n", registers[r].name[8]);
+}
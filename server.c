@@ -0,0 +1,237 @@
+#define _POSIX_C_SOURCE 200809L
+#include <setjmp.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/prctl.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+#include "uoocc.h"
+
+// A request is the working directory of the client, its arguments separated
+// by NUL and the source. The reply is the status, the output and the
+// diagnostics. Every part is a 32-bit length followed by the bytes.
+
+static int read_full(int fd, char *buf, long len) {
+  while (len > 0) {
+    ssize_t n = read(fd, buf, len);
+    if (n <= 0)
+      return 0;
+    buf += n;
+    len -= n;
+  }
+  return 1;
+}
+
+static int write_full(int fd, char *buf, long len) {
+  while (len > 0) {
+    ssize_t n = write(fd, buf, len);
+    if (n <= 0)
+      return 0;
+    buf += n;
+    len -= n;
+  }
+  return 1;
+}
+
+// reads a block into memory which output_release frees. out starts empty.
+static int read_block(int fd, Output *out) {
+  unsigned int len;
+  if (!read_full(fd, (char *)&len, 4))
+    return 0;
+  out->buf = malloc(len + 1);
+  if (out->buf == NULL)
+    return 0;
+  out->fd = -1;
+  out->cap = len + 1;
+  out->len = len;
+  out->buf[len] = '\0';
+  return read_full(fd, out->buf, len);
+}
+
+static int write_block(int fd, char *buf, unsigned int len) {
+  return write_full(fd, (char *)&len, 4) && write_full(fd, buf, len);
+}
+
+static int connect_server(char *path) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path))
+    return -1;
+  strcpy(addr.sun_path, path);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (fd >= 0 && connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == 0)
+    return fd;
+  if (fd >= 0)
+    close(fd);
+  return -1;
+}
+
+// compiles through the server listening at path and writes the result to
+// output, or stdout when it is NULL. Returns the exit status, or -1 when no
+// server answers.
+int remote_compile(char *path, int argc, char **argv, Source *src,
+                   char *output) {
+  int fd = connect_server(path);
+  if (fd < 0)
+    return -1;
+
+  Output args;
+  output_init(&args, -1);
+  for (int i = 0; i < argc; i++)
+    output_write(&args, argv[i], strlen(argv[i]) + 1);
+  char cwd[4096];
+  if (getcwd(cwd, sizeof(cwd)) == NULL)
+    error("cannot get the working directory");
+  int sent = write_block(fd, cwd, strlen(cwd) + 1) &&
+             write_block(fd, args.buf, args.len) &&
+             write_block(fd, src->buf, src->len);
+  output_release(&args);
+
+  unsigned int status;
+  Output result = {.fd = -1}, diag = {.fd = -1};
+  if (!sent || !read_full(fd, (char *)&status, 4) ||
+      !read_block(fd, &result) || !read_block(fd, &diag)) {
+    close(fd);
+    output_release(&result);
+    output_release(&diag);
+    return -1;  // the server went away, compile here
+  }
+  close(fd);
+
+  fwrite(diag.buf, 1, diag.len, stderr);
+  if (status == 0) {
+    int out = open_output(output);
+    if (!write_full(out, result.buf, result.len))
+      error("cannot write the output");
+    if (out != 1)
+      close(out);
+  }
+  output_release(&result);
+  output_release(&diag);
+  return status;
+}
+
+// the last request, file scope so that it survives longjmp
+static Compilation request;
+
+static void serve(int fd) {
+  Output cwd = {.fd = -1}, args = {.fd = -1}, src = {.fd = -1};
+  if (!read_block(fd, &cwd) || !read_block(fd, &args) ||
+      !read_block(fd, &src) || chdir(cwd.buf) != 0) {
+    output_release(&cwd);
+    output_release(&args);
+    output_release(&src);
+    return;  // the client compiles by itself
+  }
+
+  char **argv = malloc((args.len + 1) * sizeof(char *));
+  int argc = 0;
+  for (char *p = args.buf; p < args.buf + args.len; p += strlen(p) + 1)
+    argv[argc++] = p;
+
+  // diagnostics go to the client
+  FILE *diag = tmpfile();
+  fflush(stderr);
+  int saved_stderr = dup(2);
+  dup2(fileno(diag), 2);
+
+  Output out;
+  output_init(&out, -1);
+  volatile unsigned int status = 1;
+  jmp_buf env;
+  error_return = &env;
+  if (setjmp(env) == 0) {
+    Options opts;
+    Vector *inputs = vector_new();
+    char *output;
+    pp_reset_options();
+    parse_options(argc, argv, &opts, inputs, &output);
+    opts.jobs = 1;  // errors are caught on this thread only
+    memset(&request, 0, sizeof(request));
+    request.input = vector_at(inputs, 0);
+    Source s = {src.buf, src.len};
+    src.buf = NULL;
+    compile_source(&request, &s, &opts, &out);
+    if (opts.time_trace != NULL)
+      time_trace_write(opts.time_trace);
+    status = 0;
+  }
+  error_return = NULL;
+  time_reset();
+  compilation_release(&request);
+
+  fflush(stderr);
+  dup2(saved_stderr, 2);
+  close(saved_stderr);
+  Output messages;
+  output_init(&messages, -1);
+  rewind(diag);
+  char buf[4096];
+  for (size_t n; (n = fread(buf, 1, sizeof(buf), diag)) > 0;)
+    output_write(&messages, buf, n);
+  fclose(diag);
+
+  unsigned int st = status;
+  if (write_full(fd, (char *)&st, 4) && write_block(fd, out.buf, out.len))
+    write_block(fd, messages.buf, messages.len);
+
+  output_release(&messages);
+  output_release(&out);
+  output_release(&cwd);
+  output_release(&args);
+  output_release(&src);
+  free(argv);
+  // interned names and cached headers stay, the arenas keep their blocks
+  arena_recycle_all();
+}
+
+// a worker answers requests one after another and keeps what it cached.
+static void serve_forever(int fd) {
+  for (;;) {
+    int conn = accept(fd, NULL, NULL);
+    if (conn < 0)
+      continue;
+    serve(conn);
+    close(conn);
+  }
+}
+
+static pid_t start_worker(int fd) {
+  pid_t server = getpid();
+  pid_t pid = fork();
+  if (pid != 0)
+    return pid;
+  prctl(PR_SET_PDEATHSIG, SIGTERM);
+  if (getppid() != server)
+    _exit(0);  // the server died before prctl
+  serve_forever(fd);
+  return 0;
+}
+
+// answers requests on the Unix socket at path until the process is killed.
+// A request changes the working directory and stderr of its process, so
+// concurrent requests go to workers, processes of their own accepting on
+// the same socket. There is one per CPU, or jobs of them when jobs is
+// above 1, and one which a request brought down is replaced.
+void run_server(char *path, int jobs) {
+  struct sockaddr_un addr = {.sun_family = AF_UNIX};
+  if (strlen(path) >= sizeof(addr.sun_path))
+    error("socket path is too long");
+  strcpy(addr.sun_path, path);
+  int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(path);
+  if (fd < 0 || bind(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 ||
+      listen(fd, 64) != 0)
+    error(allocate_concat_3string("cannot listen on '", path, "'"));
+
+  signal(SIGPIPE, SIG_IGN);  // clients may go away early
+  long workers = jobs > 1 ? jobs : sysconf(_SC_NPROCESSORS_ONLN);
+  for (long i = 0; i < (workers > 0 ? workers : 1); i++)
+    if (start_worker(fd) < 0)
+      error("cannot start a worker");
+  for (;;)
+    if (wait(NULL) > 0 && start_worker(fd) < 0)
+      error("cannot start a worker");
+}
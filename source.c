@@ -0,0 +1,56 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "uoocc.h"
+
+#define SOURCE_READ_SIZE (64 * 1024)
+
+// loads the rest of fp into memory. Regular files are mapped, anything
+// else (pipes, terminals) is read into one growing buffer.
+void source_read(Source *src, FILE *fp) {
+  src->buf = src->map = NULL;
+  src->len = src->map_len = 0;
+
+  struct stat st;
+  int fd = fileno(fp);
+  long offset = ftell(fp);
+  if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && offset >= 0 &&
+      st.st_size > offset) {
+    char *p = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (p != MAP_FAILED) {
+      posix_madvise(p, st.st_size, POSIX_MADV_SEQUENTIAL);
+      src->map = p;
+      src->map_len = st.st_size;
+      src->buf = p + offset;
+      src->len = st.st_size - offset;
+      return;
+    }
+  }
+
+  long reserved = 0;
+  for (;;) {
+    if (reserved - src->len < SOURCE_READ_SIZE) {
+      reserved = reserved == 0 ? SOURCE_READ_SIZE : reserved * 2;
+      src->buf = realloc(src->buf, reserved);
+      if (src->buf == NULL)
+        error("out of memory");
+    }
+    size_t n = fread(src->buf + src->len, 1, reserved - src->len, fp);
+    if (n == 0)
+      break;
+    src->len += n;
+  }
+  if (ferror(fp))
+    error("cannot read the source");
+}
+
+void source_release(Source *src) {
+  if (src->map != NULL)
+    munmap(src->map, src->map_len);
+  else
+    free(src->buf);
+  src->buf = src->map = NULL;
+  src->len = src->map_len = 0;
+}
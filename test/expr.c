@@ -92,6 +92,13 @@ void test_postfix_expr() {
   expect(a, 2);
   expect(a--, 2);
   expect(a, 1);
+
+  char c;
+  c = 127;
+  c++;
+  expect(c, 0 - 128);
+  --c;
+  expect(c, 127);
   return;
 }
 
@@ -222,6 +229,85 @@ void test_postfix_ptr() {
   return;
 }
 
+int twice(int x) {
+  return x + x;
+}
+
+void test_register_pressure() {
+  int a;
+  a = 1;
+  expect(a + (a + (a + (a + (a + (a + (a + (a + a))))))), 9);
+  expect(a + (a + (a + (a + (a + twice(a))))), 7);
+  expect(a + twice(a + twice(a + twice(a))), 15);
+  expect(twice(1) + twice(2) + twice(3) + twice(4) + twice(5) + twice(6), 42);
+  return;
+}
+
+int calls;
+int count_call() {
+  calls++;
+  return 3;
+}
+
+void test_folding() {
+  int x;
+  int *p;
+  int arr[3];
+  char c;
+  x = 5;
+  arr[0] = 1;
+  arr[1] = 2;
+  arr[2] = 3;
+  p = arr;
+  c = 7;
+  expect(x + 0, 5);
+  expect(0 + x, 5);
+  expect(x - 0, 5);
+  expect(x * 1, 5);
+  expect(1 * x, 5);
+  expect(x * 0, 0);
+  expect(x / 1, 5);
+  expect(x << 0, 5);
+  expect(x >> 0, 5);
+  expect(x | 0, 5);
+  expect(x ^ 0, 5);
+  expect(c + 0, 7);
+  expect(*(p + 0), 1);
+  expect(*(0 + p), 1);
+  expect(*(p + 1 * 2), 3);
+  expect(*(p + (2 - 1)), 2);
+  expect(p[1 - 1], 1);
+  expect(2 && 4, 1);
+  expect(0 - 7 / 2, 0 - 3);
+  calls = 0;
+  expect(count_call() * 0, 0);
+  expect(calls, 1);
+  expect(0 && count_call(), 0);
+  expect(1 || count_call(), 1);
+  expect(calls, 1);
+  return;
+}
+
+void test_short_circuit() {
+  int a;
+  int *p;
+  a = 2;
+  p = 0;
+  calls = 0;
+  expect(a && a - 2, 0);
+  expect(a - 2 || a, 1);
+  expect(a - 2 && count_call(), 0);
+  expect(calls, 0);
+  expect(a || count_call(), 1);
+  expect(calls, 0);
+  expect(a && count_call(), 1);
+  expect(a - 2 || count_call(), 1);
+  expect(calls, 2);
+  expect(p && *p, 0);
+  expect(a + (a && (a - 2 || a)), 3);
+  return;
+}
+
 int main() {
   printf("Testing expression ...\n");
 
@@ -238,6 +324,9 @@ int main() {
   test_logical_expr();
   test_additive_ptr();
   test_unary_ptr();
+  test_register_pressure();
+  test_folding();
+  test_short_circuit();
 
   printf("OK!\n");
 
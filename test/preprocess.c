@@ -0,0 +1,112 @@
+#include "preprocess.h"
+#include "preprocess.h"
+
+int cnt;
+void expect(int a, int b) {
+  if (a != b) {
+    printf("Test %d: Failed\n", cnt++);
+    printf("  %d expected, but got %d\n", b, a);
+    exit(1);
+  } else
+    printf("Test %d: Passed\n", cnt++);
+  return;
+}
+
+#define ONE 1
+#define TWO (ONE + ONE)
+#define SQUARE(x) ((x) * (x))
+#define ADD(a, b) a + b
+#define CAT(a, b) a##b
+#define FIRST(a, ...) a
+#define CALL(f, ...) f(__VA_ARGS__)
+#define EMPTY()
+#define ID(x) x
+
+void test_object_macro() {
+  expect(ONE, 1);
+  expect(TWO, 2);
+  expect(TWO * 3, 6);
+  expect(HEADER_VALUE, 42);
+  return;
+}
+
+void test_function_macro() {
+  expect(SQUARE(3), 9);
+  expect(SQUARE(1 + 2), 9);
+  expect(SQUARE(SQUARE(2)), 16);
+  expect(ADD(1, 2) * 3, 7);
+  ID(expect(5, 5));
+  expect(FIRST(4, 5, 6), 4);
+  CALL(expect, 7, 7);
+  int CAT(x, y);
+  xy = 10;
+  expect(CAT(x, y), 10);
+  expect(EMPTY() 3, 3);
+  return;
+}
+
+int rec;
+
+void test_recursive_macro() {
+  rec = 1;
+#define rec (rec + 1)
+  expect(rec, 2);
+#undef rec
+  expect(rec, 1);
+  return;
+}
+
+void test_conditional() {
+  int a;
+  a = 0;
+#if TWO == 2 && defined(ONE)
+  a = a + 1;
+#else
+  a = a + 100;
+#endif
+#ifdef NOT_DEFINED
+  a = a + 100;
+#elif SQUARE(3) > 8
+  a = a + 2;
+#endif
+#ifndef PREPROCESS_H
+  a = a + 100;
+#endif
+#if 0
+#error not reached
+#if 1
+  a = a + 100;
+#endif
+#elif 1
+  a = a + 4;
+#endif
+#if 0 && 1 / 0
+  a = a + 100;
+#elif 1 || 1 % 0
+  a = a + 8;
+#endif
+#if 1 ? 16 : 1 / 0
+  a = a + 16;
+#endif
+  expect(a, 31);
+  return;
+}
+
+void test_include_guard() {
+  expect(count_include(), 1);
+  return;
+}
+
+int main() {
+  printf("Testing preprocessor ...\n");
+
+  test_object_macro();
+  test_function_macro();
+  test_recursive_macro();
+  test_conditional();
+  test_include_guard();
+
+  printf("OK!\n");
+
+  return 0;
+}
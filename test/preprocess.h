@@ -0,0 +1,13 @@
+#ifndef PREPROCESS_H
+#define PREPROCESS_H
+
+#define HEADER_VALUE 42
+
+int included;
+
+int count_include() {
+  included++;
+  return included;
+}
+
+#endif
@@ -148,6 +148,65 @@ void test_continue() {
   return;
 }
 
+void test_logical_cond() {
+  int i;
+  int n;
+  int *p;
+  p = 0;
+  if (p && *p)
+    expect(0, 1);
+  if (p == 0 || *p)
+    n = 1;
+  else
+    n = 2;
+  expect(n, 1);
+  if (!(n == 1 && p))
+    n = 3;
+  expect(n, 3);
+
+  n = 0;
+  for (i = 0; i < 10 && n < 3; i++)
+    n = n + (i > 2 || i == 0);
+  expect(i, 5);
+  expect(n, 3);
+
+  n = 0;
+  while (n < 5 || n == 7)
+    n++;
+  expect(n, 5);
+
+  return;
+}
+
+void test_compare_cond() {
+  int i;
+  int n;
+  int lim;
+  lim = 4;
+  n = 0;
+  for (i = 0; i < lim; i++)
+    n++;
+  expect(n, 4);
+  for (i = 10; i >= 0 - 2; i--)
+    n++;
+  expect(n, 17);
+  i = 0;
+  while (!(i == lim))
+    i++;
+  expect(i, 4);
+  if (!(i != 4))
+    n = 1;
+  expect(n, 1);
+  if (!!(i <= 3))
+    n = 2;
+  expect(n, 1);
+  if (lim > i || !(i - 4))
+    n = 3;
+  expect(n, 3);
+
+  return;
+}
+
 int main() {
   printf("Testing statement ...\n");
 
@@ -156,6 +215,8 @@ int main() {
   test_for();
   test_break();
   test_continue();
+  test_logical_cond();
+  test_compare_cond();
 
   printf("OK!\n");
 
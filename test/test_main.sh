@@ -41,6 +41,8 @@ failtest 'int main() { ++1; }' "expression is not assignable."
 failtest 'int main() { 1++; }' "expression is not assignable."
 failtest 'int main() { int a; a++ = 1; }' "expression is not assignable."
 failtest 'int main() { int a; ++a = 1; }' "expression is not assignable."
+failtest 'int main() { int x; (x+0) = 1; }' "expression is not assignable."
+failtest 'int main() { int x; int *p; p = &(x+0); }' "cannot take the address of an rvalue."
 failtest 'int main() { int x; int x; }' "redefinition of 'x'."
 failtest 'int main() { int 1; }' "ident was expected."
 failtest 'int main() { x = 1; }' "use of undeclared identifier 'x'."
@@ -56,6 +58,10 @@ failtest 'int main() { if () {} }' "primary-expression was expected."
 failtest 'int main() { while () {} }' "primary-expression was expected."
 failtest '/*' "unterminated comment."
 failtest '/*/' "unterminated comment."
+failtest '#if 1' "unterminated conditional directive."
+failtest '#if 1 / 0' "division by zero in preprocessor expression."
+failtest '#define F(a, b) a
+F(1)' "wrong number of arguments to macro \"F\"."
 failtest 'struct { int a; int hoge(); } x;' "not member variable."
 failtest 'int main() { int x; return x.a; }' "cannot apply operator."
 failtest 'int main() { struct { int a; } x; return x.b; }' "not exist such member."
@@ -1,17 +1,26 @@
 #include <assert.h>
+#include <elf.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include "../uoocc.h"
 
 void test_vector(void) {
   Vector *v = vector_new();
 
   assert(v != NULL);
+  assert(v->data == v->inline_data);
 
   int times = 64;
   for (int i = 0; i < times; i++) {
     assert(vector_push_back(v, (void *)allocate_integer(i)) == 1);
     assert(v->size == i + 1);
+    assert(v->size <= v->reserved_size);
+    if (i < VECTOR_INLINE_SIZE)
+      assert(v->data == v->inline_data);
   }
+  assert(v->data != v->inline_data);
+  assert(v->reserved_size == times);
 
   for (int i = 0; i < times; i++) {
     int *p = (int *)vector_at(v, i);
@@ -28,26 +37,182 @@ void test_map(void) {
 
   assert(m != NULL);
 
-  e = allocate_MapEntry(allocate_string("abc"), (void *)allocate_integer(1));
+  e = allocate_MapEntry(intern_string("abc"), (void *)allocate_integer(1));
   assert(map_put(m, e) == 1);
-  e = allocate_MapEntry(allocate_string("xyz"), (void *)allocate_integer(2));
+  e = allocate_MapEntry(intern_string("xyz"), (void *)allocate_integer(2));
   assert(map_put(m, e) == 1);
-  e = allocate_MapEntry(allocate_string("a"), (void *)allocate_integer(3));
+  e = allocate_MapEntry(intern_string("a"), (void *)allocate_integer(3));
   assert(map_put(m, e) == 1);
-  e = allocate_MapEntry(allocate_string("123"), (void *)allocate_integer(4));
+  e = allocate_MapEntry(intern_string("123"), (void *)allocate_integer(4));
   assert(map_put(m, e) == 1);
 
-  assert(*(int *)(map_get(m, "abc")->val) == 1);
-  assert(*(int *)(map_get(m, "xyz")->val) == 2);
-  assert(*(int *)(map_get(m, "a")->val) == 3);
-  assert(*(int *)(map_get(m, "123")->val) == 4);
+  assert(*(int *)(map_get(m, intern_string("abc"))->val) == 1);
+  assert(*(int *)(map_get(m, intern_string("xyz"))->val) == 2);
+  assert(*(int *)(map_get(m, intern_string("a"))->val) == 3);
+  assert(*(int *)(map_get(m, intern_string("123"))->val) == 4);
 
-  assert(map_get(m, "hoge") == NULL);
+  assert(map_get(m, intern_string("hoge")) == NULL);
+
+  // rehash keeps every entry reachable and insertion order intact.
+  int times = 1000;
+  char buf[16];
+  for (int i = 0; i < times; i++) {
+    sprintf(buf, "key%d", i);
+    e = allocate_MapEntry(intern_string(buf), (void *)allocate_integer(i));
+    assert(map_put(m, e) == 1);
+  }
+  assert(m->size == times + 4);
+  for (int i = 0; i < times; i++) {
+    sprintf(buf, "key%d", i);
+    assert(*(int *)(map_get(m, intern_string(buf))->val) == i);
+    assert(*(int *)(((MapEntry *)vector_at(m->vec, i + 4))->val) == i);
+  }
+  assert(*(int *)(map_get(m, intern_string("abc"))->val) == 1);
+
+  // the first entry wins when the same key is put twice.
+  e = allocate_MapEntry(intern_string("abc"), (void *)allocate_integer(5));
+  assert(map_put(m, e) == 1);
+  assert(*(int *)(map_get(m, intern_string("abc"))->val) == 1);
+}
+
+void test_arena(void) {
+  Arena a = {"test"};
+
+  int *p = arena_alloc(&a, sizeof(int) * 4);
+  assert(p != NULL && p[0] == 0 && p[3] == 0);
+  p[0] = 1;
+  assert(a.num_allocs == 1);
+
+  // freed chunks are reused by the next allocation of the same size class.
+  arena_free(&a, p, sizeof(int) * 4);
+  int *q = arena_alloc(&a, sizeof(int) * 4);
+  assert(q == p && q[0] == 0);
+  assert(a.num_reused == 1);
+
+  // big allocations live in their own block.
+  char *big = arena_alloc(&a, ARENA_BLOCK_SIZE);
+  assert(big != NULL && big[ARENA_BLOCK_SIZE - 1] == 0);
+  long reserved = a.reserved_bytes;
+  arena_free(&a, big, ARENA_BLOCK_SIZE);
+  assert(a.reserved_bytes == reserved - ARENA_BLOCK_SIZE);
+
+  arena_release(&a);
+  assert(a.blocks == NULL && a.large == NULL && a.reserved_bytes == 0);
+}
+
+void test_arena_tags(void) {
+  Arena a = {"test"};
+
+  // live bytes go down on free, the peak stays.
+  char *s = arena_alloc_tagged(&a, MEM_STRING, 16);
+  char *t = arena_alloc_tagged(&a, MEM_STRING, 16);
+  arena_free_tagged(&a, MEM_STRING, s, 16);
+  arena_alloc_tagged(&a, MEM_AST, 8);
+  assert(a.tags[MEM_STRING].num_allocs == 2);
+  assert(a.tags[MEM_STRING].num_bytes == 32);
+  assert(a.tags[MEM_STRING].live_bytes == 16);
+  assert(a.tags[MEM_STRING].peak_bytes == 32);
+  assert(a.tags[MEM_AST].live_bytes == 8);
+  assert(a.num_allocs == 3);
+
+  // a grown buffer counts once towards what is live.
+  t = arena_realloc_tagged(&a, MEM_STRING, t, 16, 24);
+  assert(a.tags[MEM_STRING].live_bytes == 24);
+
+  arena_release(&a);
+  assert(a.tags[MEM_STRING].live_bytes == 0);
+  assert(a.tags[MEM_STRING].peak_bytes == 40);
+}
+
+static void fill_job(int i, void *arg) {
+  int **slots = arg;
+  slots[i] = arena_alloc(&ast_arena, sizeof(int));
+  *slots[i] = i;
+}
+
+void test_parallel_for(void) {
+  int *slots[100];
+  long allocs = ast_arena.num_allocs;
+  parallel_for(100, 4, fill_job, slots);
+
+  // memory of the workers outlives them and is counted by this thread.
+  for (int i = 0; i < 100; i++)
+    assert(*slots[i] == i);
+  assert(ast_arena.num_allocs == allocs + 100);
+  arena_release(&ast_arena);
+}
+
+void test_intern(void) {
+  char buf[] = "ident";
+  char *p = intern_string("ident");
+  assert(strcmp(p, "ident") == 0);
+  assert(intern_string(buf) == p);
+  assert(intern_string_n("identifier", 5) == p);
+  assert(intern_string("Ident") != p);
+  assert(intern_hash(p) == hash_string_n("ident", 5));
+
+  char name[16];
+  for (int i = 0; i < 5000; i++) {
+    sprintf(name, "x%d", i);
+    assert(strcmp(intern_string(name), name) == 0);
+  }
+  assert(intern_string("ident") == p);
+  assert(intern_string("x4999") == intern_string_n("x4999", 5));
+}
+
+void test_output(void) {
+  Output out;
+  output_init(&out, -1);
+  asm_output = &out;
+
+  emit("\tpushq $%d\n", -42);
+  emit_literal("\tpopq %rax\n");
+  emit("%s:%d%%\n", "main", 0);
+  output_int(&out, -2147483648L);
+  char *expected = "\tpushq $-42\n\tpopq %rax\nmain:0%\n-2147483648";
+  assert(out.len == strlen(expected));
+  assert(memcmp(out.buf, expected, out.len) == 0);
+
+  // memory outputs grow instead of flushing
+  for (int i = 0; i < OUTPUT_BUFFER_SIZE; i++)
+    emit_literal("x");
+  assert(out.len == strlen(expected) + OUTPUT_BUFFER_SIZE);
+  output_release(&out);
+}
+
+void test_assemble(void) {
+  char *text =
+      "main:\n\tpushq %rbp\n\tmovq %rsp, %rbp\n.L0:\n\tjmp .L0\n"
+      "\tcall f\n\tpopq %r12\n\tret\n";
+  unsigned char expected[] = {0x55, 0x48, 0x89, 0xe5, 0xeb, 0xfe, 0xe8,
+                              0,    0,    0,    0,    0x41, 0x5c, 0xc3};
+  Output out;
+  output_init(&out, -1);
+  assemble(text, strlen(text), &out);
+
+  Elf64_Ehdr *eh = (Elf64_Ehdr *)out.buf;
+  assert(memcmp(eh->e_ident, ELFMAG, SELFMAG) == 0);
+  assert(eh->e_type == ET_REL && eh->e_machine == EM_X86_64);
+  Elf64_Shdr *sh = (Elf64_Shdr *)(out.buf + eh->e_shoff);
+  assert(sh[1].sh_size == sizeof(expected));
+  assert(memcmp(out.buf + sh[1].sh_offset, expected, sizeof(expected)) == 0);
+
+  // the call to the undefined f is left to the linker
+  assert(sh[3].sh_type == SHT_RELA && sh[3].sh_size == sizeof(Elf64_Rela));
+  Elf64_Rela *r = (Elf64_Rela *)(out.buf + sh[3].sh_offset);
+  assert(r->r_offset == 7 && ELF64_R_TYPE(r->r_info) == R_X86_64_PLT32);
+  output_release(&out);
 }
 
 int main(void) {
+  test_arena();
+  test_arena_tags();
+  test_parallel_for();
+  test_intern();
   test_vector();
   test_map();
+  test_output();
+  test_assemble();
 
   return 0;
 }
@@ -278,6 +278,11 @@ typedef struct _Node {
   struct _Node *next;
 } Node;
 
+typedef struct {
+  char tag;
+  int value;
+} Pair;
+
 #define NULL (0)
 
 Node *new_node(int data) {
@@ -308,6 +313,13 @@ void test_typedef() {
   expect(s.b, 78);
   expect(s.c, 79);
 
+  Pair pair;
+  pair.tag = 1;
+  pair.value = 300;
+  expect(pair.tag, 1);
+  expect(pair.value, 300);
+  expect(sizeof(Pair), 8);
+
   int i;
   Node *list;
   Node *p;
@@ -0,0 +1,135 @@
+#define _POSIX_C_SOURCE 200809L
+#include <pthread.h>
+#include <stdlib.h>
+#include <time.h>
+#include "uoocc.h"
+
+// Spans of every compilation in the process, from any thread. The phases
+// make the -ftime-report table, -ftime-trace= also records a span per
+// function and writes them all in the trace event format of Chrome.
+
+typedef struct {
+  char *name;    // phase
+  char *detail;  // function, NULL for a phase
+  char *file;
+  Compilation *compilation;
+  int tid;
+  long start;  // nanoseconds
+  long end;
+} Span;
+
+static pthread_mutex_t spans_lock = PTHREAD_MUTEX_INITIALIZER;
+static Span *spans;
+static int num_spans;
+static int spans_cap;
+
+static atomic_int num_threads;
+static _Thread_local int tid;  // 0 until the thread records a span
+
+long time_now(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000L + ts.tv_nsec;
+}
+
+static void add_span(char *name, char *detail, long start) {
+  long end = time_now();
+  if (tid == 0)
+    tid = atomic_fetch_add(&num_threads, 1) + 1;
+  char *file = compilation->input != NULL ? compilation->input : "<stdin>";
+  pthread_mutex_lock(&spans_lock);
+  if (num_spans == spans_cap) {
+    int cap = spans_cap == 0 ? 256 : spans_cap * 2;
+    Span *p = realloc(spans, cap * sizeof(Span));
+    if (p == NULL) {
+      pthread_mutex_unlock(&spans_lock);
+      return;  // the report is incomplete, the compilation goes on
+    }
+    spans = p;
+    spans_cap = cap;
+  }
+  Span s = {name, detail, intern_string(file), compilation, tid, start, end};
+  spans[num_spans++] = s;
+  pthread_mutex_unlock(&spans_lock);
+}
+
+// records the phase name of the current compilation from start to now.
+void time_phase(char *name, long start) {
+  Options *opts = compilation->opts;
+  if (opts->time_report || opts->time_trace != NULL)
+    add_span(name, NULL, start);
+}
+
+// records the work of phase name on a function, for the trace only.
+void time_function(char *name, char *function, long start) {
+  if (compilation->opts->time_trace != NULL)
+    add_span(name, function, start);
+}
+
+// prints the phases of the current compilation as a table.
+void time_report(FILE *fp) {
+  pthread_mutex_lock(&spans_lock);
+  long total = 0;
+  for (int i = 0; i < num_spans; i++)
+    if (spans[i].compilation == compilation && spans[i].detail == NULL)
+      total += spans[i].end - spans[i].start;
+  fprintf(fp, "%-18s %12s %7s\n", "phase", "time (ms)", "share");
+  for (int i = 0; i < num_spans; i++) {
+    Span *s = &spans[i];
+    if (s->compilation != compilation || s->detail != NULL)
+      continue;
+    long t = s->end - s->start;
+    fprintf(fp, "%-18s %12.3f %6.1f%%\n", s->name, t / 1e6,
+            total > 0 ? 100.0 * t / total : 0.0);
+  }
+  fprintf(fp, "%-18s %12.3f\n", "total", total / 1e6);
+  pthread_mutex_unlock(&spans_lock);
+}
+
+static void write_json_string(FILE *fp, char *s) {
+  fputc('"', fp);
+  for (; *s != '\0'; s++) {
+    if (*s == '"' || *s == '\\')
+      fputc('\\', fp);
+    if ((unsigned char)*s < 0x20)
+      fprintf(fp, "\\u%04x", *s);
+    else
+      fputc(*s, fp);
+  }
+  fputc('"', fp);
+}
+
+// writes the spans recorded so far to path and forgets them.
+void time_trace_write(char *path) {
+  FILE *fp = fopen(path, "w");
+  if (fp == NULL)
+    error(allocate_concat_3string("cannot open '", path, "'"));
+  pthread_mutex_lock(&spans_lock);
+  long origin = num_spans > 0 ? spans[0].start : 0;
+  for (int i = 0; i < num_spans; i++)
+    if (spans[i].start < origin)
+      origin = spans[i].start;
+  fprintf(fp, "{\"traceEvents\":[\n");
+  for (int i = 0; i < num_spans; i++) {
+    Span *s = &spans[i];
+    fprintf(fp, "{\"name\":");
+    write_json_string(fp, s->detail != NULL ? s->detail : s->name);
+    fprintf(fp, ",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,",
+            s->detail != NULL ? s->name : "phase", (s->start - origin) / 1e3,
+            (s->end - s->start) / 1e3);
+    fprintf(fp, "\"pid\":1,\"tid\":%d,\"args\":{\"file\":", s->tid);
+    write_json_string(fp, s->file);
+    fprintf(fp, "}}%s\n", i + 1 < num_spans ? "," : "");
+  }
+  fprintf(fp, "]}\n");
+  num_spans = 0;
+  pthread_mutex_unlock(&spans_lock);
+  fclose(fp);
+}
+
+// forgets the spans recorded so far.
+void time_reset(void) {
+  pthread_mutex_lock(&spans_lock);
+  num_spans = 0;
+  pthread_mutex_unlock(&spans_lock);
+}
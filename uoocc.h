@@ -1,27 +1,119 @@
+#include <setjmp.h>
+#include <stdatomic.h>
 #include <stdio.h>
 
+// arena.c
+#define ARENA_BLOCK_SIZE (64 * 1024)
+#define ARENA_ALIGN 8
+#define ARENA_MAX_POOLED_SIZE 256
+
+typedef struct _ArenaBlock {
+  struct _ArenaBlock *next;
+  struct _ArenaBlock *prev;
+} ArenaBlock;
+
+// what the memory is for, counted per arena
+enum {
+  MEM_TOKEN,
+  MEM_AST,
+  MEM_CTYPE,
+  MEM_STRING,
+  MEM_MAP,
+  MEM_VECTOR,
+  MEM_SYMBOL,
+  MEM_OTHER,  // arena_alloc
+  NUM_MEM_TAGS,
+};
+
+typedef struct {
+  long num_allocs;
+  long num_bytes;
+  long live_bytes;  // allocated and not freed yet
+  long peak_bytes;
+} MemTagStats;
+
+typedef struct {
+  char *name;
+  ArenaBlock *blocks;  // bump allocation blocks
+  ArenaBlock *large;   // dedicated blocks for big allocations
+  ArenaBlock *spare;   // blocks kept by arena_recycle for reuse
+  char *ptr;
+  char *end;
+  void *pool[ARENA_MAX_POOLED_SIZE / ARENA_ALIGN];  // free list per size class
+  long num_allocs;
+  long num_bytes;
+  long num_reused;
+  long reserved_bytes;
+  MemTagStats tags[NUM_MEM_TAGS];
+  int persistent;  // kept by arena_release_all
+} Arena;
+
+#define NUM_THREAD_ARENAS 4
+
+extern _Thread_local Arena token_arena;
+extern _Thread_local Arena ast_arena;
+extern _Thread_local Arena table_arena;
+extern _Thread_local Arena string_arena;
+extern Arena intern_arena;
+extern Arena header_arena;
+
+void *arena_alloc(Arena *, int);
+void arena_free(Arena *, void *, int);
+void *arena_realloc(Arena *, void *, int, int);
+void *arena_alloc_tagged(Arena *, int, int);
+void arena_free_tagged(Arena *, int, void *, int);
+void *arena_realloc_tagged(Arena *, int, void *, int, int);
+char *arena_strndup(Arena *, char *, int);
+void arena_release(Arena *);
+void arena_recycle(Arena *);
+void arena_release_all(void);
+void arena_recycle_all(void);
+void arena_print_stats(FILE *);
+void arena_save_thread(Arena *);
+void arena_adopt_thread(Arena *);
+
+// intern.c
+#define INTERN_INITIAL_CAPACITY 1024
+
+#define DIGEST_INIT 14695981039346656037ul
+
+unsigned int hash_string_n(char *, int);
+unsigned long digest_n(unsigned long, char *, int);
+char *intern_string_n(char *, int);
+char *intern_string(char *);
+unsigned int intern_hash(char *);
+int intern_id(char *);
+char *intern_name(int);
+
 // vector.c
+#define VECTOR_INLINE_SIZE 4
+
 typedef struct {
-  void **data;
+  void **data;  // points to inline_data until the vector outgrows it
   int size;
   int reserved_size;
+  void *inline_data[VECTOR_INLINE_SIZE];
 } Vector;
 
-#define VECTOR_BLOCK_SIZE 16
-
 Vector *vector_new(void);
 int vector_push_back(Vector *, void *);
 void *vector_at(Vector *, int);
 
 // map.c
+#define MAP_INITIAL_CAPACITY 16
+
+// keys must be interned by intern_string, they are compared by pointer.
 typedef struct {
   char *key;
   void *val;
+  unsigned int hash;
 } MapEntry;
 
 typedef struct _Map {
-  Vector *vec;
+  Vector *vec;  // entries in insertion order
   int size;
+  int *slots;  // open addressing index into vec (+1), 0 means empty
+  int capacity;
   struct _Map *next;
 } Map;
 
@@ -30,13 +122,20 @@ Map *map_new(Map *);
 int map_put(Map *, MapEntry *);
 MapEntry *map_get(Map *, char *);
 
-extern Map *symbol_table;
-extern Map *string_table;
-extern Map *typedef_table;
+extern _Thread_local Map *symbol_table;
 
-// lex.c
-#define MAX_TOKEN_LENGTH 256
+// source.c
+typedef struct {
+  char *buf;
+  long len;
+  char *map;  // mmap'd region when the source is a regular file
+  long map_len;
+} Source;
 
+void source_read(Source *, FILE *);
+void source_release(Source *);
+
+// lex.c
 enum {
   TK_EOF,
   TK_NUM,
@@ -91,36 +190,127 @@ enum {
   TK_MISC,
 };
 
+// tokens are small values, their spelling stays in the source.
 typedef struct {
-  int row;
-  int col;
   int type;
-  char *text;
-  int number;
+  unsigned int offset;  // byte offset in the source
+  unsigned int length;
+  int value;  // number of TK_NUM, intern id of TK_IDENT and TK_STR
 } Token;
 
+// power of two, larger than the lookahead of the parser
+#define TOKEN_RING_SIZE 4
+
+// tokens are lexed on demand into a small ring buffer.
 typedef struct {
-  Vector *vec;
-  int idx;
+  Token ring[TOKEN_RING_SIZE];
+  int idx;    // index of the current token
+  int lexed;  // number of tokens lexed so far
+  char *pos;  // where the lexer resumes
+  char *end;
+  Source source;
+  unsigned int *line_starts;  // built on the first diagnostic
+  int num_lines;
+  int digesting;         // the consumed tokens are hashed into digest
+  unsigned long digest;  // since the last take_token_digest
 } TokenQueue;
 
-extern TokenQueue token_queue;
-
 void init_token_queue(FILE *);
-Token *current_token(void);
-Token *second_token(void);
-Token *third_token(void);
-Token *next_token(void);
+void init_token_queue_source(Source *);
+Token current_token(void);
+Token second_token(void);
+Token third_token(void);
+Token next_token(void);
+char *token_text(Token);
+unsigned long take_token_digest(void);
+void token_position(Token, int *, int *);
+
+// output.c
+#define OUTPUT_BUFFER_SIZE (64 * 1024)
+
+typedef struct {
+  char *buf;
+  int len;
+  int cap;
+  int fd;  // -1 when the output stays in memory
+} Output;
+
+extern _Thread_local Output *asm_output;
+
+void output_init(Output *, int);
+void output_flush(Output *);
+void output_release(Output *);
+void output_write(Output *, char *, int);
+void output_int(Output *, long);
+void emit(char *, ...);
+
+// writes a pre-rendered string literal, no format is parsed.
+#define emit_literal(s) output_write(asm_output, (s), sizeof(s) - 1)
+
+// compile.c
+#define NUM_PEEPHOLE_RULES 4
+
+typedef struct {
+  int mem_report;
+  int preprocess_only;
+  int object;
+  int jobs;          // threads working on one translation unit
+  char *server;      // socket of -fserver=
+  char *cache_dir;   // function cache of -fcache=
+  int cache_report;  // -fcache-report
+  char *pch;         // snapshot of -fpch=
+  int pch_create;    // -fpch-create
+  int time_report;   // -ftime-report
+  char *time_trace;  // trace file of -ftime-trace=
+  int optimize;      // level of -O, registers are allocated from 1
+  int peephole;      // -fpeephole, on from -O1
+  int peephole_report;  // -fpeephole-report
+} Options;
+
+// state of one translation unit. A thread compiles one at a time and
+// parallel_for hands it to its workers.
+typedef struct {
+  char *input;   // NULL for stdin
+  char *output;  // NULL for stdout
+  Options *opts;
+  TokenQueue token_queue;
+  Map *string_table;
+  Map *typedef_table;
+  Output scratch;  // the preprocessed source or the assembly of -c
+  int seq;         // next label number
+  atomic_int cache_hits;
+  atomic_int cache_misses;
+  atomic_long cache_bytes;  // of the functions taken from the cache
+  atomic_long cache_saved;  // nanoseconds of codegen the hits avoided
+  atomic_int peephole_hits[NUM_PEEPHOLE_RULES];
+} Compilation;
+
+extern _Thread_local Compilation *compilation;
+
+void parse_options(int, char **, Options *, Vector *, char **);
+char *default_output(char *, int);
+void read_input(char *, Source *);
+int open_output(char *);
+void compile_source(Compilation *, Source *, Options *, Output *);
+void compilation_release(Compilation *);
+void compile(Compilation *, Options *);
+
+// server.c
+int remote_compile(char *, int, char **, Source *, char *);
+void run_server(char *, int);
 
 // mylib.c
 char *allocate_string(char *);
 char *allocate_concat_2string(char *, char *);
 char *allocate_concat_3string(char *, char *, char *);
 int *allocate_integer(int);
+extern _Thread_local jmp_buf *error_return;
+_Noreturn void abort_compilation(void);
 void error(char *);
-void error_with_token(Token *, char *);
-void expect_token(Token *, int);
+void error_with_token(Token, char *);
+void expect_token(Token, int);
 int get_sequence_num(void);
+int reserve_sequence_nums(int);
 
 // parse.c
 enum {
@@ -158,6 +348,7 @@ enum {
   AST_SUBSCRIPT,
   AST_DECL_LOCAL_VAR,
   AST_DECL_GLOBAL_VAR,
+  AST_DECL_TYPEDEF,
   AST_CALL_FUNC,
   AST_DECL_FUNC,
   AST_COMPOUND_STATEMENT,
@@ -204,6 +395,7 @@ typedef struct {
   int constant_value;
   int is_struct_tag;
   char *ident;
+  int decl_order;  // index of the top level declaration which made it
 } SymbolTableEntry;
 
 typedef struct _Ast {
@@ -211,12 +403,13 @@ typedef struct _Ast {
   CType *ctype;
   int ival;
   int label;
+  unsigned long digest;  // of a function and what it sees, the cache key
   char *ident;
   Vector *args;
   Vector *statements;
   Map *symbol_table;
   int offset_from_bp;
-  Token *token;
+  Token token;
   SymbolTableEntry *symbol_table_entry;
   struct _Ast *left;
   struct _Ast *right;
@@ -228,14 +421,102 @@ typedef struct _Ast {
 } Ast;
 
 CType *make_ctype(int, CType *);
-Ast *make_ast_op(int, Ast *, Ast *, Token *);
+Ast *make_ast_op(int, Ast *, Ast *, Token);
 Ast *make_ast_int(int);
 Vector *program(void);
 
 // analyze.c
 Ast *semantic_analysis(Ast *);
+void analyze_program(Vector *, int);
 int sizeof_ctype(CType *);
 
+// preprocess.c
+void pp_add_include_path(char *);
+void pp_define(char *);
+void pp_undef(char *);
+void pp_reset_options(void);
+int preprocess_needed(Source *);
+void preprocess(Source *, char *, Output *);
+
+// assemble.c
+void assemble(char *, int, Output *);
+
+// cache.c
+unsigned long compiler_id(void);
+int cache_load(unsigned long, int, Output *);
+void cache_store(unsigned long, int, char *, int, long);
+
+// timer.c
+long time_now(void);
+void time_phase(char *, long);
+void time_function(char *, char *, long);
+void time_report(FILE *);
+void time_trace_write(char *);
+void time_reset(void);
+
+// pch.c
+void write_snapshot(Vector *, Output *);
+Vector *adopt_snapshot(char *);
+
+// regalloc.c
+enum {
+  IR_IMM,           // dst = imm
+  IR_LABEL_ADDR,    // dst = address of .L<imm>
+  IR_LOCAL_ADDR,    // dst = address of imm(%rbp)
+  IR_GLOBAL_ADDR,   // dst = address of sym
+  IR_LOAD,          // dst = size bytes at src + imm, sign extended
+  IR_LOAD_LOCAL,    // dst = size bytes at imm(%rbp)
+  IR_LOAD_GLOBAL,   // dst = size bytes at sym
+  IR_STORE,         // size bytes at dst + imm = src
+  IR_STORE_LOCAL,   // size bytes at imm(%rbp) = src
+  IR_STORE_GLOBAL,  // size bytes at sym = src
+  IR_ADD,           // dst = dst op src, or op imm when src is absent
+  IR_SUB,
+  IR_AND,
+  IR_OR,
+  IR_XOR,
+  IR_SHL,
+  IR_SAR,
+  IR_MUL,
+  IR_DIV,
+  IR_NOT,  // dst = ~dst
+  IR_SET,  // dst = dst <sym> src, sym a condition code like l or ne
+  IR_INC,  // the int at src + imm is incremented
+  IR_DEC,
+  IR_CALL,    // dst = sym(args)
+  IR_LABEL,   // .L<label>:
+  IR_JMP,     // jumps to .L<label>
+  IR_BRANCH,  // jumps to .L<label> when dst <sym> src
+};
+
+typedef struct {
+  int op;
+  int dst;  // virtual registers, -1 when absent
+  int src;
+  int imm;
+  int size;  // of a memory access
+  char *sym;
+  int label;
+  int *args;
+  int num_args;
+} Ins;
+
+void ir_begin_function(int);
+int ir_new_reg(void);
+Ins *ir_add(int, int, int);
+void ir_flush(int);
+int ir_frame_size(void);
+void ir_save_registers(void);
+void ir_restore_registers(void);
+
+// peephole.c
+void peephole(char *, int, Output *);
+void peephole_report(FILE *);
+
 // gen.c
 void emit_string(void);
 void codegen(Ast *);
+void codegen_program(Vector *, int);
+
+// pool.c
+void parallel_for(int, int, void (*)(int, void *), void *);
@@ -1,30 +1,33 @@
-#include <stdlib.h>
+#include <string.h>
 #include "uoocc.h"
 
 static int vector_realloc(Vector *v, int new_size) {
-  void **p = realloc(v->data, new_size * sizeof(void *));
-  if (p == NULL)
-    return 0;
+  void **p;
+  if (v->data == v->inline_data) {
+    p = arena_alloc_tagged(&table_arena, MEM_VECTOR, new_size * sizeof(void *));
+    memcpy(p, v->data, v->size * sizeof(void *));
+  } else {
+    p = arena_realloc_tagged(&table_arena, MEM_VECTOR, v->data,
+                             v->reserved_size * sizeof(void *),
+                             new_size * sizeof(void *));
+  }
   v->data = p;
   v->reserved_size = new_size;
   return 1;
 }
 
 Vector *vector_new(void) {
-  Vector *v = (Vector *)malloc(sizeof(Vector));
-  if (v == NULL)
-    return NULL;
+  Vector *v =
+      (Vector *)arena_alloc_tagged(&table_arena, MEM_VECTOR, sizeof(Vector));
   v->size = 0;
-  v->reserved_size = VECTOR_BLOCK_SIZE;
-  v->data = (void **)malloc(v->reserved_size * sizeof(void *));
-  if (v->data == NULL)
-    return NULL;
+  v->reserved_size = VECTOR_INLINE_SIZE;
+  v->data = v->inline_data;
   return v;
 }
 
 int vector_push_back(Vector *v, void *data) {
   if (v->reserved_size <= v->size) {
-    int res = vector_realloc(v, v->reserved_size + VECTOR_BLOCK_SIZE);
+    int res = vector_realloc(v, v->reserved_size * 2);
     if (res == 0)
       return 0;
   }